@@ -34,3 +34,6 @@ XPU_D void sort<items_per_thread>::operator()(context &ctx, float *a, size_t N,
     size_t offset = items_per_block * pos.block_idx_x();
     dst[pos.block_idx_x()] = sort_t(pos, ctx.smem()).sort(&a[offset], items_per_block, &buf[offset], [](float x) { return x; });
 }
+
+XPU_EXPORT(empty_kernel);
+XPU_D void empty_kernel::operator()(context &, int *) {}
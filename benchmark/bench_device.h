@@ -37,4 +37,12 @@ struct sort : xpu::kernel<bench_device> {
     XPU_D void operator()(context &, float *a, size_t N, float *b, float **c);
 };
 
+// Does nothing. Used to measure the launch overhead.
+// A single thread, so the time to run the block doesn't add to the measurement.
+struct empty_kernel : xpu::kernel<bench_device> {
+    using block_size = xpu::block_size<1>;
+    using context = xpu::kernel_context<xpu::no_smem>;
+    XPU_D void operator()(context &, int *);
+};
+
 #endif
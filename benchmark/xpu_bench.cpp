@@ -3,6 +3,7 @@
 #include <xpu/host.h>
 
 #include <algorithm>
+#include <chrono>
 #include <iomanip>
 #include <memory>
 #include <random>
@@ -163,7 +164,7 @@ public:
     }
 
     size_t bytes() { return elems_per_block * n_blocks * 2 * sizeof(float); }
-    std::vector<double> timings() { return m_timings.kernel<Kernel>().times(); }
+    std::vector<double> timings() { return {m_timings.kernel<Kernel>().total()}; }
 
 };
 
@@ -214,13 +215,97 @@ public:
     }
 
     size_t bytes() { return elems_per_block * n_blocks * sizeof(float); }
-    std::vector<double> timings() { return m_timings.kernel<Kernel>().times(); }
+    std::vector<double> timings() { return {m_timings.kernel<Kernel>().total()}; }
 
 };
 
 template<typename T>
 constexpr size_t sort_bench<T>::elems_per_block;
 
+// Merges a stream of chunks, including the transfers from and to host memory.
+// With depth 1 every chunk is uploaded, merged and downloaded in turn, as in merge_bench.
+// Larger depths overlap the transfers of one chunk with the kernel of another.
+// Runs with profiling paused, as profiled copies and launches wait until they're done,
+// which would serialize the pipeline. Times are measured around the whole run instead.
+class merge_stream_bench : public benchmark {
+
+private:
+    using kernel = merge<4>;
+
+    static constexpr size_t elems_per_block = 32 * 32 * 50;
+    static constexpr size_t blocks_per_chunk = 16;
+    static constexpr size_t chunk_size = elems_per_block * blocks_per_chunk;
+    static constexpr size_t n_chunks = 16;
+    static constexpr size_t buf_size = chunk_size * n_chunks;
+
+    size_t m_depth;
+    std::vector<float> a;
+    std::vector<float> b;
+    std::vector<float> c;
+    std::vector<double> m_times;
+
+public:
+    explicit merge_stream_bench(size_t depth) : m_depth(depth) {}
+
+    std::string name() { return "merge_stream (depth " + std::to_string(m_depth) + ")"; }
+
+    void setup() {
+        std::mt19937 gen{42};
+        std::uniform_real_distribution<float> dist{0, 1};
+
+        float partial_sum = 0.f;
+        auto rand_partial_sum = [&](){ partial_sum += dist(gen); return partial_sum; };
+
+        a.resize(buf_size);
+        std::generate(a.begin(), a.end(), rand_partial_sum);
+        partial_sum = 0.f;
+        b.resize(buf_size);
+        std::generate(b.begin(), b.end(), rand_partial_sum);
+        c.resize(buf_size * 2);
+    }
+
+    void teardown() {
+        a.clear();
+        b.clear();
+        c.clear();
+    }
+
+    void run() {
+        // Both inputs of a chunk share one input buffer.
+        xpu::stream_pipeline<float, float> pipeline{chunk_size * 2, chunk_size * 2, m_depth};
+
+        size_t next = 0;
+        size_t done = 0;
+        auto source = [&](xpu::h_view<float> in) -> size_t {
+            if (next == n_chunks) {
+                return 0;
+            }
+            std::copy_n(&a[next * chunk_size], chunk_size, in.begin());
+            std::copy_n(&b[next * chunk_size], chunk_size, in.begin() + chunk_size);
+            next++;
+            return chunk_size * 2;
+        };
+        auto compute = [](xpu::queue &q, xpu::buffer<float> in, xpu::buffer<float> out, size_t) {
+            q.launch<kernel>(xpu::n_blocks(blocks_per_chunk), in.get(), in.get() + chunk_size, elems_per_block, out.get());
+        };
+        auto sink = [&](xpu::h_view<const float> out, size_t) {
+            std::copy(out.begin(), out.end(), &c[done * chunk_size * 2]);
+            done++;
+        };
+
+        xpu::scoped_profiling_pause no_profiling;
+
+        auto start = std::chrono::steady_clock::now();
+        pipeline.run(source, compute, sink);
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        m_times.push_back(elapsed.count());
+    }
+
+    size_t bytes() { return buf_size * 2 * sizeof(float); }
+    std::vector<double> timings() { return m_times; }
+
+};
+
 int main() {
     setenv("XPU_PROFILE", "1", 1); // always enable profiling in benchmark
 
@@ -252,6 +337,10 @@ int main() {
         runner.add(new merge_bench<merge<64>>{});
     }
 
+
+    runner.add(new merge_stream_bench{1});
+    runner.add(new merge_stream_bench{3});
+
     runner.run(10);
 
     return 0;
@@ -0,0 +1,72 @@
+// Measures the host side overhead of launching a kernel.
+// Profiling is left disabled, as it adds timer calls to every launch.
+#include "bench_device.h"
+
+#include <xpu/host.h>
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+static constexpr int n_launches = 1000000;
+static constexpr int n_repeats = 10;
+
+// finish() is called after every batch of launches, so asynchronous launches are included in the time.
+// launch() may issue several kernel launches at once, given by 'batch'.
+template<typename Launch, typename Finish>
+static void run(const std::string &name, Launch &&launch, Finish &&finish, int batch = 1) {
+    using clock = std::chrono::steady_clock;
+
+    launch(); // warmup, loads the image
+    finish();
+
+    std::vector<double> ns_per_launch;
+    for (int r = 0; r < n_repeats; r++) {
+        auto start = clock::now();
+        for (int i = 0; i < n_launches; i += batch) {
+            launch();
+        }
+        finish();
+        std::chrono::duration<double, std::nano> elapsed = clock::now() - start;
+        ns_per_launch.push_back(elapsed.count() / n_launches);
+    }
+    std::sort(ns_per_launch.begin(), ns_per_launch.end());
+
+    std::cout << std::left << std::setw(25) << name << std::fixed << std::setprecision(1)
+        << "min " << ns_per_launch.front() << "ns, median " << ns_per_launch[ns_per_launch.size() / 2] << "ns per launch" << std::endl;
+}
+
+int main() {
+    xpu::initialize();
+
+    xpu::device_prop prop{xpu::device::active()};
+    std::cout << "Launching empty kernel on " << prop.name() << std::endl;
+
+    run("run_kernel", [] { xpu::run_kernel<empty_kernel>(xpu::n_threads(1), nullptr); }, [] {});
+
+    xpu::queue q;
+    run("queue::launch", [&] { q.launch<empty_kernel>(xpu::n_threads(1), nullptr); }, [&] { q.wait(); });
+
+    // Launch many instances at once. Times are per instance.
+    // Only batched on the CPU. Elsewhere it's a loop over queue::launch, which is measured above.
+    if (xpu::device::active().backend() == xpu::cpu) {
+        constexpr int batch_size = 100;
+        std::vector<xpu::grid> grids(batch_size, xpu::n_threads(1));
+        std::vector<xpu::kernel_args<empty_kernel>> args(batch_size, {nullptr});
+        run("queue::launch_batch", [&] { q.launch_batch<empty_kernel>(grids, args); }, [&] { q.wait(); }, batch_size);
+    }
+
+    // Replay a graph of launches. Times are per recorded launch.
+    constexpr int graph_size = 40;
+    q.begin_capture();
+    for (int i = 0; i < graph_size; i++) {
+        q.launch<empty_kernel>(xpu::n_threads(1), nullptr);
+    }
+    xpu::graph g = q.end_capture();
+    run("graph::launch", [&] { g.launch(q); }, [&] { q.wait(); }, graph_size);
+
+    return 0;
+}
@@ -55,11 +55,20 @@ struct grid {
     dim nblocks;
     dim nthreads;
 
-    inline void get_compute_grid(dim &block_dim, dim &grid_dim) const;
+    /**
+     * True for grids created with 'persistent_blocks'.
+     */
+    bool persistent() const { return m_persistent; }
+
+    // resident_blocks: Number of blocks that fit onto the device at once. Used for persistent grids.
+    inline void get_compute_grid(dim &block_dim, dim &grid_dim, int resident_blocks = 1) const;
 
 private:
+    bool m_persistent = false;
+
     friend inline grid n_blocks(dim);
     friend inline grid n_threads(dim);
+    friend inline grid persistent_blocks();
     grid(dim b, dim t);
 
 };
@@ -76,14 +85,29 @@ inline grid n_blocks(dim nblocks);
  */
 inline grid n_threads(dim nthreads);
 
+/**
+ * @brief Construct a 1d grid with as many blocks as the device can run at the same time.
+ * For persistent kernels that loop until their work is done, e.g. by popping from an xpu::work_queue.
+ * On the CPU, this is one block per worker thread.
+ */
+inline grid persistent_blocks();
+
 enum buffer_type {
     buf_host = detail::buf_host,
     buf_device = detail::buf_device,
     buf_shared = detail::buf_shared,
     buf_io = detail::buf_io,
     buf_stack = detail::buf_stack,
+    buf_mmap = detail::buf_mmap,
 };
 
+enum mmap_mode {
+    mmap_read_only,
+    mmap_copy_on_write,
+};
+
+class device;
+
 template<typename T>
 class buffer {
 
@@ -121,12 +145,43 @@ public:
      *     Allocates a buffer in the stack on the device. The buffer is not accessible from the host.
      *     Memory is not initialized and 'data' pointer has no effect.
      *     The stack memory must be allocated beforehand using xpu::stack_alloc.
+     *     If the calling thread selected a xpu::stack_arena, the buffer is taken from that arena instead.
      *     Note that, no additional allocation takes place. The buffer simply points to the stack memory.
      *     The buffer is not freed automatically when it goes out of scope. Instead use xpu::stack_pop to reset the stack head.
      *     Note: This also means stack buffers may overlap.
+     * - buf_mmap:
+     *     Can't be allocated with this constructor, see below.
      */
     buffer(size_t N, buffer_type type, T *data = nullptr);
 
+    /**
+     * @brief Create a buffer with the given size on the given device.
+     * Same as above, but memory is allocated on 'dev' instead of the active device.
+     * Stack buffers are taken from the stack of 'dev'.
+     */
+    buffer(size_t N, buffer_type type, device dev, T *data = nullptr);
+
+    /**
+     * @brief Create a buffer of type buf_mmap from a file.
+     * @param path File to map.
+     * @param offset Offset into the file in bytes. Does not need to be page aligned.
+     * @param N Number of elements to map.
+     * @param mode Whether the mapping may be written.
+     *
+     * Maps the file region into host memory instead of reading it. Pages are loaded
+     * from the page cache when touched, with read-ahead hints for sequential access.
+     * With mmap_copy_on_write, writes go to private copies of the pages and never reach the file.
+     *
+     * The buffer behaves like buf_io with the mapping as host pointer:
+     * On the CPU, kernels access the mapping directly and xpu::copy is a no-op.
+     * Other devices allocate device memory and data is transfered with xpu::copy(buf, xpu::h2d).
+     * If the driver supports it, the mapping is page-locked on the first copy and stays locked until the buffer is freed.
+     * Copies back to the file (xpu::d2h) are not supported.
+     *
+     * Throws std::runtime_error if the file can't be mapped or is too short.
+     */
+    buffer(const char *path, size_t offset, size_t N, mmap_mode mode = mmap_read_only);
+
     /**
      * @brief Free the buffer.
      */
@@ -13,15 +13,27 @@ public:
     virtual ~backend_base() {}
 
     virtual error setup() = 0;
-    virtual error malloc_device(void **, size_t) = 0;
-    virtual error malloc_host(void **, size_t) = 0;
-    virtual error malloc_shared(void **, size_t) = 0;
+    virtual error malloc_device(void **, size_t, int) = 0;
+    virtual error malloc_host(void **, size_t, int) = 0;
+    virtual error malloc_shared(void **, size_t, int) = 0;
     virtual error free(void *) = 0;
 
+    // Page-lock existing host memory, e.g. a memory mapped file, for faster transfers.
+    // Optional, drivers may return not_supported.
+    virtual error register_host(void *, size_t, bool read_only) = 0;
+    virtual error unregister_host(void *) = 0;
+
     virtual error create_queue(void **, int) = 0;
     virtual error destroy_queue(void *) = 0;
     virtual error synchronize_queue(void *) = 0;
 
+    virtual error create_event(void **, int) = 0;
+    virtual error destroy_event(void *) = 0;
+    virtual error record_event(void *, void *) = 0;
+    virtual error wait_event(void *, void *) = 0;
+    virtual error synchronize_event(void *) = 0;
+    virtual error event_elapsed_time(double *, void *, void *) = 0;
+
     virtual error memcpy(void *, const void *, size_t) = 0;
     virtual error memcpy_async(void *, const void *, size_t, void *, double *) = 0;
     virtual error memset(void *, int, size_t) = 0;
@@ -36,6 +48,21 @@ public:
 
     virtual error meminfo(size_t *, size_t *) = 0;
 
+    // Device-wide algorithms. Calls block until the algorithm has finished.
+    // Drivers may return not_supported for some arguments, the runtime then
+    // runs the algorithm on the host instead.
+    static constexpr error not_supported = -1;
+
+    virtual error sort_pairs(void *keys, void *values, size_t n, sort_key_t, size_t value_size) = 0;
+
+    // Native graphs. Commands issued on a capturing queue are recorded instead of executed.
+    // Drivers without graph support return not_supported from begin_capture,
+    // the runtime then replays the recorded commands itself.
+    virtual error begin_capture(void *queue) = 0;
+    virtual error end_capture(void *queue, void **graph) = 0;
+    virtual error launch_graph(void *graph, void *queue) = 0;
+    virtual error destroy_graph(void *graph) = 0;
+
     virtual const char *error_to_string(error) = 0;
 
     virtual driver_t get_type() = 0;
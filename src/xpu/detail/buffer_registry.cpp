@@ -2,6 +2,15 @@
 #include "runtime.h"
 #include "../host.h"
 
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 using namespace xpu::detail;
 
 buffer_registry &buffer_registry::instance() {
@@ -10,43 +19,48 @@ buffer_registry &buffer_registry::instance() {
 }
 
 void *buffer_registry::create(size_t size, buffer_type type, void *host_ptr) {
+    return create(size, type, host_ptr, runtime::instance().active_device());
+}
+
+void *buffer_registry::create(size_t size, buffer_type type, void *host_ptr, device dev) {
+    runtime &rt = runtime::instance();
     void *ptr = nullptr;
     bool owns_host_ptr = false;
     switch (type) {
     case buf_host:
-        ptr = xpu::malloc_host(size);
+        ptr = rt.malloc_host(size, dev);
         if (host_ptr != nullptr) {
             std::memcpy(ptr, host_ptr, size);
         }
         host_ptr = ptr;
         break;
     case buf_device:
-        ptr = xpu::malloc_device(size);
+        ptr = rt.malloc_device(size, dev);
         host_ptr = nullptr;
         break;
     case buf_shared:
-        ptr = xpu::malloc_shared(size);
+        ptr = rt.malloc_shared(size, dev);
         if (host_ptr != nullptr) {
             std::memcpy(ptr, host_ptr, size);
         }
         host_ptr = ptr;
         break;
-    case buf_io: {
+    case buf_io:
         if (host_ptr == nullptr) {
-            host_ptr = xpu::malloc_host(size);
+            host_ptr = rt.malloc_host(size, dev);
             owns_host_ptr = true;
         }
-        xpu::device active_dev = xpu::device::active();
-        if (active_dev.backend() == xpu::cpu) {
+        if (dev.backend == cpu) {
             ptr = host_ptr;
         } else {
-            ptr = xpu::malloc_device(size);
+            ptr = rt.malloc_device(size, dev);
         }
         break;
-    }
     case buf_stack:
-        ptr = stack_push(runtime::instance().active_device(), size);
+        ptr = stack_push(dev, size);
         break;
+    case buf_mmap:
+        throw std::runtime_error("Memory mapped buffers must be created from a file");
     }
 
     if (type != buf_stack) {
@@ -57,90 +71,244 @@ void *buffer_registry::create(size_t size, buffer_type type, void *host_ptr) {
             type,
             size
         };
-
-        m_entries.emplace(ptr, buffer_entry{
-            data,
-            std::make_unique<std::atomic<int>>(1)
-        });
+        insert(data, file_mapping{nullptr, 0, false, cpu, pin_none});
     }
     XPU_LOG("Created buffer: %p", ptr);
     return ptr;
 }
 
+void *buffer_registry::create_mmap(const char *path, size_t offset, size_t size, bool copy_on_write) {
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error(format("Failed to open '%s': %s", path, std::strerror(errno)));
+    }
+
+    struct stat st;
+    if (::fstat(fd, &st) != 0) {
+        int err = errno;
+        ::close(fd);
+        throw std::runtime_error(format("Failed to stat '%s': %s", path, std::strerror(err)));
+    }
+    size_t file_size = static_cast<size_t>(st.st_size);
+    if (size == 0 || offset > file_size || size > file_size - offset) {
+        ::close(fd);
+        throw std::runtime_error(format("Can't map %lu bytes at offset %lu from '%s' with %lu bytes", size, offset, path, file_size));
+    }
+
+    // mmap offsets must be page aligned.
+    size_t page_size = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+    size_t page_offset = offset % page_size;
+    size_t map_size = size + page_offset;
+
+    int prot = (copy_on_write ? PROT_READ | PROT_WRITE : PROT_READ);
+    void *addr = ::mmap(nullptr, map_size, prot, MAP_PRIVATE, fd, static_cast<off_t>(offset - page_offset));
+    int err = errno;
+    // The mapping keeps its own reference to the file.
+    ::close(fd);
+    if (addr == MAP_FAILED) {
+        throw std::runtime_error(format("Failed to map '%s': %s", path, std::strerror(err)));
+    }
+
+    // Input files are usually read front to back once. Start reading ahead right away.
+    // Hints only, so errors are ignored.
+    ::madvise(addr, map_size, MADV_SEQUENTIAL);
+    ::madvise(addr, map_size, MADV_WILLNEED);
+
+    void *host_ptr = static_cast<char *>(addr) + page_offset;
+    void *ptr = host_ptr;
+    driver_t backend = runtime::instance().active_device().backend;
+    if (backend != cpu) {
+        try {
+            ptr = xpu::malloc_device(size);
+        } catch (...) {
+            ::munmap(addr, map_size);
+            throw;
+        }
+    }
+
+    buffer_data data {
+        ptr,
+        host_ptr,
+        false,
+        buf_mmap,
+        size
+    };
+    insert(data, file_mapping{addr, map_size, !copy_on_write, backend, pin_none});
+    XPU_LOG("Mapped %lu bytes from '%s' into buffer: %p", size, path, ptr);
+    return ptr;
+}
+
 void buffer_registry::add_ref(const void *ptr) {
-    auto it = m_entries.find(ptr);
-    if (it == m_entries.end()) {
+    shard &sh = shard_of(ptr);
+    std::lock_guard<std::mutex> lock{sh.mutex};
+    auto it = sh.entries.find(ptr);
+    if (it == sh.entries.end()) {
         return;
     }
     XPU_LOG("Add ref: %p", it->second.data.ptr);
-    (*it->second.ref_count)++;
+    it->second.ref_count++;
 }
 
 void buffer_registry::remove_ref(const void *ptr) {
-    auto it = m_entries.find(ptr);
-    if (it == m_entries.end()) {
-        return;
+    buffer_entry entry;
+    {
+        shard &sh = shard_of(ptr);
+        std::lock_guard<std::mutex> lock{sh.mutex};
+        auto it = sh.entries.find(ptr);
+        if (it == sh.entries.end()) {
+            return;
+        }
+        XPU_LOG("Removing ref: %p", ptr);
+        it->second.ref_count--;
+        if (it->second.ref_count > 0) {
+            return;
+        }
+        entry = it->second;
+        sh.entries.erase(it);
     }
-    XPU_LOG("Removing ref: %p", ptr);
-    (*it->second.ref_count)--;
-    if (*it->second.ref_count == 0) {
-        XPU_LOG("Free buffer: %p", ptr);
-        remove(it);
+    // Free memory outside of the lock, the driver might take a while.
+    XPU_LOG("Free buffer: %p", ptr);
+    release(entry);
+}
+
+void buffer_registry::pin_mapping(const void *ptr) {
+    file_mapping mapping;
+    shard &sh = shard_of(ptr);
+    {
+        std::lock_guard<std::mutex> lock{sh.mutex};
+        auto it = sh.entries.find(ptr);
+        if (it == sh.entries.end() || it->second.data.type != buf_mmap || it->second.mapping.pinned != pin_none) {
+            return;
+        }
+        if (it->second.mapping.backend == cpu) {
+            // Kernels read the mapping directly, nothing to transfer
+            return;
+        }
+        it->second.mapping.pinned = pin_pending;
+        mapping = it->second.mapping;
     }
+
+    // Registering touches and locks every page, so don't block the shard meanwhile.
+    // Concurrent copies of the same buffer simply go through the driver's staging buffers.
+    pin_state result = pin_failed;
+    try {
+        if (runtime::instance().register_host(mapping.backend, mapping.addr, mapping.size, mapping.read_only)) {
+            result = pin_done;
+        }
+    } catch (...) {
+        std::lock_guard<std::mutex> lock{sh.mutex};
+        sh.entries.at(ptr).mapping.pinned = pin_none;
+        throw;
+    }
+
+    std::lock_guard<std::mutex> lock{sh.mutex};
+    sh.entries.at(ptr).mapping.pinned = result;
 }
 
 buffer_data buffer_registry::get(const void *ptr) {
-    auto it = m_entries.find(ptr);
-    if (it != m_entries.end()) {
-        return it->second.data;
-    }
-    // Check if the pointer is in a stack
-    if (!stack_contains(ptr)) {
-        throw std::runtime_error("Buffer not found");
+    {
+        shard &sh = shard_of(ptr);
+        std::lock_guard<std::mutex> lock{sh.mutex};
+        auto it = sh.entries.find(ptr);
+        if (it != sh.entries.end()) {
+            return it->second.data;
+        }
     }
 
-    for (auto &stack : m_stacks) {
-        for (auto &block : stack.second->alloced_blocks) {
-            if (block.first == ptr) {
-                return buffer_data{
-                    const_cast<void *>(ptr),
-                    nullptr,
-                    false,
-                    buf_stack,
-                    block.second
-                };
-            }
+    // Check if the pointer is in a stack
+    std::lock_guard<std::mutex> lock{m_stack_mutex};
+    stack_entry *stack = find_stack(ptr);
+    if (stack != nullptr) {
+        std::lock_guard<std::mutex> stack_lock{stack->mutex};
+        auto &blocks = stack->alloced_blocks;
+        auto block = std::lower_bound(blocks.begin(), blocks.end(), ptr, [](const auto &b, const void *p) { return b.first < p; });
+        if (block != blocks.end() && block->first == ptr) {
+            return buffer_data{
+                const_cast<void *>(ptr),
+                nullptr,
+                false,
+                buf_stack,
+                block->second
+            };
         }
     }
 
-    throw std::runtime_error("Internal error: Couldn't find stack buffer. This should never happen.");
+    throw std::runtime_error("Buffer not found");
 }
 
 void buffer_registry::stack_alloc(device dev, size_t size) {
-    auto it = m_stacks.find(dev.id);
-    if (it != m_stacks.end()) {
-        throw std::runtime_error("Stack already allocated");
+    {
+        // Reserve the slot with an empty placeholder, so concurrent calls for the same device
+        // fail here instead of both creating a stack.
+        std::lock_guard<std::mutex> lock{m_stack_mutex};
+        if (!m_stacks.try_emplace(dev.id, nullptr).second) {
+            throw std::runtime_error("Stack already allocated");
+        }
     }
-    void *ptr = xpu::malloc_device(size);
-    m_stacks.emplace(dev.id, nullptr);
-    m_stacks[dev.id].reset(new stack_entry{
-        ptr,
-        size,
-        std::vector<std::pair<void *, size_t>>{}
-    });
+
+    stack_entry *stack = nullptr;
+    try {
+        stack = stack_create(dev, size);
+    } catch (...) {
+        std::lock_guard<std::mutex> lock{m_stack_mutex};
+        m_stacks.erase(dev.id);
+        throw;
+    }
+
+    std::lock_guard<std::mutex> lock{m_stack_mutex};
+    m_stacks.at(dev.id).reset(stack);
 }
 
 void *buffer_registry::stack_push(device dev, size_t size) {
-    auto it = m_stacks.find(dev.id);
-    if (it == m_stacks.end()) {
-        throw std::runtime_error("Stack not allocated");
+    return stack_push(current_stack(dev), size);
+}
+
+void buffer_registry::stack_pop(device dev, void *ptr) {
+    stack_pop(current_stack(dev), ptr);
+}
+
+bool buffer_registry::stack_contains(const void *ptr) {
+    if (ptr == nullptr) {
+        return false;
     }
-    auto &stack = it->second;
-    void *head = stack->head();
-    // align to 256 bytes
-    head = static_cast<char *>(head) + (stack_alignment - (reinterpret_cast<size_t>(head) % stack_alignment));
 
-    if (static_cast<char *>(head) + size > static_cast<char *>(stack->start) + stack->size) {
+    std::lock_guard<std::mutex> lock{m_stack_mutex};
+    stack_entry *stack = find_stack(ptr);
+    if (stack == nullptr) {
+        return false;
+    }
+    std::lock_guard<std::mutex> stack_lock{stack->mutex};
+    return stack->contains(ptr);
+}
+
+stack_entry *buffer_registry::stack_create(device dev, size_t size) {
+    void *ptr = runtime::instance().malloc_device(size, dev);
+    auto *stack = new stack_entry{dev, ptr, size};
+    std::lock_guard<std::mutex> lock{m_stack_mutex};
+    m_stack_index.emplace(ptr, stack);
+    return stack;
+}
+
+void buffer_registry::stack_destroy(stack_entry *stack) {
+    {
+        std::lock_guard<std::mutex> lock{m_stack_mutex};
+        m_stack_index.erase(stack->start);
+    }
+    if (thread_stack() == stack) {
+        thread_stack() = nullptr;
+    }
+    delete stack;
+}
+
+void *buffer_registry::stack_push(stack_entry *stack, size_t size) {
+    std::lock_guard<std::mutex> lock{stack->mutex};
+    char *head = static_cast<char *>(stack->head());
+    size_t misalignment = reinterpret_cast<size_t>(head) % stack_alignment;
+    if (misalignment != 0) {
+        head += stack_alignment - misalignment;
+    }
+
+    if (head + size > static_cast<char *>(stack->start) + stack->size) {
         throw std::runtime_error("Stack overflow");
     }
 
@@ -149,50 +317,65 @@ void *buffer_registry::stack_push(device dev, size_t size) {
     return head;
 }
 
-void buffer_registry::stack_pop(device dev, void *ptr) {
-    auto it = m_stacks.find(dev.id);
-    if (it == m_stacks.end()) {
-        throw std::runtime_error("Stack not allocated");
-    }
-    auto &stack = it->second;
+void buffer_registry::stack_pop(stack_entry *stack, void *ptr) {
+    std::lock_guard<std::mutex> lock{stack->mutex};
+    auto &blocks = stack->alloced_blocks;
 
     if (ptr == nullptr) {
-        stack->alloced_blocks.clear();
+        blocks.clear();
         return;
     }
 
-    for (auto blocks = stack->alloced_blocks.begin(); blocks != stack->alloced_blocks.end(); blocks++) {
-        if (blocks->first == ptr) {
-            // Erase this block and all blocks after it
-            stack->alloced_blocks.erase(blocks, stack->alloced_blocks.end());
-            return;
-        }
+    auto block = std::lower_bound(blocks.begin(), blocks.end(), ptr, [](const auto &b, const void *p) { return b.first < p; });
+    if (block == blocks.end() || block->first != ptr) {
+        throw std::runtime_error("Stack entry not found");
     }
+    // Erase this block and all blocks after it
+    blocks.erase(block, blocks.end());
+}
 
-    throw std::runtime_error("Stack entry not found");
+stack_entry *&buffer_registry::thread_stack() {
+    static thread_local stack_entry *stack = nullptr;
+    return stack;
 }
 
-bool buffer_registry::stack_contains(const void *ptr) {
-    if (ptr == nullptr) {
-        return false;
+stack_entry *buffer_registry::current_stack(device dev) {
+    stack_entry *stack = thread_stack();
+    if (stack != nullptr && stack->dev.id == dev.id) {
+        return stack;
     }
 
-    for (auto &it : m_stacks) {
-        auto &stack = it.second;
-        if (stack->contains(ptr)) {
-            return true;
-        }
+    std::lock_guard<std::mutex> lock{m_stack_mutex};
+    auto it = m_stacks.find(dev.id);
+    if (it == m_stacks.end() || it->second == nullptr) {
+        throw std::runtime_error("Stack not allocated");
     }
+    return it->second.get();
+}
 
-    return false;
+stack_entry *buffer_registry::find_stack(const void *ptr) {
+    // Last stack starting at or before ptr
+    auto it = m_stack_index.upper_bound(ptr);
+    if (it == m_stack_index.begin()) {
+        return nullptr;
+    }
+    --it;
+    stack_entry *stack = it->second;
+    if (ptr >= static_cast<char *>(stack->start) + stack->size) {
+        return nullptr;
+    }
+    return stack;
+}
+
+stack_entry::stack_entry(device dev_, void *start_, size_t size_) : dev(dev_), start(start_), size(size_) {
 }
 
-buffer_registry::stack_entry::~stack_entry() {
+stack_entry::~stack_entry() {
     XPU_LOG("Freeing stack: %p\n", start);
     xpu::free(start);
 }
 
-void *buffer_registry::stack_entry::head() const {
+void *stack_entry::head() const {
     if (alloced_blocks.empty()) {
         return start;
     } else {
@@ -200,34 +383,51 @@ void *buffer_registry::stack_entry::head() const {
     }
 }
 
-bool buffer_registry::stack_entry::contains(const void *ptr) const {
+bool stack_entry::contains(const void *ptr) const {
     return ptr >= start && ptr < head();
 }
 
-void buffer_registry::remove(buffer_map::iterator it) {
-    if (it == m_entries.end()) {
-        return;
-    }
-    auto &entry = it->second;
-    switch (entry.data.type) {
+buffer_registry::shard &buffer_registry::shard_of(const void *ptr) {
+    // Low bits are mostly zero due to alignment
+    size_t addr = reinterpret_cast<size_t>(ptr);
+    return m_shards[(addr >> 8 ^ addr >> 16) % num_shards];
+}
+
+void buffer_registry::insert(const buffer_data &data, const file_mapping &mapping) {
+    shard &sh = shard_of(data.ptr);
+    std::lock_guard<std::mutex> lock{sh.mutex};
+    sh.entries.emplace(data.ptr, buffer_entry{data, 1, mapping});
+}
+
+void buffer_registry::release(const buffer_entry &entry) {
+    const buffer_data &data = entry.data;
+    switch (data.type) {
     case buf_host:
     case buf_device:
     case buf_shared:
-        xpu::free(entry.data.ptr);
+        xpu::free(data.ptr);
         break;
     case buf_io: {
         xpu::device active_dev = xpu::device::active();
         if (active_dev.backend() != xpu::cpu) {
-            xpu::free(entry.data.ptr);
+            xpu::free(data.ptr);
         }
-        if (entry.data.owns_host_ptr) {
-            xpu::free(entry.data.host_ptr);
+        if (data.owns_host_ptr) {
+            xpu::free(data.host_ptr);
         }
         break;
     }
+    case buf_mmap:
+        if (data.ptr != data.host_ptr) {
+            xpu::free(data.ptr);
+        }
+        if (entry.mapping.pinned == pin_done) {
+            runtime::instance().unregister_host(entry.mapping.backend, entry.mapping.addr);
+        }
+        ::munmap(entry.mapping.addr, entry.mapping.size);
+        break;
     case buf_stack:
-        // stack buffer shouldn't be added to m_entries...
+        // stack buffer shouldn't be added to the registry...
         throw std::runtime_error("Internal error: Tried to free a stack buffer. This should never happen.");
     }
-    m_entries.erase(it);
 }
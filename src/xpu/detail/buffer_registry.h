@@ -3,9 +3,11 @@
 
 #include "common.h"
 
-#include <atomic>
+#include <array>
 #include <cstddef>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <unordered_map>
 #include <vector>
 
@@ -17,6 +19,7 @@ enum buffer_type {
     buf_shared,
     buf_io,
     buf_stack,
+    buf_mmap,
 };
 
 struct buffer_data {
@@ -27,40 +30,93 @@ struct buffer_data {
     size_t size;
 };
 
+struct stack_entry {
+    device dev;
+    void *start;
+    size_t size;
+
+    std::mutex mutex;
+    std::vector<std::pair<void *, size_t>> alloced_blocks; // head, size; sorted by address
+
+    stack_entry(device dev, void *start, size_t size);
+    ~stack_entry();
+    void *head() const;
+    bool contains(const void *ptr) const;
+};
+
 class buffer_registry {
 public:
     static buffer_registry &instance();
 
     void *create(size_t size, buffer_type type, void *host_ptr = nullptr);
+    void *create(size_t size, buffer_type type, void *host_ptr, device dev);
+    void *create_mmap(const char *path, size_t offset, size_t size, bool copy_on_write);
     void add_ref(const void *ptr);
     void remove_ref(const void *ptr);
     buffer_data get(const void *ptr);
 
+    // Page-lock the file mapping of a buf_mmap buffer for transfers to its device.
+    // Done on the first copy instead of at creation, so mappings that are never copied aren't faulted in.
+    void pin_mapping(const void *ptr);
+
+    // Default stack of a device, or the stack arena selected by the calling thread.
     void stack_alloc(device dev, size_t size);
     void *stack_push(device dev, size_t size);
     void stack_pop(device dev, void *ptr);
     bool stack_contains(const void *ptr);
 
+    // Stack arenas
+    stack_entry *stack_create(device dev, size_t size);
+    void stack_destroy(stack_entry *stack);
+    void *stack_push(stack_entry *stack, size_t size);
+    void stack_pop(stack_entry *stack, void *ptr);
+    static stack_entry *&thread_stack();
+
 private:
+    enum pin_state {
+        pin_none,
+        pin_pending, // Another thread is registering the mapping
+        pin_done,
+        pin_failed, // Driver can't page-lock host memory
+    };
+
+    // Mapped file region of a buf_mmap buffer. Starts at a page boundary.
+    struct file_mapping {
+        void *addr;
+        size_t size;
+        bool read_only;
+        driver_t backend; // Backend of the device buffer, the mapping is registered with this driver
+        pin_state pinned;
+    };
+
     struct buffer_entry {
         buffer_data data;
-        std::unique_ptr<std::atomic<int>> ref_count;
+        int ref_count;
+        file_mapping mapping;
     };
     using buffer_map = std::unordered_map<const void *, buffer_entry>;
-    buffer_map m_entries;
 
-    static constexpr size_t stack_alignment = 256;
-    struct stack_entry {
-        void *start;
-        size_t size;
-        std::vector<std::pair<void *, size_t>> alloced_blocks; // head, size
-        ~stack_entry();
-        void *head() const;
-        bool contains(const void *ptr) const;
+    // Buffers are created, copied and released from many host threads (and queue executors).
+    // So entries are spread over several independently locked shards based on their address.
+    static constexpr size_t num_shards = 64;
+    struct alignas(64) shard {
+        std::mutex mutex;
+        buffer_map entries;
     };
-    std::unordered_map<int, std::unique_ptr<stack_entry>> m_stacks; // device id -> stack
+    std::array<shard, num_shards> m_shards;
+
+    std::mutex m_stack_mutex;
+
+    static constexpr size_t stack_alignment = 256;
+    std::unordered_map<int, std::unique_ptr<stack_entry>> m_stacks; // device id -> default stack
+    std::map<const void *, stack_entry *> m_stack_index; // start address -> stack, includes arenas
+
+    stack_entry *current_stack(device dev);
+    stack_entry *find_stack(const void *ptr);
 
-    void remove(buffer_map::iterator it);
+    shard &shard_of(const void *ptr);
+    void insert(const buffer_data &data, const file_mapping &mapping);
+    void release(const buffer_entry &entry);
 };
 
 } // namespace xpu::detail
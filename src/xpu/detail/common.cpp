@@ -1,6 +1,7 @@
 #include "common.h"
 
 #include <algorithm>
+#include <cmath>
 
 const char *xpu::detail::driver_to_str(driver_t d, bool lower) {
     switch (d) {
@@ -30,8 +31,7 @@ void xpu::detail::timings::merge(const timings &other) {
         if (it == kernels.end()) {
             kernels.push_back(k);
         } else {
-            it->times.insert(it->times.end(), k.times.begin(), k.times.end());
-            it->bytes_input += k.bytes_input;
+            it->merge(k);
         }
     }
 
@@ -46,3 +46,72 @@ void xpu::detail::timings::merge(const timings &other) {
         }
     }
 }
+
+void xpu::detail::time_histogram::add(double ms) {
+    min = (count == 0 ? ms : std::min(min, ms));
+    max = (count == 0 ? ms : std::max(max, ms));
+    count++;
+    sum += ms;
+
+    size_t i = bucket_index(static_cast<unsigned long long>(std::max(ms, 0.) * 1e6));
+    if (i >= buckets.size()) {
+        buckets.resize(i + 1, 0);
+    }
+    buckets[i]++;
+}
+
+void xpu::detail::time_histogram::merge(const time_histogram &other) {
+    if (other.count == 0) {
+        return;
+    }
+    min = (count == 0 ? other.min : std::min(min, other.min));
+    max = (count == 0 ? other.max : std::max(max, other.max));
+    count += other.count;
+    sum += other.sum;
+
+    if (other.buckets.size() > buckets.size()) {
+        buckets.resize(other.buckets.size(), 0);
+    }
+    for (size_t i = 0; i < other.buckets.size(); i++) {
+        buckets[i] += other.buckets[i];
+    }
+}
+
+double xpu::detail::time_histogram::percentile(double q) const {
+    if (count == 0) {
+        return 0;
+    }
+    auto rank = static_cast<size_t>(std::ceil(std::clamp(q, 0., 1.) * count));
+    rank = std::max<size_t>(rank, 1);
+    if (rank == count) {
+        return max;
+    }
+
+    size_t seen = 0;
+    for (size_t i = 0; i < buckets.size(); i++) {
+        seen += buckets[i];
+        if (seen >= rank) {
+            return std::clamp(bucket_value(i), min, max);
+        }
+    }
+    return max; // unreachable
+}
+
+size_t xpu::detail::time_histogram::bucket_index(unsigned long long ns) {
+    ns = std::min(ns, (1ull << max_bits) - 1);
+    if (ns < sub_buckets) {
+        return ns;
+    }
+    int shift = 63 - __builtin_clzll(ns) - sub_bucket_bits;
+    return (shift + 1) * sub_buckets + ((ns >> shift) - sub_buckets);
+}
+
+double xpu::detail::time_histogram::bucket_value(size_t index) {
+    if (index < sub_buckets) {
+        return index * 1e-6;
+    }
+    int shift = static_cast<int>(index / sub_buckets) - 1;
+    unsigned long long lo = (sub_buckets + index % sub_buckets) << shift;
+    unsigned long long width = 1ull << shift;
+    return (lo + (width - 1) / 2.) * 1e-6;
+}
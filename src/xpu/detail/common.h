@@ -4,6 +4,7 @@
 #include <array>
 #include <memory>
 #include <string>
+#include <tuple>
 #include <type_traits>
 #include <vector>
 
@@ -51,6 +52,12 @@ template<typename T> inline constexpr bool is_kernel_v = is_kernel<T>::value;
 template<typename I, typename T> struct is_image_kernel : std::bool_constant<is_kernel_v<T> && std::is_same_v<typename T::image, I>> {};
 template<typename I, typename T> inline constexpr bool is_image_kernel_v = is_image_kernel<I, T>::value;
 
+// Arguments of a kernel (without the context), stored by value.
+template<typename> struct kernel_args {};
+template<typename K, typename Context, typename... Args>
+struct kernel_args<void(K::*)(Context &, Args...)> { using type = std::tuple<std::decay_t<Args>...>; };
+template<typename K> using kernel_args_t = typename kernel_args<decltype(&K::operator())>::type;
+
 enum mem_type {
     mem_host,
     mem_device,
@@ -67,6 +74,29 @@ enum driver_t {
 constexpr inline size_t num_drivers = 4;
 const char *driver_to_str(driver_t, bool lower = false);
 
+// Key types supported by device-wide sorts.
+enum sort_key_t {
+    sort_key_int32,
+    sort_key_uint32,
+    sort_key_int64,
+    sort_key_uint64,
+    sort_key_float,
+    sort_key_double,
+};
+
+template<typename T>
+constexpr sort_key_t sort_key_type() {
+    static_assert(std::is_arithmetic_v<T> && (sizeof(T) == 4 || sizeof(T) == 8),
+        "Sort keys must be 32 or 64 bit integers, float or double");
+    if constexpr (std::is_floating_point_v<T>) {
+        return sizeof(T) == 4 ? sort_key_float : sort_key_double;
+    } else if constexpr (std::is_signed_v<T>) {
+        return sizeof(T) == 4 ? sort_key_int32 : sort_key_int64;
+    } else {
+        return sizeof(T) == 4 ? sort_key_uint32 : sort_key_uint64;
+    }
+}
+
 enum direction_t {
     dir_h2d,
     dir_d2h,
@@ -105,6 +135,18 @@ struct ptr_prop {
     void *ptr;
 };
 
+struct stack_entry;
+struct graph_impl;
+
+// Control words of an xpu::work_queue, stored in front of the ready flag of each slot.
+enum work_queue_counter {
+    wq_head,
+    wq_tail,
+    wq_pending,
+    wq_overflow,
+    wq_num_counters,
+};
+
 struct queue_handle {
     queue_handle();
     queue_handle(device dev);
@@ -117,16 +159,109 @@ struct queue_handle {
 
     void *handle;
     device dev;
+
+    // Graph that commands are recorded into, while the queue is capturing.
+    std::shared_ptr<graph_impl> capture;
+};
+
+struct event_handle {
+    event_handle(device dev);
+    ~event_handle();
+
+    event_handle(const event_handle &) = delete;
+    event_handle &operator=(const event_handle &) = delete;
+    event_handle(event_handle &&) = delete;
+    event_handle &operator=(event_handle &&) = delete;
+
+    void *handle;
+    device dev;
+};
+
+/**
+ * Log-linear histogram of times, similar to HdrHistogram.
+ * Times are counted in nanoseconds. Each power of two is split into 32 buckets,
+ * so percentiles are accurate to about 3%. Times above ~18 minutes go into the last bucket.
+ * Buckets are only allocated up to the largest time seen, at most 9 KB.
+ */
+struct time_histogram {
+    static constexpr int sub_bucket_bits = 5;
+    static constexpr size_t sub_buckets = size_t{1} << sub_bucket_bits;
+    static constexpr int max_bits = 40;
+    static constexpr size_t max_buckets = (max_bits - sub_bucket_bits + 1) * sub_buckets;
+
+    size_t count = 0;
+    double sum = 0; // [ms]
+    double min = 0; // [ms]
+    double max = 0; // [ms]
+    std::vector<size_t> buckets;
+
+    void add(double ms);
+    void merge(const time_histogram &other);
+
+    // Time at quantile q in [0, 1]. [ms]
+    double percentile(double q) const;
+
+    static size_t bucket_index(unsigned long long ns);
+    static double bucket_value(size_t index); // Midpoint of the bucket [ms]
+};
+
+// Hardware events counted while a kernel ran, summed over all threads. Only collected on the CPU.
+struct kernel_counters {
+    bool valid = false;
+    unsigned long long cycles = 0;
+    unsigned long long instructions = 0;
+    unsigned long long llc_references = 0;
+    unsigned long long llc_misses = 0;
+    unsigned long long branch_misses = 0;
+
+    void add(const kernel_counters &other) {
+        if (not other.valid) {
+            return;
+        }
+        valid = true;
+        cycles += other.cycles;
+        instructions += other.instructions;
+        llc_references += other.llc_references;
+        llc_misses += other.llc_misses;
+        branch_misses += other.branch_misses;
+    }
+
+    // Events counted between 'begin' and 'end', two readings of the same counters.
+    static kernel_counters delta(const kernel_counters &begin, const kernel_counters &end) {
+        kernel_counters d;
+        d.valid = begin.valid && end.valid;
+        d.cycles = end.cycles - begin.cycles;
+        d.instructions = end.instructions - begin.instructions;
+        d.llc_references = end.llc_references - begin.llc_references;
+        d.llc_misses = end.llc_misses - begin.llc_misses;
+        d.branch_misses = end.branch_misses - begin.branch_misses;
+        return d;
+    }
 };
 
 struct kernel_timings {
     std::string_view name; // Fine to make string_view, since kernel names are static
-    std::vector<double> times;
+    time_histogram hist;
+    kernel_counters counters;
+    std::vector<double> times; // Only recorded with config::profile_samples
     size_t bytes_input = 0;
 
     kernel_timings() = default;
     kernel_timings(std::string_view name_) : name(name_) {}
-    kernel_timings(std::string_view name_, double ms) : name(name_) { times.emplace_back(ms); }
+
+    void add(double ms, bool keep_sample) {
+        hist.add(ms);
+        if (keep_sample) {
+            times.emplace_back(ms);
+        }
+    }
+
+    void merge(const kernel_timings &other) {
+        hist.merge(other.hist);
+        counters.add(other.counters);
+        times.insert(times.end(), other.times.begin(), other.times.end());
+        bytes_input += other.bytes_input;
+    }
 };
 
 struct timings {
@@ -2,3 +2,12 @@
 
 bool xpu::detail::config::logging = false;
 bool xpu::detail::config::profile = false;
+thread_local int xpu::detail::config::profile_paused = 0;
+bool xpu::detail::config::profile_samples = false;
+bool xpu::detail::config::perf_counters = false;
+bool xpu::detail::config::trace = false;
+size_t xpu::detail::config::trace_max_events = 1 << 20;
+int xpu::detail::config::cpu_threads = 0;
+size_t xpu::detail::config::cpu_chunk_size = 0;
+bool xpu::detail::config::memory_cache = true;
+size_t xpu::detail::config::memory_cache_limit = 0;
@@ -1,9 +1,23 @@
 #ifndef XPU_DETAIL_SETTINGS_H
 #define XPU_DETAIL_SETTINGS_H
 
+#include <cstddef>
+
 namespace xpu::detail::config {
     extern bool logging;
     extern bool profile;
+    extern thread_local int profile_paused; // Nesting depth of xpu::scoped_profiling_pause on this thread
+    extern bool profile_samples;
+    extern bool perf_counters;
+    extern bool trace;
+    extern size_t trace_max_events;
+    extern int cpu_threads;
+    extern size_t cpu_chunk_size;
+    extern bool memory_cache;
+    extern size_t memory_cache_limit;
+
+    // Whether commands issued by the calling thread are profiled.
+    inline bool profiling() { return profile && profile_paused == 0; }
 } // namespace xpu::detail::settings
 
 #endif // XPU_DETAIL_SETTINGS_H
@@ -2,7 +2,7 @@
 #define XPU_DETAIL_DYNAMIC_LOADER_H
 
 #include "../defines.h"
-#include "platform/cpu/this_thread.h"
+#include "../common.h"
 #include "common.h"
 #include "constant_memory.h"
 #include "backend_base.h"
@@ -27,10 +27,21 @@
 
 namespace xpu::detail {
 
+// Independent instances of a kernel, run by a single launch.
+// args points to 'size' tuples of the kernel arguments (see kernel_args_t).
+struct kernel_batch {
+    const grid *grids;
+    const void *args;
+    size_t size;
+};
+
 struct kernel_launch_info {
     grid g;
     void *queue_handle;
     double *ms;
+    int instance = 0; // Returned by kernel_context::instance_idx()
+    const kernel_batch *batch = nullptr; // If set, g and the kernel arguments are ignored
+    kernel_counters *counters = nullptr; // Hardware counters are collected if set. Only supported by the CPU driver.
 };
 
 // FIXME: member_fn and action_interface belong into type_info.h
@@ -226,9 +237,9 @@ public:
         return m_symbols;
     }
 
-private:
-    template<typename F, typename... Args>
-    int call_action(Args&&... args) {
+    // Resolve the entry point of an action. Stays valid as long as the image is loaded.
+    template<typename F>
+    action_interface_t<F> get_action() {
         size_t id = grouped_type_id<F, typename F::image>::get();
         if (id >= m_symbols.size()) {
             dump_symbols();
@@ -236,8 +247,13 @@ private:
         assert(id < m_symbols.size());
         const auto &symbol = m_symbols.at(id);
         assert(symbol.name == type_name<F>());
-        auto *fn = reinterpret_cast<action_interface_t<F>>(symbol.handle);
-        return fn(std::forward<Args>(args)...);
+        return reinterpret_cast<action_interface_t<F>>(symbol.handle);
+    }
+
+private:
+    template<typename F, typename... Args>
+    int call_action(Args&&... args) {
+        return get_action<F>()(std::forward<Args>(args)...);
     }
 
 };
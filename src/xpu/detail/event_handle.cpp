@@ -0,0 +1,12 @@
+#include "common.h"
+#include "backend.h"
+
+using namespace xpu::detail;
+
+event_handle::event_handle(device dev_) : dev(dev_) {
+    backend::call(dev.backend, &backend_base::create_event, &handle, dev.device_nr);
+}
+
+event_handle::~event_handle() {
+    backend::call(dev.backend, &backend_base::destroy_event, handle);
+}
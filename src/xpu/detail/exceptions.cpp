@@ -8,3 +8,8 @@ void xpu::detail::throw_out_of_range(std::string_view where, size_t i, size_t si
     throw std::out_of_range{format("%.*s: index out of range: i = %zu, size = %zu",
         static_cast<int>(where.size()), where.data(), i, size)};
 }
+
+void xpu::detail::throw_size_mismatch(std::string_view where, size_t expected, size_t size) {
+    throw std::length_error{format("%.*s: size mismatch: expected at least %zu elements, got %zu",
+        static_cast<int>(where.size()), where.data(), expected, size)};
+}
@@ -16,6 +16,7 @@
 namespace xpu::detail {
 
 [[noreturn]] void throw_out_of_range(std::string_view where, size_t i, size_t size);
+[[noreturn]] void throw_size_mismatch(std::string_view where, size_t expected, size_t size);
 
 } // namespace xpu::detail
 
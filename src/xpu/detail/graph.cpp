@@ -0,0 +1,22 @@
+#include "graph.h"
+#include "backend.h"
+
+using namespace xpu::detail;
+
+graph_impl::~graph_impl() {
+    if (native != nullptr) {
+        // Errors are ignored, destructors must not throw.
+        backend::get(dev.backend)->destroy_graph(native);
+    }
+}
+
+void graph_impl::replace(size_t i, std::shared_ptr<const graph_node> node) {
+    auto updated = std::make_shared<node_list>(*nodes);
+    updated->at(i) = std::move(node);
+    nodes = std::move(updated);
+
+    if (native != nullptr) {
+        backend::get(dev.backend)->destroy_graph(native);
+        native = nullptr;
+    }
+}
@@ -0,0 +1,119 @@
+#ifndef XPU_DETAIL_GRAPH_H
+#define XPU_DETAIL_GRAPH_H
+
+#include "backend.h"
+#include "common.h"
+#include "dynamic_loader.h"
+#include "type_info.h"
+
+#include <memory>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+namespace xpu::detail {
+
+/**
+ * Command recorded while a queue is capturing.
+ * Entry points and arguments are resolved when the command is recorded,
+ * so replaying a node is a single call into the driver.
+ */
+class graph_node {
+
+public:
+    virtual ~graph_node() {}
+
+    // Issue the command on a queue of the backend the node was recorded for.
+    virtual error run(void *queue) const = 0;
+
+    // Linear type id of the kernel, if the node launches one.
+    virtual size_t kernel_id() const { return no_kernel; }
+
+    static constexpr size_t no_kernel = static_cast<size_t>(-1);
+};
+
+template<typename Kernel, typename... Args>
+class kernel_node final : public graph_node {
+
+public:
+    kernel_node(action_interface_t<Kernel> fn, grid g, Args... args)
+        : m_fn(fn), m_grid(g), m_args(std::move(args)...) {}
+
+    error run(void *queue) const override {
+        return std::apply([&](const Args &... args) {
+            return m_fn(kernel_launch_info{.g = m_grid, .queue_handle = queue, .ms = nullptr}, args...);
+        }, m_args);
+    }
+
+    size_t kernel_id() const override { return linear_type_id<Kernel>::get(); }
+
+private:
+    action_interface_t<Kernel> m_fn;
+    grid m_grid;
+    std::tuple<Args...> m_args;
+};
+
+class copy_node final : public graph_node {
+
+public:
+    copy_node(backend_base *b, const void *from, void *to, size_t size)
+        : m_backend(b), m_from(from), m_to(to), m_size(size) {}
+
+    error run(void *queue) const override {
+        return m_backend->memcpy_async(m_to, m_from, m_size, queue, nullptr);
+    }
+
+private:
+    backend_base *m_backend;
+    const void *m_from;
+    void *m_to;
+    size_t m_size;
+};
+
+class memset_node final : public graph_node {
+
+public:
+    memset_node(backend_base *b, void *dst, int value, size_t size)
+        : m_backend(b), m_dst(dst), m_value(value), m_size(size) {}
+
+    error run(void *queue) const override {
+        return m_backend->memset_async(m_dst, m_value, m_size, queue, nullptr);
+    }
+
+private:
+    backend_base *m_backend;
+    void *m_dst;
+    int m_value;
+    size_t m_size;
+};
+
+struct graph_impl {
+    // Nodes are never modified after they were recorded. Updates replace the list instead,
+    // so launches still pending on a queue keep their own copy.
+    using node_list = std::vector<std::shared_ptr<const graph_node>>;
+
+    explicit graph_impl(device dev_) : dev(dev_), nodes(std::make_shared<node_list>()) {}
+    ~graph_impl();
+
+    graph_impl(const graph_impl &) = delete;
+    graph_impl &operator=(const graph_impl &) = delete;
+
+    device dev;
+    std::shared_ptr<node_list> nodes;
+
+    // Graph instantiated by the backend (CUDA / HIP graphs).
+    // Recreated on the next launch after an update.
+    void *native = nullptr;
+    bool native_supported = true;
+
+    template<typename Node, typename... Args>
+    void add(Args&&... args) {
+        nodes->emplace_back(std::make_shared<const Node>(std::forward<Args>(args)...));
+    }
+
+    void replace(size_t i, std::shared_ptr<const graph_node> node);
+};
+
+} // namespace xpu::detail
+
+#endif
@@ -2,21 +2,24 @@
 
 #include <cstdarg>
 #include <cstdio>
+#include <cstdlib>
 #include <memory>
 
 using namespace xpu::detail;
 
 logger &logger::instance() {
-    static logger the_logger;
-    return the_logger;
+    // Never destroyed, so messages from destructors of other statics are still written.
+    // The background thread is stopped at exit instead.
+    static logger *the_logger = new logger{};
+    return *the_logger;
 }
 
-void logger::initialize(std::function<void(std::string_view)> write_out) {
+void logger::initialize(std::function<void(std::string_view)> write_out, bool async) {
+    stop();
     this->m_write_out = std::move(write_out);
-}
-
-bool logger::active() const {
-    return m_write_out != nullptr;
+    if (async && active()) {
+        start();
+    }
 }
 
 void logger::write(const char *formatstr, ...) {
@@ -25,17 +28,196 @@ void logger::write(const char *formatstr, ...) {
     }
 
     std::va_list args;
-    va_start(args, formatstr);
-    int buf_size = std::vsnprintf(nullptr, 0, formatstr, args);
-    va_end(args);
 
-    std::string formatted(size_t(buf_size), '\0');
+    m_writers.fetch_add(1, std::memory_order_seq_cst);
+    if (not m_async.load(std::memory_order_seq_cst)) {
+        m_writers.fetch_sub(1, std::memory_order_relaxed);
+
+        va_start(args, formatstr);
+        int buf_size = std::vsnprintf(nullptr, 0, formatstr, args);
+        va_end(args);
+
+        std::string formatted(size_t(buf_size), '\0');
+
+        va_start(args, formatstr);
+        std::vsnprintf(formatted.data(), buf_size + 1, formatstr, args);
+        va_end(args);
+
+        std::string line;
+        std::lock_guard<std::mutex> lock{m_sync_mutex};
+        write_out(line, now_ms(), thread_id(), formatted);
+        return;
+    }
+
+    // Claim a record
+    size_t pos = m_enqueue_pos.load(std::memory_order_relaxed);
+    record *r = nullptr;
+    for (;;) {
+        r = &m_records[pos & (queue_size - 1)];
+        size_t seq = r->seq.load(std::memory_order_acquire);
+        auto diff = static_cast<std::ptrdiff_t>(seq) - static_cast<std::ptrdiff_t>(pos);
+        if (diff == 0) {
+            if (m_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // Consumer is a full queue behind
+            m_dropped.fetch_add(1, std::memory_order_relaxed);
+            m_writers.fetch_sub(1, std::memory_order_release);
+            return;
+        } else {
+            pos = m_enqueue_pos.load(std::memory_order_relaxed);
+        }
+    }
+
+    r->ms = now_ms();
+    r->thread = thread_id();
 
     va_start(args, formatstr);
-    std::vsnprintf(formatted.data(), buf_size + 1, formatstr, args);
+    int size = std::vsnprintf(r->message, max_message_size, formatstr, args);
     va_end(args);
 
-    m_write_out(formatted);
+    if (size < 0) {
+        size = 0;
+    } else if (size_t(size) >= max_message_size) {
+        // Mark truncated messages
+        size = max_message_size - 1;
+        r->message[size - 3] = r->message[size - 2] = r->message[size - 1] = '.';
+    }
+    r->size = size_t(size);
+
+    r->seq.store(pos + 1, std::memory_order_release);
+    m_writers.fetch_sub(1, std::memory_order_release);
+
+    if (m_consumer_idle.load(std::memory_order_acquire)) {
+        m_wakeup.notify_one();
+    }
+}
+
+void logger::flush() {
+    if (not m_async.load(std::memory_order_acquire)) {
+        return;
+    }
+    size_t target = m_enqueue_pos.load(std::memory_order_acquire);
+    while (m_dequeue_pos.load(std::memory_order_acquire) < target) {
+        m_wakeup.notify_one();
+        std::this_thread::yield();
+    }
+}
+
+void logger::start() {
+    if (m_records == nullptr) {
+        m_records = std::make_unique<record[]>(queue_size);
+    }
+    for (size_t i = 0; i < queue_size; i++) {
+        m_records[i].seq.store(i, std::memory_order_relaxed);
+    }
+    m_enqueue_pos = 0;
+    m_dequeue_pos = 0;
+    m_stop = false;
+
+    static bool registered_at_exit = false;
+    if (not registered_at_exit) {
+        // Runs before the destructors of statics created earlier (e.g. the runtime),
+        // so their messages are written synchronously.
+        std::atexit([] { logger::instance().stop(); });
+        registered_at_exit = true;
+    }
+
+    m_consumer = std::thread{[this] { consume(); }};
+    m_async.store(true, std::memory_order_release);
+}
+
+void logger::stop() {
+    if (not m_consumer.joinable()) {
+        return;
+    }
+    // New messages are written synchronously, the consumer still drains what's queued.
+    // Synchronous writers wait until the consumer is done, so the sink is never called concurrently.
+    std::lock_guard<std::mutex> sync_lock{m_sync_mutex};
+    m_async.store(false, std::memory_order_seq_cst);
+    {
+        std::lock_guard<std::mutex> lock{m_mutex};
+        m_stop = true;
+    }
+    m_wakeup.notify_one();
+    m_consumer.join();
+}
+
+void logger::consume() {
+    std::string line;
+    size_t reported_drops = 0;
+
+    for (;;) {
+        if (drain(line, reported_drops)) {
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock{m_mutex};
+        if (m_stop) {
+            break;
+        }
+        m_consumer_idle.store(true, std::memory_order_release);
+        // Producers only notify after they see the idle flag. Time out in case a notification came too early.
+        m_wakeup.wait_for(lock, std::chrono::milliseconds{10});
+        m_consumer_idle.store(false, std::memory_order_relaxed);
+    }
+
+    // Writers that saw m_async before stop() cleared it may still be publishing a record.
+    // Later writers see it cleared and write synchronously.
+    for (;;) {
+        bool writing = m_writers.load(std::memory_order_seq_cst) > 0; // Check before draining, so no record is missed
+        bool drained = drain(line, reported_drops);
+        if (not writing && not drained) {
+            break;
+        }
+        if (not drained) {
+            std::this_thread::yield();
+        }
+    }
+}
+
+bool logger::drain(std::string &line, size_t &reported_drops) {
+    bool any = false;
+    size_t pos = m_dequeue_pos.load(std::memory_order_relaxed);
+    for (;;) {
+        record &r = m_records[pos & (queue_size - 1)];
+        if (r.seq.load(std::memory_order_acquire) != pos + 1) {
+            break;
+        }
+        write_out(line, r.ms, r.thread, std::string_view{r.message, r.size});
+        r.seq.store(pos + queue_size, std::memory_order_release);
+        m_dequeue_pos.store(++pos, std::memory_order_release);
+        any = true;
+    }
+
+    size_t drops = dropped();
+    if (drops != reported_drops) {
+        char buf[64];
+        std::snprintf(buf, sizeof(buf), "xpu: Dropped %zu log messages", drops - reported_drops);
+        write_out(line, now_ms(), thread_id(), buf);
+        reported_drops = drops;
+    }
+    return any;
+}
+
+void logger::write_out(std::string &line, double ms, int thread, std::string_view message) {
+    char prefix[48];
+    int prefix_size = std::snprintf(prefix, sizeof(prefix), "[%12.3f ms | T%d] ", ms, thread);
+    line.assign(prefix, size_t(prefix_size));
+    line.append(message);
+    m_write_out(line);
+}
+
+double logger::now_ms() const {
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - m_start;
+    return elapsed.count();
+}
+
+int logger::thread_id() {
+    static std::atomic<int> next_id{0};
+    static thread_local int id = next_id.fetch_add(1, std::memory_order_relaxed);
+    return id;
 }
 
 std::string xpu::detail::format(const char *format, ...) {
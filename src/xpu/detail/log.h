@@ -3,30 +3,95 @@
 
 #include "macros.h"
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
 #include <functional>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <string_view>
+#include <thread>
 
 namespace xpu::detail {
 
+/**
+ * Messages are formatted on the calling thread into a fixed size record and
+ * passed to the sink by a background thread. Records sit in a bounded lock-free queue
+ * (Vyukov, "Bounded MPMC queue"), messages are dropped if it's full.
+ * Each message is prefixed with the time since initialization and an id of the calling thread.
+ */
 class logger {
 
 public:
     static logger &instance();
 
-    void initialize(std::function<void(std::string_view)>);
-    bool active() const;
+    void initialize(std::function<void(std::string_view)>, bool async = true);
+    bool active() const { return static_cast<bool>(m_write_out); }
     void write(const char *, ...) XPU_ATTR_FORMAT_PRINTF(2, 3);
 
+    // Block until all messages written before this call were passed to the sink.
+    void flush();
+
+    // Number of messages dropped because the queue was full.
+    size_t dropped() const { return m_dropped.load(std::memory_order_relaxed); }
+
 private:
+    static constexpr size_t queue_size = 4096; // Must be a power of two
+    static constexpr size_t max_message_size = 512;
+
+    struct record {
+        std::atomic<size_t> seq;
+        double ms;
+        int thread;
+        size_t size;
+        char message[max_message_size];
+    };
+
     std::function<void(std::string_view)> m_write_out;
+    std::chrono::steady_clock::time_point m_start = std::chrono::steady_clock::now();
+
+    std::atomic<bool> m_async{false};
+    std::unique_ptr<record[]> m_records;
+    alignas(64) std::atomic<size_t> m_enqueue_pos{0};
+    alignas(64) std::atomic<size_t> m_dequeue_pos{0};
+    std::atomic<size_t> m_dropped{0};
+    // Producers between checking m_async and publishing their record. The consumer waits for them before it exits.
+    std::atomic<int> m_writers{0};
+
+    std::thread m_consumer;
+    std::mutex m_mutex;
+    std::condition_variable m_wakeup;
+    std::atomic<bool> m_consumer_idle{false};
+    bool m_stop = false;
+
+    // Serializes calls to the sink from synchronous writers. Held by stop() until the consumer has exited.
+    std::mutex m_sync_mutex;
+
+    logger() = default;
+
+    void start();
+    void stop();
+    void consume();
+    bool drain(std::string &line, size_t &reported_drops);
+    void write_out(std::string &line, double ms, int thread, std::string_view message);
 
+    double now_ms() const;
+    static int thread_id();
 };
 
 std::string format(const char *, ... ) XPU_ATTR_FORMAT_PRINTF(1, 2);
 
 } // namespace xpu::detail
 
-#define XPU_LOG(format, ...) xpu::detail::logger::instance().write("xpu: " format, ##__VA_ARGS__)
+// Arguments are only evaluated if logging is enabled. Keeps logs on hot paths (e.g. kernel launches) cheap.
+#define XPU_LOG(format, ...) \
+    do { \
+        xpu::detail::logger &xpu_detail_logger = xpu::detail::logger::instance(); \
+        if (xpu_detail_logger.active()) { \
+            xpu_detail_logger.write("xpu: " format, ##__VA_ARGS__); \
+        } \
+    } while (0)
 
 #endif
@@ -0,0 +1,266 @@
+#include "memory_cache.h"
+#include "backend.h"
+#include "config.h"
+#include "../host.h"
+
+#include <algorithm>
+
+using namespace xpu::detail;
+
+error memory_cache::allocate(void **ptr, device dev, mem_type type, size_t bytes) {
+    backend_base *driver = backend::get(dev.backend);
+
+    if (!config::memory_cache || bytes == 0) {
+        return driver_alloc(driver, dev.device_nr, type, ptr, bytes);
+    }
+
+    size_t bin = bin_of(bytes);
+    pool *p = nullptr;
+    cached_block block{nullptr, {}};
+    {
+        std::lock_guard<std::mutex> lock{m_mutex};
+
+        p = &m_pools[pool_key{dev.backend, dev.device_nr, type}];
+        p->dev = dev;
+        p->type = type;
+
+        if (bin < num_bins && !p->bins[bin].empty()) {
+            block = std::move(p->bins[bin].back());
+            p->bins[bin].pop_back();
+            p->cached_bytes -= bin_size(bin);
+            m_device_cached_bytes[device_key{dev.backend, dev.device_nr}] -= bin_size(bin);
+            m_hits++;
+        } else {
+            m_misses++;
+        }
+    }
+
+    if (block.ptr != nullptr) {
+        // Block might still be in use by a kernel that was launched before it was freed
+        for (void *event : block.events) {
+            error err = driver->synchronize_event(event);
+            if (err != 0) {
+                release_block(dev, block);
+                return err;
+            }
+        }
+
+        std::lock_guard<std::mutex> lock{m_mutex};
+        m_live_bytes += bin_size(bin);
+        m_live.emplace(block.ptr, live_block{p, bin, bin_size(bin), std::move(block.events)});
+        *ptr = block.ptr;
+        return 0;
+    }
+
+    size_t alloc_bytes = (bin < num_bins ? bin_size(bin) : bytes);
+    error err = driver_alloc(driver, dev.device_nr, type, ptr, alloc_bytes);
+    if (err != 0) {
+        // Memory might be held by the cache, free everything on this device and try again
+        std::vector<std::pair<device, cached_block>> blocks;
+        {
+            std::lock_guard<std::mutex> lock{m_mutex};
+            take_cached(&dev, blocks);
+        }
+        release_all(blocks);
+        err = driver_alloc(driver, dev.device_nr, type, ptr, alloc_bytes);
+        if (err != 0) {
+            return err;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock{m_mutex};
+    m_live_bytes += alloc_bytes;
+    m_live.emplace(*ptr, live_block{p, bin, alloc_bytes, {}});
+    return 0;
+}
+
+error memory_cache::free(driver_t driver, void *ptr) {
+    live_block block;
+    std::vector<void *> queues;
+    {
+        std::unique_lock<std::mutex> lock{m_mutex};
+
+        auto it = m_live.find(ptr);
+        if (it == m_live.end()) {
+            lock.unlock();
+            return backend::get(driver)->free(ptr);
+        }
+
+        block = std::move(it->second);
+        m_live.erase(it);
+        m_live_bytes -= block.bytes;
+
+        if (needs_queue_events(block.p->dev.backend)) {
+            queues = m_queues[device_key{block.p->dev.backend, block.p->dev.device_nr}];
+        }
+    }
+
+    pool &p = *block.p;
+    cached_block cached{ptr, std::move(block.events)};
+
+    if (block.bin >= num_bins || !config::memory_cache) {
+        return release_block(p.dev, cached);
+    }
+
+    if (p.dev.backend != cpu) {
+        error err = record_events(p.dev, cached.events, queues);
+        if (err != 0) {
+            release_block(p.dev, cached);
+            return err;
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock{m_mutex};
+        size_t &device_cached = m_device_cached_bytes[device_key{p.dev.backend, p.dev.device_nr}];
+        if (config::memory_cache_limit == 0 || device_cached + block.bytes <= config::memory_cache_limit) {
+            p.bins[block.bin].push_back(std::move(cached));
+            p.cached_bytes += block.bytes;
+            device_cached += block.bytes;
+            return 0;
+        }
+    }
+
+    // Cache of this device is full
+    return release_block(p.dev, cached);
+}
+
+error memory_cache::trim() {
+    std::vector<std::pair<device, cached_block>> blocks;
+    {
+        std::lock_guard<std::mutex> lock{m_mutex};
+        take_cached(nullptr, blocks);
+    }
+    return release_all(blocks);
+}
+
+void memory_cache::get_stats(memory_cache_stats *stats) {
+    std::lock_guard<std::mutex> lock{m_mutex};
+    stats->hits = m_hits;
+    stats->misses = m_misses;
+    stats->live_bytes = m_live_bytes;
+    stats->cached_bytes = 0;
+    for (auto &[key, p] : m_pools) {
+        stats->cached_bytes += p.cached_bytes;
+    }
+}
+
+void memory_cache::add_queue(device dev, void *handle) {
+    if (!needs_queue_events(dev.backend)) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock{m_mutex};
+    m_queues[device_key{dev.backend, dev.device_nr}].push_back(handle);
+}
+
+void memory_cache::remove_queue(device dev, void *handle) {
+    if (!needs_queue_events(dev.backend)) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock{m_mutex};
+    auto &queues = m_queues[device_key{dev.backend, dev.device_nr}];
+    queues.erase(std::remove(queues.begin(), queues.end(), handle), queues.end());
+}
+
+size_t memory_cache::bin_of(size_t bytes) {
+    if (bytes <= (size_t{1} << min_bin_log2)) {
+        return 0;
+    }
+
+    size_t log2 = min_bin_log2;
+    while (log2 < max_bin_log2 && (size_t{2} << log2) <= bytes) {
+        log2++;
+    }
+
+    size_t base = size_t{1} << log2;
+    if (bytes > base && log2 == max_bin_log2) {
+        return num_bins;
+    }
+    size_t step = base / bin_steps;
+    size_t sub = (bytes - base + step - 1) / step;
+    return (log2 - min_bin_log2) * bin_steps + sub;
+}
+
+size_t memory_cache::bin_size(size_t bin) {
+    size_t base = size_t{1} << (bin / bin_steps + min_bin_log2);
+    return base + bin % bin_steps * (base / bin_steps);
+}
+
+error memory_cache::driver_alloc(backend_base *driver, int device, mem_type type, void **ptr, size_t bytes) {
+    switch (type) {
+    case mem_host: return driver->malloc_host(ptr, bytes, device);
+    case mem_shared: return driver->malloc_shared(ptr, bytes, device);
+    default: return driver->malloc_device(ptr, bytes, device);
+    }
+}
+
+error memory_cache::record_events(const device &dev, std::vector<void *> &events, const std::vector<void *> &queues) {
+    backend_base *driver = backend::get(dev.backend);
+
+    // One event on the default queue, plus one for every queue that isn't ordered with it
+    size_t n = queues.size() + 1;
+    while (events.size() > n) {
+        driver->destroy_event(events.back());
+        events.pop_back();
+    }
+    while (events.size() < n) {
+        void *event = nullptr;
+        error err = driver->create_event(&event, dev.device_nr);
+        if (err != 0) {
+            return err;
+        }
+        events.push_back(event);
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        error err = driver->record_event(events[i], i == 0 ? nullptr : queues[i - 1]);
+        if (err != 0) {
+            return err;
+        }
+    }
+    return 0;
+}
+
+error memory_cache::release_block(const device &dev, cached_block &block) {
+    backend_base *driver = backend::get(dev.backend);
+    error result = 0;
+    for (void *event : block.events) {
+        error err = driver->synchronize_event(event);
+        if (err == 0) {
+            err = driver->destroy_event(event);
+        }
+        if (result == 0) {
+            result = err;
+        }
+    }
+    block.events.clear();
+    error err = driver->free(block.ptr);
+    return (result != 0 ? result : err);
+}
+
+void memory_cache::take_cached(const device *dev, std::vector<std::pair<device, cached_block>> &blocks) {
+    for (auto &[key, p] : m_pools) {
+        if (dev != nullptr && (p.dev.backend != dev->backend || p.dev.device_nr != dev->device_nr)) {
+            continue;
+        }
+        for (size_t bin = 0; bin < num_bins; bin++) {
+            for (cached_block &block : p.bins[bin]) {
+                blocks.emplace_back(p.dev, std::move(block));
+            }
+            p.cached_bytes -= p.bins[bin].size() * bin_size(bin);
+            m_device_cached_bytes[device_key{p.dev.backend, p.dev.device_nr}] -= p.bins[bin].size() * bin_size(bin);
+            p.bins[bin].clear();
+        }
+    }
+}
+
+error memory_cache::release_all(std::vector<std::pair<device, cached_block>> &blocks) {
+    error result = 0;
+    for (auto &[dev, block] : blocks) {
+        error err = release_block(dev, block);
+        if (result == 0) {
+            result = err;
+        }
+    }
+    return result;
+}
@@ -0,0 +1,121 @@
+#ifndef XPU_DETAIL_MEMORY_CACHE_H
+#define XPU_DETAIL_MEMORY_CACHE_H
+
+#include "backend_base.h"
+#include "common.h"
+
+#include <array>
+#include <cstddef>
+#include <map>
+#include <mutex>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+namespace xpu {
+struct memory_cache_stats;
+}
+
+namespace xpu::detail {
+
+/**
+ * Caching allocator that sits between the runtime and the drivers.
+ *
+ * Allocations are rounded up to the next size class and served from
+ * per-device bins of previously freed blocks. Size classes split each power of two
+ * into four steps, so at most 25% of a block is wasted. Only when a bin is empty the
+ * driver is called. Freed blocks are returned to their bin, as long as the
+ * number of cached bytes on that device stays below config::memory_cache_limit.
+ * Allocations larger than the biggest bin bypass the cache.
+ *
+ * GPU drivers may still use a freed block in a queue. So events are recorded
+ * when a block is freed and waited on before the block is handed out again.
+ * (CPU queues hold references to their buffers instead.)
+ * CUDA and HIP streams are ordered with the default stream, so one event there is enough.
+ * SYCL queues run independently of each other, so an event is recorded on every queue of the device.
+ *
+ * The lock only protects the bookkeeping. Driver calls (allocations, events) happen outside of it.
+ */
+class memory_cache {
+
+public:
+    memory_cache() = default;
+
+    // Drivers may already be unloaded when this is destroyed at exit,
+    // so cached blocks are intentionally not freed here.
+    ~memory_cache() = default;
+
+    error allocate(void **ptr, device dev, mem_type type, size_t bytes);
+
+    /**
+     * Free memory allocated with allocate() or directly with driver 'driver'.
+     */
+    error free(driver_t driver, void *ptr);
+
+    /**
+     * Return all cached blocks to the drivers.
+     */
+    error trim();
+
+    void get_stats(memory_cache_stats *);
+
+    /**
+     * Track queues that freed blocks have to be ordered with.
+     */
+    void add_queue(device dev, void *handle);
+    void remove_queue(device dev, void *handle);
+
+private:
+    static constexpr size_t min_bin_log2 = 8; // 256 bytes
+    static constexpr size_t max_bin_log2 = 30; // 1 GiB
+    static constexpr size_t bin_steps = 4; // size classes per power of two
+    static constexpr size_t num_bins = (max_bin_log2 - min_bin_log2) * bin_steps + 1;
+
+    struct cached_block {
+        void *ptr;
+        std::vector<void *> events; // empty if no event is required
+    };
+
+    struct pool {
+        device dev;
+        mem_type type;
+        size_t cached_bytes = 0;
+        std::array<std::vector<cached_block>, num_bins> bins;
+    };
+
+    struct live_block {
+        pool *p;
+        size_t bin; // num_bins if the allocation bypasses the cache
+        size_t bytes;
+        std::vector<void *> events; // Reused when the block is freed again
+    };
+
+    using pool_key = std::tuple<driver_t, int, mem_type>;
+    using device_key = std::pair<driver_t, int>;
+
+    std::mutex m_mutex;
+    std::map<pool_key, pool> m_pools;
+    std::map<device_key, size_t> m_device_cached_bytes;
+    std::map<device_key, std::vector<void *>> m_queues;
+    std::unordered_map<void *, live_block> m_live;
+
+    size_t m_hits = 0;
+    size_t m_misses = 0;
+    size_t m_live_bytes = 0;
+
+    static size_t bin_of(size_t bytes);
+    static size_t bin_size(size_t bin);
+    static error driver_alloc(backend_base *, int, mem_type, void **, size_t);
+    static bool needs_queue_events(driver_t d) { return d == sycl; }
+
+    error record_events(const device &, std::vector<void *> &events, const std::vector<void *> &queues);
+    error release_block(const device &, cached_block &);
+
+    // Remove cached blocks from the bins (all devices if dev is nullptr). Call with the lock held.
+    void take_cached(const device *dev, std::vector<std::pair<device, cached_block>> &blocks);
+    error release_all(std::vector<std::pair<device, cached_block>> &blocks);
+};
+
+} // namespace xpu::detail
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef XPU_DETAIL_MERGE_PATH_H
+#define XPU_DETAIL_MERGE_PATH_H
+
+#include "../defines.h"
+
+namespace xpu::detail {
+
+enum merge_path_bounds {
+    merge_path_lower,
+    merge_path_upper,
+};
+
+/**
+ * Merge path search (Green et al., "Merge Path - Parallel Merging Made Simple", 2012).
+ * Returns how many items of a come before output position diag, when a and b are merged.
+ * The remaining diag - result items are taken from b.
+ *
+ * With merge_path_lower, items of a go before equal items of b (same as std::merge).
+ * Output ranges between two diagonals can then be merged independently of each other.
+ */
+template<merge_path_bounds Bounds, typename T, typename Index, typename Compare>
+XPU_H XPU_D Index merge_path(const T *a, Index a_count, const T *b, Index b_count, Index diag, Compare &&comp) {
+    Index begin = (diag > b_count ? diag - b_count : 0);
+    Index end = (diag < a_count ? diag : a_count);
+
+    while (begin < end) {
+        Index mid = begin + (end - begin) / 2;
+        const T &a_key = a[mid];
+        const T &b_key = b[diag - 1 - mid];
+        bool pred = (Bounds == merge_path_upper) ? comp(a_key, b_key) : !comp(b_key, a_key);
+
+        if (pred) {
+            begin = mid + 1;
+        } else {
+            end = mid;
+        }
+    }
+    return begin;
+}
+
+} // namespace xpu::detail
+
+#endif
@@ -2,6 +2,7 @@
 #define XPU_DETAIL_PARALLEL_MERGE_H
 
 #include "../defines.h"
+#include "merge_path.h"
 #include <type_traits>
 
 #if 0
@@ -149,32 +150,9 @@ private:
 
     template<MgpuBounds Bounds, typename Compare>
     XPU_D int merge_path(const data_t *a, int aCount, const data_t *b, int bCount, int diag, Compare &&comp) {
-
         PRINT_B("Merge path for diag %d", diag);
-
-        int begin = max(0, diag - bCount);
-        int end = min(diag, aCount);
-
-        PRINT_B("begin = %d, end = %d", begin, end);
-
-        while (begin < end) {
-            int mid = (begin + end) >> 1;
-            data_t aKey = a[mid];
-            // printf("tid %d: bidx = %d\n", pos.thread_idx_x(), diag-1-mid);
-
-            PRINT_T("b_idx = %d", diag-1-mid);
-            data_t bKey = b[diag - 1 - mid];
-            bool pred = (MgpuBoundsUpper == Bounds) ? comp(aKey, bKey) : !comp(bKey, aKey);
-
-            PRINT_B("aKey = %f, bKey = %f, begin = %d, end = %d", aKey, bKey, begin, end);
-
-            if (pred) {
-                begin = mid + 1;
-            } else {
-                end = mid;
-            }
-        }
-        return begin;
+        constexpr merge_path_bounds bounds = (Bounds == MgpuBoundsUpper ? merge_path_upper : merge_path_lower);
+        return detail::merge_path<bounds>(a, aCount, b, bCount, diag, comp);
     }
 
     XPU_D void reg_to_shared(const data_t* reg, data_t *dest, bool sync) {
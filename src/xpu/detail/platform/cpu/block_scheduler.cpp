@@ -0,0 +1,171 @@
+#if __APPLE__
+#define _XOPEN_SOURCE 600 // ucontext is only exposed in XOPEN mode on MacOS
+#endif
+
+#include "block_scheduler.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+#include <ucontext.h>
+
+using namespace xpu::detail;
+
+// Kernels run on fibers should only need little stack space.
+// Stack memory is reserved lazily by the OS, so this mostly costs address space.
+static constexpr size_t fiber_stack_size = 256 * 1024;
+
+struct block_scheduler::fiber {
+    ucontext_t ctx;
+    void *stack = nullptr;
+
+    ~fiber() { std::free(stack); }
+};
+
+block_scheduler &block_scheduler::instance() {
+    static thread_local block_scheduler the_scheduler;
+    return the_scheduler;
+}
+
+block_scheduler::block_scheduler() : m_main(std::make_unique<fiber>()) {}
+
+block_scheduler::~block_scheduler() = default;
+
+void block_scheduler::run(int nthreads, thread_fn fn, void *args) {
+    // A single thread never waits at a barrier, so no bookkeeping is needed.
+    if (nthreads == 1) {
+        m_nthreads = 1;
+        m_current = 0;
+        fn(args, 0);
+        m_nthreads = 0;
+        m_current = -1;
+        return;
+    }
+
+    m_fn = fn;
+    m_args = args;
+    m_nthreads = nthreads;
+    m_state.assign(nthreads, not_started);
+
+    // Threads are started in order on the current stack.
+    // A thread might have been started on a fiber already,
+    // if a previous thread hit a barrier.
+    for (int i = 0; i < nthreads; i++) {
+        if (m_state[i] != not_started) {
+            continue;
+        }
+        m_main_thread = i;
+        m_current = i;
+        m_state[i] = running;
+        m_fn(m_args, i);
+        m_state[i] = done;
+        m_main_thread = -1;
+    }
+
+    // Resume threads that are still waiting at a barrier.
+    // Control returns here once all of them have finished.
+    for (int i = 0; i < nthreads; i++) {
+        if (m_state[i] == suspended) {
+            m_current = i;
+            m_state[i] = running;
+            swapcontext(&m_main->ctx, &m_fibers[i]->ctx);
+        }
+    }
+
+    m_nthreads = 0;
+    m_current = -1;
+}
+
+void block_scheduler::barrier() {
+    if (m_lanes) {
+        std::fputs("xpu: barrier() is not allowed in kernels with cpu_simd_width > 1.\n", stderr);
+        std::abort();
+    }
+    if (m_nthreads <= 1) {
+        return;
+    }
+
+    int self = m_current;
+    int next = next_live_thread(self);
+    if (next == self) {
+        return;
+    }
+
+    m_state[self] = suspended;
+    switch_to(self, next);
+    // Every other thread has reached the barrier or finished at this point.
+    m_current = self;
+    m_state[self] = running;
+}
+
+block_scheduler::fiber &block_scheduler::context_of(int thread) {
+    if (thread == m_main_thread || thread < 0) {
+        return *m_main;
+    }
+    return *m_fibers[thread];
+}
+
+int block_scheduler::next_live_thread(int thread) const {
+    // Threads are scheduled round-robin. So when control returns to a thread
+    // waiting at a barrier, every other thread has been given the chance to reach it.
+    for (int i = 1; i <= m_nthreads; i++) {
+        int t = (thread + i) % m_nthreads;
+        if (m_state[t] != done) {
+            return t;
+        }
+    }
+    return -1;
+}
+
+void block_scheduler::switch_to(int from, int to) {
+    ucontext_t *target;
+
+    if (to < 0) {
+        target = &m_main->ctx; // Back to run()
+    } else if (m_state[to] == not_started) {
+        if (m_fibers.size() < static_cast<size_t>(m_nthreads)) {
+            m_fibers.resize(m_nthreads);
+        }
+        std::unique_ptr<fiber> &f = m_fibers[to];
+        if (f == nullptr) {
+            f = std::make_unique<fiber>();
+            f->stack = std::malloc(fiber_stack_size);
+            if (f->stack == nullptr) {
+                throw std::bad_alloc{};
+            }
+        }
+        getcontext(&f->ctx);
+        f->ctx.uc_stack.ss_sp = f->stack;
+        f->ctx.uc_stack.ss_size = fiber_stack_size;
+        f->ctx.uc_link = nullptr;
+        makecontext(&f->ctx, &block_scheduler::fiber_entry, 0);
+        target = &f->ctx;
+    } else {
+        target = &context_of(to).ctx;
+    }
+
+    if (to >= 0) {
+        m_current = to;
+        m_state[to] = running;
+    }
+
+    if (m_state[from] == done) {
+        setcontext(target);
+    } else {
+        swapcontext(&context_of(from).ctx, target);
+    }
+}
+
+void block_scheduler::finish_current() {
+    int self = m_current;
+    m_state[self] = done;
+    switch_to(self, next_live_thread(self));
+    std::abort(); // unreachable, a finished fiber is never resumed
+}
+
+void block_scheduler::fiber_entry() {
+    block_scheduler &self = instance();
+    self.m_fn(self.m_args, self.m_current);
+    self.finish_current();
+}
@@ -0,0 +1,92 @@
+#ifndef XPU_DRIVER_CPU_BLOCK_SCHEDULER_H
+#define XPU_DRIVER_CPU_BLOCK_SCHEDULER_H
+
+#include <memory>
+#include <vector>
+
+namespace xpu::detail {
+
+/**
+ * Runs the logical threads of a single block on the calling OS thread.
+ *
+ * Threads are executed one after another directly on the caller's stack.
+ * Only when a thread calls barrier(), the remaining threads are started on
+ * fibers (with their own stack), so that every thread can reach the barrier
+ * before any thread continues. Kernels without barriers never pay for
+ * context switches.
+ *
+ * Each OS thread owns its own instance (see instance()), so blocks can be
+ * executed in parallel by different OS threads.
+ */
+class block_scheduler {
+
+public:
+    using thread_fn = void(*)(void *, int);
+
+    static block_scheduler &instance();
+
+    ~block_scheduler();
+
+    /**
+     * Execute fn(args, i) for all threads i in [0, nthreads).
+     * Returns once all threads have finished.
+     */
+    void run(int nthreads, thread_fn fn, void *args);
+
+    /**
+     * Suspend the current logical thread until all other threads in the block
+     * have either reached a barrier or have finished.
+     */
+    void barrier();
+
+    /**
+     * Marks a region where threads run as SIMD lanes and barriers are forbidden.
+     * Calling barrier() inside aborts the program.
+     */
+    class lane_scope {
+    public:
+        lane_scope() : m_sched(instance()) { m_sched.m_lanes = true; }
+        ~lane_scope() { m_sched.m_lanes = false; }
+
+        lane_scope(const lane_scope &) = delete;
+        lane_scope &operator=(const lane_scope &) = delete;
+
+    private:
+        block_scheduler &m_sched;
+    };
+
+private:
+    enum thread_state : unsigned char {
+        not_started,
+        running,
+        suspended,
+        done,
+    };
+
+    struct fiber;
+
+    thread_fn m_fn = nullptr;
+    void *m_args = nullptr;
+    int m_nthreads = 0;
+    int m_current = -1;
+    int m_main_thread = -1; // Thread running on the stack of the OS thread
+    bool m_lanes = false; // Threads run as SIMD lanes, see lane_scope
+
+    std::vector<thread_state> m_state;
+    std::unique_ptr<fiber> m_main; // Context of the OS thread stack
+    std::vector<std::unique_ptr<fiber>> m_fibers; // Fiber i is reserved for thread i
+
+    block_scheduler();
+
+    fiber &context_of(int thread);
+    int next_live_thread(int thread) const;
+    void switch_to(int from, int to);
+    [[noreturn]] void finish_current();
+
+    static void fiber_entry();
+
+};
+
+} // namespace xpu::detail
+
+#endif
@@ -1,5 +1,7 @@
 #include "cpu_driver.h"
+#include "radix_sort.h"
 
+#include "../../config.h"
 #include "../../log.h"
 
 #include <unistd.h>
@@ -8,118 +10,299 @@
 #include <cstdlib>
 #include <cstring>
 #include <chrono>
+#include <memory>
+#include <new>
+#include <string>
 
 using namespace xpu::detail;
 
-error cpu_driver::setup() {
-    return SUCCESS;
+// Returns errors of earlier commands, if it has to wait for the queue.
+template<typename F>
+static error run_on_queue(void *queue, double *ms, F &&func) {
+    auto timed = [=]() {
+        if (ms == nullptr) {
+            func();
+        } else {
+            auto start = std::chrono::high_resolution_clock::now();
+            func();
+            auto end = std::chrono::high_resolution_clock::now();
+            *ms = std::chrono::duration<double, std::milli>(end - start).count();
+        }
+    };
+
+    if (queue == nullptr) {
+        timed();
+        return 0;
+    }
+
+    auto *q = static_cast<cpu_queue *>(queue);
+    if (q->on_executor()) {
+        // Called from a command of the same queue (graph replay), so it's already our turn.
+        timed();
+        return 0;
+    }
+    q->submit(timed);
+    if (ms != nullptr) {
+        // Timings must be available when returning
+        return q->wait();
+    }
+    return 0;
 }
 
-error cpu_driver::malloc_device(void **ptr, size_t bytes) {
-    *ptr = std::malloc(bytes);
-    if (*ptr == nullptr) {
-        return OUT_OF_MEMORY;
+error cpu_driver::setup() {
+    m_nodes = numa::detect_nodes();
+    m_pools.resize(m_nodes.size());
+    m_started_pools = std::vector<std::atomic<thread_pool *>>(m_nodes.size());
+    if (numa_enabled()) {
+        XPU_LOG("Found %zu NUMA nodes. Each node is exposed as a separate CPU device.", m_nodes.size());
     }
     return SUCCESS;
 }
 
-error cpu_driver::malloc_host(void **ptr, size_t bytes) {
-    *ptr = std::malloc(bytes);
-    if (*ptr == nullptr) {
-        return OUT_OF_MEMORY;
+thread_pool &cpu_driver::pool(int device) {
+    thread_pool *started = m_started_pools.at(device).load(std::memory_order_acquire);
+    if (started != nullptr) {
+        return *started;
     }
-    return SUCCESS;
+
+    std::lock_guard<std::mutex> lock{m_pools_mutex};
+    std::unique_ptr<thread_pool> &p = m_pools.at(device);
+    if (p == nullptr) {
+        const numa::node &node = m_nodes[device];
+        int nthreads = config::cpu_threads;
+        if (nthreads <= 0 && numa_enabled()) {
+            nthreads = static_cast<int>(node.cpus.size());
+        }
+        p = std::make_unique<thread_pool>(nthreads, config::cpu_chunk_size, (numa_enabled() ? node.cpus : std::vector<int>{}));
+        XPU_LOG("Started CPU thread pool with %d threads for device cpu%d.", p->num_threads(), device);
+        m_started_pools[device].store(p.get(), std::memory_order_release);
+    }
+    return *p;
 }
 
-error cpu_driver::malloc_shared(void **ptr, size_t bytes) {
-    *ptr = std::malloc(bytes);
+error cpu_driver::allocate(void **ptr, size_t bytes, int device) {
+    if (device < 0 || device >= static_cast<int>(m_nodes.size())) {
+        return INVALID_DEVICE;
+    }
+    if (numa_enabled() && bytes >= numa_alloc_threshold) {
+        *ptr = numa::alloc_on_node(bytes, m_nodes[device].id);
+    } else {
+        *ptr = std::malloc(bytes);
+    }
     if (*ptr == nullptr) {
         return OUT_OF_MEMORY;
     }
+    if (numa_enabled()) {
+        std::lock_guard<std::mutex> lock{m_allocations_mutex};
+        m_allocations[reinterpret_cast<uintptr_t>(*ptr)] = allocation{bytes, device};
+    }
     return SUCCESS;
 }
 
+error cpu_driver::malloc_device(void **ptr, size_t bytes, int device) {
+    return allocate(ptr, bytes, device);
+}
+
+error cpu_driver::malloc_host(void **ptr, size_t bytes, int device) {
+    return allocate(ptr, bytes, device);
+}
+
+error cpu_driver::malloc_shared(void **ptr, size_t bytes, int device) {
+    return allocate(ptr, bytes, device);
+}
+
 error cpu_driver::free(void *ptr) {
+    if (numa_enabled()) {
+        std::lock_guard<std::mutex> lock{m_allocations_mutex};
+        m_allocations.erase(reinterpret_cast<uintptr_t>(ptr));
+    }
     std::free(ptr);
     return SUCCESS;
 }
 
+error cpu_driver::register_host(void * /*ptr*/, size_t /*bytes*/, bool /*read_only*/) {
+    // Host memory is device memory already.
+    return not_supported;
+}
+
+error cpu_driver::unregister_host(void * /*ptr*/) {
+    return not_supported;
+}
+
 error cpu_driver::create_queue(void **queue, int device) {
-    *queue = nullptr;
-    return (device == 0 ? SUCCESS : INVALID_DEVICE);
+    if (device < 0 || device >= static_cast<int>(m_nodes.size())) {
+        return INVALID_DEVICE;
+    }
+    auto *q = new cpu_queue{device, (numa_enabled() ? m_nodes[device].cpus : std::vector<int>{})};
+    {
+        std::lock_guard<std::mutex> lock{m_queues_mutex};
+        m_queues.insert(q);
+    }
+    *queue = q;
+    return SUCCESS;
+}
+
+error cpu_driver::destroy_queue(void *queue) {
+    auto *q = static_cast<cpu_queue *>(queue);
+    {
+        std::lock_guard<std::mutex> lock{m_queues_mutex};
+        m_queues.erase(q);
+    }
+    delete q; // Finishes pending commands
+    return SUCCESS;
 }
 
-error cpu_driver::destroy_queue(void * /*queue*/) {
+error cpu_driver::synchronize_queue(void *queue) {
+    if (queue != nullptr) {
+        return static_cast<cpu_queue *>(queue)->wait();
+    }
     return SUCCESS;
 }
 
-error cpu_driver::synchronize_queue(void * /*queue*/) {
+// Event handles hold one reference to the event, commands submitted to a queue hold their own.
+// So destroying the handle never frees an event that a queue is still going to signal or wait on.
+using event_ref = std::shared_ptr<cpu_event>;
+
+static event_ref &get_event(void *event) {
+    return *static_cast<event_ref *>(event);
+}
+
+error cpu_driver::create_event(void **event, int device) {
+    if (device < 0 || device >= static_cast<int>(m_nodes.size())) {
+        return INVALID_DEVICE;
+    }
+    *event = new event_ref{std::make_shared<cpu_event>()};
     return SUCCESS;
 }
 
-error cpu_driver::memcpy(void *dst, const void *src, size_t bytes) {
-    std::memcpy(dst, src, bytes);
+error cpu_driver::destroy_event(void *event) {
+    delete static_cast<event_ref *>(event);
     return SUCCESS;
 }
 
-error cpu_driver::memcpy_async(void *dst, const void *src, size_t bytes, void * /*queue*/, double *ms) {
-    if (ms == nullptr) {
-        std::memcpy(dst, src, bytes);
+error cpu_driver::record_event(void *event, void *queue) {
+    event_ref ev = get_event(event);
+    ev->reset();
+    if (queue == nullptr) {
+        ev->complete();
     } else {
-        auto start = std::chrono::high_resolution_clock::now();
-        std::memcpy(dst, src, bytes);
-        auto end = std::chrono::high_resolution_clock::now();
-        *ms = std::chrono::duration<double, std::milli>(end - start).count();
+        static_cast<cpu_queue *>(queue)->submit([ev]() { ev->complete(); });
     }
     return SUCCESS;
 }
 
-error cpu_driver::memset(void *dst, int ch, size_t bytes) {
-    std::memset(dst, ch, bytes);
+error cpu_driver::wait_event(void *queue, void *event) {
+    event_ref ev = get_event(event);
+    if (queue == nullptr) {
+        ev->wait();
+    } else {
+        static_cast<cpu_queue *>(queue)->submit([ev]() { ev->wait(); });
+    }
     return SUCCESS;
 }
 
-error cpu_driver::memset_async(void *dst, int ch, size_t bytes, void * /*queue*/, double *ms) {
-    if (ms == nullptr) {
-        std::memset(dst, ch, bytes);
-    } else {
-        auto start = std::chrono::high_resolution_clock::now();
-        std::memset(dst, ch, bytes);
-        auto end = std::chrono::high_resolution_clock::now();
-        *ms = std::chrono::duration<double, std::milli>(end - start).count();
+error cpu_driver::synchronize_event(void *event) {
+    get_event(event)->wait();
+    return SUCCESS;
+}
+
+error cpu_driver::event_elapsed_time(double *ms, void *start, void *end) {
+    cpu_event &ev_start = *get_event(start);
+    cpu_event &ev_end = *get_event(end);
+    if (!ev_start.recorded() || !ev_end.recorded()) {
+        return EVENT_NOT_RECORDED;
     }
+    ev_start.wait();
+    ev_end.wait();
+    *ms = std::chrono::duration<double, std::milli>(ev_end.time() - ev_start.time()).count();
+    return SUCCESS;
+}
+
+error cpu_driver::memcpy(void *dst, const void *src, size_t bytes) {
+    std::memcpy(dst, src, bytes);
+    return SUCCESS;
+}
+
+error cpu_driver::memcpy_async(void *dst, const void *src, size_t bytes, void *queue, double *ms) {
+    return run_on_queue(queue, ms, [=]() { std::memcpy(dst, src, bytes); });
+}
+
+error cpu_driver::memset(void *dst, int ch, size_t bytes) {
+    std::memset(dst, ch, bytes);
     return SUCCESS;
 }
 
+error cpu_driver::memset_async(void *dst, int ch, size_t bytes, void *queue, double *ms) {
+    return run_on_queue(queue, ms, [=]() { std::memset(dst, ch, bytes); });
+}
+
 error cpu_driver::num_devices(int *devices) {
-    *devices = 1;
+    *devices = static_cast<int>(m_nodes.size());
     return SUCCESS;
 }
 
 error cpu_driver::set_device(int device) {
-    return (device == 0 ? SUCCESS : INVALID_DEVICE);
+    if (device < 0 || device >= static_cast<int>(m_nodes.size())) {
+        return INVALID_DEVICE;
+    }
+    m_device.store(device, std::memory_order_relaxed);
+    return SUCCESS;
 }
 
 error cpu_driver::get_device(int *device) {
-    *device = 0;
+    *device = active_device();
     return SUCCESS;
 }
 
 error cpu_driver::device_synchronize() {
-    return SUCCESS;
+    std::lock_guard<std::mutex> lock{m_queues_mutex};
+    error err = SUCCESS;
+    std::exception_ptr ex;
+    for (cpu_queue *q : m_queues) {
+        // Wait for the remaining queues, even if a command of this one threw.
+        error qerr = SUCCESS;
+        try {
+            qerr = q->wait();
+        } catch (...) {
+            if (ex == nullptr) {
+                ex = std::current_exception();
+            }
+        }
+        if (err == SUCCESS) {
+            err = qerr;
+        }
+    }
+    if (ex != nullptr) {
+        std::rethrow_exception(ex);
+    }
+    return err;
+}
+
+void cpu_driver::drain_queues() {
+    std::lock_guard<std::mutex> lock{m_queues_mutex};
+    for (cpu_queue *q : m_queues) {
+        if (q->on_executor()) {
+            return;
+        }
+    }
+    for (cpu_queue *q : m_queues) {
+        q->drain();
+    }
 }
 
 error cpu_driver::get_properties(device_prop *props, int device) {
-    if (device != 0) {
+    if (device < 0 || device >= static_cast<int>(m_nodes.size())) {
         return INVALID_DEVICE;
     }
 
-    props->name = "CPU";
+    props->name = (numa_enabled() ? "CPU (NUMA node " + std::to_string(m_nodes[device].id) + ")" : "CPU");
     props->driver = cpu;
     props->arch = "";
 
     size_t free_mem, total_mem;
-    meminfo(&free_mem, &total_mem);
+    if (!numa_enabled() || !numa::meminfo(m_nodes[device].id, &free_mem, &total_mem)) {
+        meminfo(&free_mem, &total_mem);
+    }
     props->shared_mem_size = total_mem;
     props->const_mem_size = total_mem;
 
@@ -130,16 +313,31 @@ error cpu_driver::get_properties(device_prop *props, int device) {
     return SUCCESS;
 }
 
-error cpu_driver::get_ptr_prop(const void * /*ptr*/, int *device, mem_type *type) {
-    // There's no way to query the actual device here for the pointer
-    // Therefore we have to assume it's pointing to cpu memory...
+error cpu_driver::get_ptr_prop(const void *ptr, int *device, mem_type *type) {
+    // Memory types aren't distinguished on the CPU. Pointers that weren't allocated by xpu
+    // (or with a single device) are assumed to be on the first device.
     *device = 0;
     *type = mem_unknown;
+
+    if (numa_enabled()) {
+        auto addr = reinterpret_cast<uintptr_t>(ptr);
+        std::lock_guard<std::mutex> lock{m_allocations_mutex};
+        auto it = m_allocations.upper_bound(addr);
+        if (it != m_allocations.begin()) {
+            --it;
+            if (addr < it->first + it->second.bytes) {
+                *device = it->second.device;
+            }
+        }
+    }
     return SUCCESS;
 }
 
 #ifdef __linux__
 error cpu_driver::meminfo(size_t *free, size_t *total) {
+    if (numa_enabled() && numa::meminfo(m_nodes[active_device()].id, free, total)) {
+        return SUCCESS;
+    }
     size_t pagesize = sysconf(_SC_PAGESIZE);
     *free = pagesize * sysconf(_SC_AVPHYS_PAGES);
     *total = pagesize * sysconf(_SC_PHYS_PAGES);
@@ -169,12 +367,40 @@ error cpu_driver::meminfo(size_t *free, size_t *total) {
 }
 #endif
 
+error cpu_driver::sort_pairs(void *keys, void *values, size_t n, sort_key_t type, size_t value_size) {
+    try {
+        radix_sort(pool(active_device()), keys, values, n, type, value_size);
+    } catch (const std::bad_alloc &) {
+        return OUT_OF_MEMORY;
+    }
+    return SUCCESS;
+}
+
+// The CPU has no native graphs. Instead the runtime submits all recorded commands
+// as a single command to the queue, see runtime::launch_graph.
+error cpu_driver::begin_capture(void * /*queue*/) {
+    return not_supported;
+}
+
+error cpu_driver::end_capture(void * /*queue*/, void ** /*graph*/) {
+    return not_supported;
+}
+
+error cpu_driver::launch_graph(void * /*graph*/, void * /*queue*/) {
+    return not_supported;
+}
+
+error cpu_driver::destroy_graph(void * /*graph*/) {
+    return not_supported;
+}
+
 const char *cpu_driver::error_to_string(error err) {
     switch (err) {
     case SUCCESS: return "Success";
     case OUT_OF_MEMORY: return "Out of memory";
     case INVALID_DEVICE: return "Invalid device";
     case MACOSX_ERROR: return "Macosx error";
+    case EVENT_NOT_RECORDED: return "Event not recorded";
     }
 
     return "Unknown error code";
@@ -2,6 +2,17 @@
 #define XPU_DRIVER_CPU_CPU_DRIVER_H
 
 #include "../../backend_base.h"
+#include "cpu_queue.h"
+#include "numa.h"
+#include "thread_pool.h"
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <unordered_set>
+#include <vector>
 
 namespace xpu::detail {
 
@@ -11,15 +22,24 @@ public:
     virtual ~cpu_driver() {}
 
     error setup() override;
-    error malloc_device(void **, size_t) override;
-    error malloc_host(void **, size_t) override;
-    error malloc_shared(void **, size_t) override;
+    error malloc_device(void **, size_t, int) override;
+    error malloc_host(void **, size_t, int) override;
+    error malloc_shared(void **, size_t, int) override;
     error free(void *) override;
+    error register_host(void *, size_t, bool) override;
+    error unregister_host(void *) override;
 
     error create_queue(void **, int) override;
     error destroy_queue(void *) override;
     error synchronize_queue(void *) override;
 
+    error create_event(void **, int) override;
+    error destroy_event(void *) override;
+    error record_event(void *, void *) override;
+    error wait_event(void *, void *) override;
+    error synchronize_event(void *) override;
+    error event_elapsed_time(double *, void *, void *) override;
+
     error memcpy(void *, const void *, size_t) override;
     error memcpy_async(void *, const void *, size_t, void *, double *) override;
     error memset(void *, int, size_t) override;
@@ -34,18 +54,66 @@ public:
 
     error meminfo(size_t *, size_t *) override;
 
+    error sort_pairs(void *, void *, size_t, sort_key_t, size_t) override;
+
+    error begin_capture(void *) override;
+    error end_capture(void *, void **) override;
+    error launch_graph(void *, void *) override;
+    error destroy_graph(void *) override;
+
     const char *error_to_string(error) override;
 
     driver_t get_type() override;
 
+    /**
+     * Thread pool running kernels on the given device (NUMA node).
+     * Pools are started on first use.
+     */
+    thread_pool &pool(int device);
+
+    /**
+     * Block until all commands submitted to any queue have finished.
+     * Unlike device_synchronize, errors of the queues are kept for their next wait.
+     * Does nothing if called from a queue executor, as it might wait for itself.
+     */
+    void drain_queues();
+
+    int active_device() const { return m_device.load(std::memory_order_relaxed); }
+
 private:
     enum error_code : int {
         SUCCESS = 0,
         OUT_OF_MEMORY,
         INVALID_DEVICE,
-        MACOSX_ERROR
+        MACOSX_ERROR,
+        EVENT_NOT_RECORDED,
     };
 
+    // Allocations of at least this size are placed on the NUMA node of the active device.
+    // Smaller allocations aren't worth a separate page.
+    static constexpr size_t numa_alloc_threshold = 64 * 1024;
+
+    std::vector<numa::node> m_nodes; // One device per node
+    std::atomic<int> m_device{0};
+
+    std::mutex m_pools_mutex;
+    std::vector<std::unique_ptr<thread_pool>> m_pools;
+    std::vector<std::atomic<thread_pool *>> m_started_pools; // Read without lock on every kernel launch
+
+    bool numa_enabled() const { return m_nodes.size() > 1; }
+    error allocate(void **, size_t, int);
+
+    // Device of each allocation, so get_ptr_prop can report it. Only tracked with several NUMA nodes.
+    struct allocation {
+        size_t bytes;
+        int device;
+    };
+    std::mutex m_allocations_mutex;
+    std::map<uintptr_t, allocation> m_allocations;
+
+    std::mutex m_queues_mutex;
+    std::unordered_set<cpu_queue *> m_queues;
+
 };
 
 } // namespace xpu::detail
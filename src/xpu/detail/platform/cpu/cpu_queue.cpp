@@ -0,0 +1,133 @@
+#include "cpu_queue.h"
+#include "numa.h"
+#include "../../log.h"
+#include "../../trace.h"
+
+#include <utility>
+
+using namespace xpu::detail;
+
+cpu_queue::cpu_queue(int device, std::vector<int> cpus) : m_device(device) {
+    m_executor = std::thread{[this, cpus = std::move(cpus)] {
+        // The executor takes part in running kernels, so keep it close to the device memory.
+        numa::bind_thread(cpus);
+        executor_loop();
+    }};
+}
+
+cpu_queue::~cpu_queue() {
+    {
+        std::lock_guard<std::mutex> lock{m_mutex};
+        m_stop = true;
+    }
+    m_cv_submit.notify_one();
+    m_executor.join();
+
+    if (m_exception != nullptr) {
+        XPU_LOG("cpu_queue: Dropping exception of a command, queue was destroyed without waiting for it.");
+    }
+}
+
+void cpu_queue::submit(command cmd) {
+    const trace_event *issued = (config::trace ? trace_span::current() : nullptr);
+    if (issued != nullptr) {
+        // Record the command again for the time it runs on the executor.
+        cmd = [cmd = std::move(cmd), ev = *issued, device = m_device]() mutable {
+            static thread_local bool named = false;
+            if (!named) {
+                trace_thread_name(format("xpu queue executor (cpu%d)", device));
+                named = true;
+            }
+            ev.begin_us = trace_now_us();
+            cmd();
+            ev.end_us = trace_now_us();
+            trace_record(std::move(ev));
+        };
+    }
+
+    {
+        std::lock_guard<std::mutex> lock{m_mutex};
+        m_commands.emplace_back(std::move(cmd));
+    }
+    m_cv_submit.notify_one();
+}
+
+int cpu_queue::wait() {
+    std::unique_lock<std::mutex> lock{m_mutex};
+    m_cv_idle.wait(lock, [&] { return m_commands.empty() && !m_busy; });
+    int err = m_error;
+    m_error = 0;
+    std::exception_ptr ex = std::exchange(m_exception, nullptr);
+    lock.unlock();
+
+    if (ex != nullptr) {
+        std::rethrow_exception(ex);
+    }
+    return err;
+}
+
+void cpu_queue::drain() {
+    std::unique_lock<std::mutex> lock{m_mutex};
+    m_cv_idle.wait(lock, [&] { return m_commands.empty() && !m_busy; });
+}
+
+void cpu_queue::fail(int err) {
+    std::lock_guard<std::mutex> lock{m_mutex};
+    if (m_error == 0 && m_exception == nullptr) {
+        m_error = err;
+    }
+}
+
+void cpu_queue::fail(std::exception_ptr ex) {
+    std::lock_guard<std::mutex> lock{m_mutex};
+    if (m_error == 0 && m_exception == nullptr) {
+        m_exception = std::move(ex);
+    }
+}
+
+void cpu_event::reset() {
+    std::lock_guard<std::mutex> lock{m_mutex};
+    m_recorded = true;
+    m_done = false;
+}
+
+void cpu_event::complete() {
+    std::lock_guard<std::mutex> lock{m_mutex};
+    m_time = clock::now();
+    m_done = true;
+    m_cv.notify_all();
+}
+
+void cpu_event::wait() {
+    std::unique_lock<std::mutex> lock{m_mutex};
+    m_cv.wait(lock, [&] { return m_done; });
+}
+
+void cpu_queue::executor_loop() {
+    std::unique_lock<std::mutex> lock{m_mutex};
+    while (true) {
+        m_cv_submit.wait(lock, [&] { return m_stop || !m_commands.empty(); });
+        if (m_commands.empty()) {
+            break; // m_stop is set and all commands are done
+        }
+
+        command cmd = std::move(m_commands.front());
+        m_commands.pop_front();
+        m_busy = true;
+
+        lock.unlock();
+        try {
+            cmd();
+        } catch (...) {
+            // Escaping the executor thread would terminate the program. Report to the next wait() instead.
+            fail(std::current_exception());
+        }
+        cmd = nullptr; // Release captured arguments before signaling completion
+        lock.lock();
+
+        m_busy = false;
+        if (m_commands.empty()) {
+            m_cv_idle.notify_all();
+        }
+    }
+}
@@ -0,0 +1,125 @@
+#ifndef XPU_DRIVER_CPU_CPU_QUEUE_H
+#define XPU_DRIVER_CPU_CPU_QUEUE_H
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace xpu::detail {
+
+/**
+ * Queue of commands executed in FIFO order by a dedicated executor thread.
+ * Backs xpu::queue on the CPU, so work submitted to a queue runs
+ * asynchronously to the host thread.
+ */
+class cpu_queue {
+
+public:
+    using command = std::function<void()>;
+
+    /**
+     * @param cpus Cores the executor thread is restricted to. If empty, it may run on any core.
+     */
+    explicit cpu_queue(int device, std::vector<int> cpus = {});
+    ~cpu_queue();
+
+    cpu_queue(const cpu_queue &) = delete;
+    cpu_queue &operator=(const cpu_queue &) = delete;
+
+    int device() const { return m_device; }
+
+    /**
+     * True if called from a command running on this queue.
+     * Commands issued from there run immediately, as the queue would execute them next anyway.
+     */
+    bool on_executor() const { return std::this_thread::get_id() == m_executor.get_id(); }
+
+    void submit(command);
+
+    /**
+     * Block until all previously submitted commands have finished.
+     * Returns the first error reported by a command since the last call, 0 otherwise.
+     * If a command threw an exception instead, it is rethrown here.
+     */
+    int wait();
+
+    /**
+     * Block until all previously submitted commands have finished.
+     * Unlike wait(), errors are kept for the next call to wait().
+     */
+    void drain();
+
+    /**
+     * Called by a command that failed. The error is returned by the next call to wait().
+     * Only the first error is kept.
+     */
+    void fail(int err);
+
+    /**
+     * Called by the executor if a command threw. The exception is rethrown by the next call to wait().
+     * Only the first error is kept.
+     */
+    void fail(std::exception_ptr);
+
+private:
+    int m_device;
+
+    std::mutex m_mutex;
+    std::condition_variable m_cv_submit;
+    std::condition_variable m_cv_idle;
+    std::deque<command> m_commands;
+    bool m_busy = false;
+    bool m_stop = false;
+    int m_error = 0;
+    std::exception_ptr m_exception;
+
+    std::thread m_executor;
+
+    void executor_loop();
+
+};
+
+/**
+ * Event that is signaled by a cpu_queue once all commands submitted before it have finished.
+ */
+class cpu_event {
+
+public:
+    using clock = std::chrono::steady_clock;
+
+    /**
+     * Mark event as pending. Called when the event is recorded.
+     */
+    void reset();
+
+    /**
+     * Signal the event and store the current time.
+     */
+    void complete();
+
+    /**
+     * Block until the event has been signaled.
+     * Returns immediately if the event was never recorded.
+     */
+    void wait();
+
+    bool recorded() const { return m_recorded; }
+    clock::time_point time() const { return m_time; }
+
+private:
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    bool m_recorded = false;
+    bool m_done = true;
+    clock::time_point m_time;
+
+};
+
+} // namespace xpu::detail
+
+#endif
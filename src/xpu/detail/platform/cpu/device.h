@@ -7,15 +7,38 @@
 
 #include "../../macros.h"
 #include "../../constant_memory.h"
-#include "this_thread.h"
+#include "../../backend.h"
+#include "block_scheduler.h"
+#include "cpu_driver.h"
 
 #include <algorithm>
 #include <cassert>
 #include <cmath>
+#include <functional>
+#include <memory>
+#include <tuple>
 #include <utility>
+#include <vector>
 
 #define XPU_DETAIL_ASSERT(x) assert(x)
 
+// Hint the compiler to vectorize the following loop. Used to run threads as SIMD lanes.
+// XPU_DETAIL_SIMD_LOOP keeps the compiler's dependency analysis, so it only vectorizes when it can
+// prove lanes are independent. GCC has no such hint, instead the loop is unrolled for the SLP vectorizer.
+// XPU_DETAIL_SIMD_LOOP_INDEPENDENT additionally asserts there are no dependencies between iterations.
+// Note: 'omp simd' is not used, as GCC then moves the per-lane thread positions to memory,
+// which prevents vectorization of the kernel body.
+#if defined(__clang__)
+#define XPU_DETAIL_SIMD_LOOP _Pragma("clang loop vectorize(enable)")
+#define XPU_DETAIL_SIMD_LOOP_INDEPENDENT _Pragma("clang loop vectorize(assume_safety)")
+#elif defined(__GNUC__)
+#define XPU_DETAIL_SIMD_LOOP _Pragma("GCC unroll 64")
+#define XPU_DETAIL_SIMD_LOOP_INDEPENDENT _Pragma("GCC ivdep")
+#else
+#define XPU_DETAIL_SIMD_LOOP
+#define XPU_DETAIL_SIMD_LOOP_INDEPENDENT
+#endif
+
 
 // math functions
 XPU_FORCE_INLINE float xpu::abs(float x) { return std::fabs(x); }
@@ -233,7 +256,9 @@ inline unsigned int xpu::atomic_xor_block(unsigned int *addr, unsigned int val)
     return std::exchange(*addr, *addr ^ val);
 }
 
-XPU_FORCE_INLINE void xpu::barrier(xpu::tpos &) { return; }
+XPU_FORCE_INLINE void xpu::barrier(xpu::tpos &) { xpu::detail::block_scheduler::instance().barrier(); }
+
+XPU_FORCE_INLINE void xpu::thread_fence() { __atomic_thread_fence(__ATOMIC_SEQ_CST); }
 
 namespace xpu {
 
@@ -258,19 +283,55 @@ template<typename T, int BlockSize>
 class block_scan<T, BlockSize, cpu> {
 
 public:
-    struct storage_t {};
+    struct storage_t {
+        T items[BlockSize];
+    };
 
-    XPU_D block_scan(tpos &, storage_t &) {}
+    XPU_D block_scan(tpos &pos, storage_t &storage) : m_pos(pos), m_storage(storage) {}
 
-    XPU_D void exclusive_sum(T /*input*/, T &output) { output = T{0}; }
+    XPU_D void exclusive_sum(T input, T &output) { exclusive_sum(input, output, T{0}, std::plus<T>{}); }
 
     template<typename ScanOp>
-    XPU_D void exclusive_sum(T /*input*/, T &output, T initial_value, ScanOp /*scan_op*/) { output = initial_value; }
+    XPU_D void exclusive_sum(T input, T &output, T initial_value, ScanOp scan_op) {
+        int thread = m_pos.impl(detail::internal_fn).thread_idx_linear();
+        scan(input, initial_value, scan_op);
+        output = (thread == 0 ? initial_value : m_storage.items[thread - 1]);
+        barrier(m_pos);
+    }
 
-    XPU_D void inclusive_sum(T input, T &output) { output = input; }
+    XPU_D void inclusive_sum(T input, T &output) { inclusive_sum(input, output, T{0}, std::plus<T>{}); }
 
     template<typename ScanOp>
-    XPU_D void inclusive_sum(T input, T &output, T initial_value, ScanOp scan_op) { output = scan_op(initial_value, input); }
+    XPU_D void inclusive_sum(T input, T &output, T initial_value, ScanOp scan_op) {
+        int thread = m_pos.impl(detail::internal_fn).thread_idx_linear();
+        scan(input, initial_value, scan_op);
+        output = m_storage.items[thread];
+        barrier(m_pos);
+    }
+
+private:
+    tpos &m_pos;
+    storage_t &m_storage;
+
+    // Logical threads of a block run on the same core, so a sequential scan
+    // by the first thread is faster than any parallel scheme.
+    template<typename ScanOp>
+    void scan(T input, T initial_value, ScanOp &scan_op) {
+        detail::tpos_impl &pos = m_pos.impl(detail::internal_fn);
+        int nthreads = pos.block_dim_linear();
+        XPU_DETAIL_ASSERT(nthreads <= BlockSize);
+
+        m_storage.items[pos.thread_idx_linear()] = input;
+        barrier(m_pos);
+        if (pos.thread_idx_linear() == 0) {
+            T acc = initial_value;
+            for (int i = 0; i < nthreads; i++) {
+                acc = scan_op(acc, m_storage.items[i]);
+                m_storage.items[i] = acc;
+            }
+        }
+        barrier(m_pos);
+    }
 
 };
 
@@ -280,16 +341,23 @@ class block_sort<Key, KeyValueType, BlockSize, ItemsPerThread, cpu> {
 public:
     struct storage_t {};
 
-    block_sort(tpos &, storage_t &) {}
+    block_sort(tpos &pos, storage_t &) : m_pos(pos) {}
 
     template<typename KeyGetter>
     KeyValueType *sort(KeyValueType *vals, size_t N, KeyValueType *, KeyGetter &&getKey) {
-        std::sort(vals, &vals[N], [&](const KeyValueType &a, const KeyValueType &b) {
-            return getKey(a) < getKey(b);
-        });
+        barrier(m_pos);
+        if (m_pos.impl(detail::internal_fn).thread_idx_linear() == 0) {
+            std::sort(vals, &vals[N], [&](const KeyValueType &a, const KeyValueType &b) {
+                return getKey(a) < getKey(b);
+            });
+        }
+        barrier(m_pos);
         return vals;
     }
 
+private:
+    tpos &m_pos;
+
 };
 
 template<typename Key, int BlockSize, int ItemsPerThread>
@@ -298,13 +366,20 @@ class block_merge<Key, BlockSize, ItemsPerThread, cpu> {
 public:
     struct storage_t {};
 
-    block_merge(tpos &, storage_t &) {}
+    block_merge(tpos &pos, storage_t &) : m_pos(pos) {}
 
     template<typename Compare>
     void merge(const Key *a, size_t size_a, const Key *b, size_t size_b, Key *dst, Compare &&comp) {
-        std::merge(a, a + size_a, b, b + size_b, dst, comp);
+        barrier(m_pos);
+        if (m_pos.impl(detail::internal_fn).thread_idx_linear() == 0) {
+            std::merge(a, a + size_a, b, b + size_b, dst, comp);
+        }
+        barrier(m_pos);
     }
 
+private:
+    tpos &m_pos;
+
 };
 
 } // namespace xpu
@@ -328,46 +403,257 @@ struct action_runner<kernel_tag, K, void(K::*)(kernel_context<typename K::shared
     using context = kernel_context<shared_memory>;
 
     static int call(kernel_launch_info launch_info, Args... args) {
-        dim block_dim{1, 1, 1};
-        dim grid_dim{};
+        if (launch_info.batch != nullptr) {
+            return call_batch(launch_info);
+        }
 
-        launch_info.g.get_compute_grid(block_dim, grid_dim);
+        auto *driver = static_cast<cpu_driver *>(backend::get(cpu));
+        auto *queue = static_cast<cpu_queue *>(launch_info.queue_handle);
+        thread_pool &pool = driver->pool(queue == nullptr ? driver->active_device() : queue->device());
+
+        // Persistent grids get one block per worker thread
+        dim block_dim = K::block_size::value;
+        dim grid_dim{};
+        launch_info.g.get_compute_grid(block_dim, grid_dim, pool.num_threads());
+        block_dim = dim{std::max(block_dim.x, 1), std::max(block_dim.y, 1), std::max(block_dim.z, 1)};
         XPU_LOG("Calling kernel '%s' [block_dim = (%d, %d, %d), grid_dim = (%d, %d, %d)] with CPU driver.", type_name<K>(), block_dim.x, block_dim.y, block_dim.z, grid_dim.x, grid_dim.y, grid_dim.z);
 
+        double *ms = launch_info.ms;
+        kernel_counters *counters = launch_info.counters;
+
+        if (queue == nullptr || queue->on_executor()) {
+            run_grid(pool, block_dim, grid_dim, ms, counters, args...);
+            return 0;
+        }
+
+        // Arguments are copied, so they stay alive until the kernel ran on the queue.
+        queue->submit([=, &pool]() mutable {
+            run_grid(pool, block_dim, grid_dim, ms, counters, args...);
+        });
+        if (ms != nullptr || counters != nullptr) {
+            return queue->wait(); // Timings must be available when returning
+        }
+
+        return 0;
+    }
+
+private:
+    struct block_range {
+        dim block_dim;
+        dim grid_dim;
+        std::tuple<Args &...> args;
+    };
+
+    using arg_tuple = std::tuple<std::decay_t<Args>...>;
+
+    // Blocks of all instances of a batch are numbered consecutively,
+    // so the whole batch runs as a single parallel region.
+    struct batch_range {
+        std::vector<dim> block_dims;
+        std::vector<dim> grid_dims;
+        std::vector<size_t> first_block; // Per instance, plus the total number of blocks at the end
+        std::vector<arg_tuple> args;
+    };
+
+    static int call_batch(const kernel_launch_info &launch_info) {
+        const kernel_batch &batch = *launch_info.batch;
+        XPU_LOG("Calling kernel '%s' [%zu instances] with CPU driver.", type_name<K>(), batch.size);
+
+        // Copied, so the batch stays valid until it ran on the queue.
+        auto range = std::make_shared<batch_range>();
+        range->block_dims.reserve(batch.size);
+        range->grid_dims.reserve(batch.size);
+        range->first_block.reserve(batch.size + 1);
+        size_t nblocks = 0;
+        for (size_t i = 0; i < batch.size; i++) {
+            dim block_dim = K::block_size::value;
+            dim grid_dim{};
+            batch.grids[i].get_compute_grid(block_dim, grid_dim);
+            block_dim = dim{std::max(block_dim.x, 1), std::max(block_dim.y, 1), std::max(block_dim.z, 1)};
+            range->block_dims.push_back(block_dim);
+            range->grid_dims.push_back(grid_dim);
+            range->first_block.push_back(nblocks);
+            nblocks += grid_dim.linear();
+        }
+        range->first_block.push_back(nblocks);
+        const auto *args = static_cast<const arg_tuple *>(batch.args);
+        range->args.assign(args, args + batch.size);
+
+        auto *driver = static_cast<cpu_driver *>(backend::get(cpu));
+        double *ms = launch_info.ms;
+        kernel_counters *counters = launch_info.counters;
+
+        auto *queue = static_cast<cpu_queue *>(launch_info.queue_handle);
+        if (queue == nullptr || queue->on_executor()) {
+            thread_pool &pool = driver->pool(queue == nullptr ? driver->active_device() : queue->device());
+            run_batch(pool, *range, nblocks, ms, counters);
+            return 0;
+        }
+
+        thread_pool &pool = driver->pool(queue->device());
+        queue->submit([=, &pool]() {
+            run_batch(pool, *range, nblocks, ms, counters);
+        });
+        if (ms != nullptr || counters != nullptr) {
+            return queue->wait();
+        }
+        return 0;
+    }
+
+    static void run_batch(thread_pool &pool, batch_range &range, size_t nblocks, double *ms, kernel_counters *counters) {
         using clock = std::chrono::high_resolution_clock;
         using duration = std::chrono::duration<float, std::milli>;
 
-        bool measure_time = (launch_info.ms != nullptr);
         clock::time_point start;
-
-        if (measure_time) {
+        if (ms != nullptr) {
             start = clock::now();
         }
 
-        #ifdef _OPENMP
-        #pragma omp parallel for schedule(static) collapse(3)
-        #endif
-        for (int i = 0; i < grid_dim.x; i++) {
-            for (int j = 0; j < grid_dim.y; j++) {
-                for (int k = 0; k < grid_dim.z; k++) {
-                    shared_memory smem;
-                    tpos pos{internal_ctor};
-                    constants cmem{internal_ctor};
-                    kernel_context ctx{internal_ctor, pos, smem, cmem};
-                    this_thread::block_idx = dim{i, j, k};
-                    this_thread::grid_dim = grid_dim;
-                    K{}(ctx, args...);
-                }
+        pool.parallel_for(nblocks, &run_batch_blocks, &range, 0, counters);
+
+        if (ms != nullptr) {
+            duration elapsed = clock::now() - start;
+            *ms = elapsed.count();
+            XPU_LOG("Kernel '%s' took %f ms", type_name<K>(), *ms);
+        }
+    }
+
+    static void run_batch_blocks(void *range_ptr, size_t begin, size_t end) {
+        auto &range = *static_cast<batch_range *>(range_ptr);
+        const std::vector<size_t> &first = range.first_block;
+
+        // Chunks are contiguous, so the instance only has to be searched once per chunk.
+        size_t inst = std::upper_bound(first.begin(), first.end(), begin) - first.begin() - 1;
+        for (size_t b = begin; b < end; b++) {
+            while (b >= first[inst + 1]) {
+                inst++;
             }
+            const dim &grid_dim = range.grid_dims[inst];
+            size_t local = b - first[inst];
+            int i = local % grid_dim.x;
+            int j = (local / grid_dim.x) % grid_dim.y;
+            int k = local / (grid_dim.x * grid_dim.y);
+            std::apply([&](Args &... args) {
+                run_block(dim{i, j, k}, range.block_dims[inst], grid_dim, static_cast<int>(inst), args...);
+            }, range.args[inst]);
+        }
+    }
+
+    static void run_grid(thread_pool &pool, dim block_dim, dim grid_dim, double *ms, kernel_counters *counters, Args &... args) {
+        using clock = std::chrono::high_resolution_clock;
+        using duration = std::chrono::duration<float, std::milli>;
+
+        bool measure_time = (ms != nullptr);
+        clock::time_point start;
+
+        if (measure_time) {
+            start = clock::now();
         }
 
+        block_range blocks{block_dim, grid_dim, std::tuple<Args &...>{args...}};
+        pool.parallel_for(grid_dim.linear(), &run_blocks, &blocks, 0, counters);
+
         if (measure_time) {
             duration elapsed = clock::now() - start;
-            *launch_info.ms = elapsed.count();
-            XPU_LOG("Kernel '%s' took %f ms", type_name<K>(), *launch_info.ms);
+            *ms = elapsed.count();
+            XPU_LOG("Kernel '%s' took %f ms", type_name<K>(), *ms);
+        }
+    }
+
+    static void run_blocks(void *range_ptr, size_t begin, size_t end) {
+        auto &range = *static_cast<block_range *>(range_ptr);
+        const dim &grid_dim = range.grid_dim;
+        for (size_t b = begin; b < end; b++) {
+            int i = b % grid_dim.x;
+            int j = (b / grid_dim.x) % grid_dim.y;
+            int k = b / (grid_dim.x * grid_dim.y);
+            std::apply([&](Args &... args) {
+                run_block(dim{i, j, k}, range.block_dim, grid_dim, 0, args...);
+            }, range.args);
         }
+    }
 
-        return 0;
+    static void run_block(dim block_idx, dim block_dim, dim grid_dim, int instance, Args &... args) {
+        // Shared and constant memory are created once per block and visible to all its threads.
+        shared_memory smem;
+        constants cmem{internal_ctor};
+
+        if constexpr (K::cpu_simd_width::value > 1) {
+            run_block_lanes(smem, cmem, block_idx, block_dim, grid_dim, instance, args...);
+            return;
+        }
+
+        auto run_thread = [&](int thread) {
+            dim thread_idx{
+                thread % block_dim.x,
+                (thread / block_dim.x) % block_dim.y,
+                thread / (block_dim.x * block_dim.y),
+            };
+            tpos pos{internal_ctor, thread_idx, block_dim, block_idx, grid_dim, instance};
+            kernel_context ctx{internal_ctor, pos, smem, cmem};
+            K{}(ctx, args...);
+        };
+
+        block_scheduler::instance().run(block_dim.linear(), &invoke_thread<decltype(run_thread)>, &run_thread);
+    }
+
+    // Trivial arguments (e.g. pointers) are passed to run_block_lanes by value. Otherwise the compiler
+    // has to assume stores in the kernel may modify them and reloads them in every iteration.
+    template<typename T>
+    using lane_arg_t = std::conditional_t<std::is_trivially_copyable_v<T>, T, T &>;
+
+    // Run threads directly from a loop in batches of 'Width' lanes, so the compiler can vectorize
+    // across threads. Only allowed for kernels that don't synchronize threads.
+    static void run_block_lanes(shared_memory &smem, constants &cmem, dim block_idx, dim block_dim, dim grid_dim, int instance, lane_arg_t<Args>... args) {
+        constexpr int Width = K::cpu_simd_width::value;
+        block_scheduler::lane_scope lanes;
+
+        int nthreads = block_dim.linear();
+        int nfull = nthreads / Width * Width;
+
+        auto run_lanes = [&](auto thread_idx_of) {
+            auto run_lane = [&](int thread) {
+                tpos pos{internal_ctor, thread_idx_of(thread), block_dim, block_idx, grid_dim, instance};
+                kernel_context ctx{internal_ctor, pos, smem, cmem};
+                K{}(ctx, args...);
+            };
+
+            // Fixed trip count, so the loop maps directly to vector instructions without a remainder.
+            for (int base = 0; base < nfull; base += Width) {
+                if constexpr (K::cpu_simd_width::independent) {
+                    XPU_DETAIL_SIMD_LOOP_INDEPENDENT
+                    for (int lane = 0; lane < Width; lane++) {
+                        run_lane(base + lane);
+                    }
+                } else {
+                    XPU_DETAIL_SIMD_LOOP
+                    for (int lane = 0; lane < Width; lane++) {
+                        run_lane(base + lane);
+                    }
+                }
+            }
+            for (int thread = nfull; thread < nthreads; thread++) {
+                run_lane(thread);
+            }
+        };
+
+        // Avoid divisions for the common 1D case
+        if (block_dim.y == 1 && block_dim.z == 1) {
+            run_lanes([](int thread) { return dim{thread, 0, 0}; });
+        } else {
+            run_lanes([&](int thread) {
+                return dim{
+                    thread % block_dim.x,
+                    (thread / block_dim.x) % block_dim.y,
+                    thread / (block_dim.x * block_dim.y),
+                };
+            });
+        }
+    }
+
+    template<typename F>
+    static void invoke_thread(void *f, int thread) {
+        (*static_cast<F *>(f))(thread);
     }
 
 };
@@ -0,0 +1,158 @@
+#include "numa.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#ifdef __linux__
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+using namespace xpu::detail;
+
+#ifdef __linux__
+
+// From linux/mempolicy.h, to avoid a dependency on libnuma
+static constexpr int mpol_preferred = 1;
+static constexpr unsigned mpol_mf_move = 1 << 1;
+
+// Parse lists like "0-3,8,10-11"
+static std::vector<int> parse_cpulist(const std::string &list) {
+    std::vector<int> cpus;
+    std::stringstream ss{list};
+    std::string range;
+    while (std::getline(ss, range, ',')) {
+        int first = 0, last = 0;
+        int n = std::sscanf(range.c_str(), "%d-%d", &first, &last);
+        if (n == 1) {
+            last = first;
+        } else if (n != 2) {
+            continue;
+        }
+        for (int c = first; c <= last; c++) {
+            cpus.push_back(c);
+        }
+    }
+    return cpus;
+}
+
+std::vector<numa::node> numa::detect_nodes() {
+    std::vector<node> nodes;
+
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    bool have_affinity = (sched_getaffinity(0, sizeof(allowed), &allowed) == 0);
+
+    DIR *dir = opendir("/sys/devices/system/node");
+    if (dir != nullptr) {
+        while (dirent *entry = readdir(dir)) {
+            int id = 0;
+            if (std::sscanf(entry->d_name, "node%d", &id) != 1) {
+                continue;
+            }
+            std::ifstream file{"/sys/devices/system/node/" + std::string{entry->d_name} + "/cpulist"};
+            std::string list;
+            std::getline(file, list);
+
+            node n{id, {}};
+            for (int cpu : parse_cpulist(list)) {
+                if (!have_affinity || CPU_ISSET(cpu, &allowed)) {
+                    n.cpus.push_back(cpu);
+                }
+            }
+            if (!n.cpus.empty()) {
+                nodes.push_back(n);
+            }
+        }
+        closedir(dir);
+    }
+
+    if (nodes.empty()) {
+        return {node{0, {}}};
+    }
+
+    std::sort(nodes.begin(), nodes.end(), [](const node &a, const node &b) { return a.id < b.id; });
+    return nodes;
+}
+
+bool numa::meminfo(int node, size_t *free, size_t *total) {
+    std::ifstream file{"/sys/devices/system/node/node" + std::to_string(node) + "/meminfo"};
+    if (!file) {
+        return false;
+    }
+
+    bool have_free = false, have_total = false;
+    std::string line;
+    while (std::getline(file, line)) {
+        // Lines have the form "Node 0 MemTotal:       5471992 kB"
+        int id = 0;
+        char key[64];
+        size_t kb = 0;
+        if (std::sscanf(line.c_str(), "Node %d %63[^:]: %zu", &id, key, &kb) != 3) {
+            continue;
+        }
+        if (std::string{key} == "MemTotal") {
+            *total = kb * 1024;
+            have_total = true;
+        } else if (std::string{key} == "MemFree") {
+            *free = kb * 1024;
+            have_free = true;
+        }
+    }
+    return have_free && have_total;
+}
+
+void *numa::alloc_on_node(size_t bytes, int node) {
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t len = (bytes + page_size - 1) / page_size * page_size;
+    void *ptr = std::aligned_alloc(page_size, len);
+    if (ptr == nullptr) {
+        return nullptr;
+    }
+
+    constexpr size_t bits = 8 * sizeof(unsigned long);
+    std::vector<unsigned long> mask(node / bits + 1, 0);
+    mask[node / bits] = 1ul << (node % bits);
+    // Failure is not fatal, pages are then placed on first touch.
+    syscall(SYS_mbind, ptr, len, mpol_preferred, mask.data(), mask.size() * bits + 1, mpol_mf_move);
+
+    return ptr;
+}
+
+void numa::bind_thread(const std::vector<int> &cpus) {
+    if (cpus.empty()) {
+        return;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus) {
+        CPU_SET(cpu, &set);
+    }
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+#else // No NUMA support on other platforms
+
+std::vector<numa::node> numa::detect_nodes() {
+    return {node{0, {}}};
+}
+
+bool numa::meminfo(int, size_t *, size_t *) {
+    return false;
+}
+
+void *numa::alloc_on_node(size_t bytes, int) {
+    return std::malloc(bytes);
+}
+
+void numa::bind_thread(const std::vector<int> &) {
+}
+
+#endif
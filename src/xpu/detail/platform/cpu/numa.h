@@ -0,0 +1,39 @@
+#ifndef XPU_DRIVER_CPU_NUMA_H
+#define XPU_DRIVER_CPU_NUMA_H
+
+#include <cstddef>
+#include <vector>
+
+namespace xpu::detail::numa {
+
+struct node {
+    int id; // Node id of the OS
+    std::vector<int> cpus; // Cores of this node the process may run on
+};
+
+/**
+ * Detect NUMA nodes from /sys/devices/system/node.
+ * Nodes without usable cores (e.g. memory-only nodes) are skipped.
+ * Returns a single node with an empty core list, if the topology can't be read.
+ */
+std::vector<node> detect_nodes();
+
+/**
+ * Get free and total memory of a node.
+ */
+bool meminfo(int node, size_t *free, size_t *total);
+
+/**
+ * Allocate page aligned memory, preferably placed on the given node.
+ * Returns nullptr on failure. Memory is released with std::free.
+ */
+void *alloc_on_node(size_t bytes, int node);
+
+/**
+ * Restrict the calling thread to the given cores.
+ */
+void bind_thread(const std::vector<int> &cpus);
+
+} // namespace xpu::detail::numa
+
+#endif
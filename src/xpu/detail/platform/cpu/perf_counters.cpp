@@ -0,0 +1,117 @@
+#include "perf_counters.h"
+
+#include "../../log.h"
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+using namespace xpu::detail;
+
+perf_counters *perf_counters::this_thread() {
+    static thread_local std::unique_ptr<perf_counters> counters = [] {
+        std::unique_ptr<perf_counters> c{new perf_counters{}};
+        if (not c->open()) {
+            c.reset();
+        }
+        return c;
+    }();
+    return counters.get();
+}
+
+perf_counters::perf_counters() {
+    for (int &fd : m_fds) {
+        fd = -1;
+    }
+}
+
+perf_counters::~perf_counters() {
+#ifdef __linux__
+    for (int fd : m_fds) {
+        if (fd != -1) {
+            close(fd);
+        }
+    }
+#endif
+}
+
+#ifdef __linux__
+
+bool perf_counters::open() {
+    // Order matches the fields read into kernel_counters
+    static constexpr unsigned long long events[n_events] = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_REFERENCES,
+        PERF_COUNT_HW_CACHE_MISSES,
+        PERF_COUNT_HW_BRANCH_MISSES,
+    };
+
+    for (int i = 0; i < n_events; i++) {
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = events[i];
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        int group = (i == 0 ? -1 : m_fds[0]);
+        long fd = syscall(SYS_perf_event_open, &attr, 0 /* calling thread */, -1 /* any cpu */, group, PERF_FLAG_FD_CLOEXEC);
+        if (fd == -1) {
+            static std::atomic<bool> reported{false};
+            if (not reported.exchange(true)) {
+                XPU_LOG("Hardware counters not available, perf_event_open failed: %s", std::strerror(errno));
+            }
+            return false;
+        }
+        m_fds[i] = static_cast<int>(fd);
+    }
+    return true;
+}
+
+bool perf_counters::read(kernel_counters &c) const {
+    struct {
+        uint64_t nr;
+        uint64_t time_enabled;
+        uint64_t time_running;
+        uint64_t values[n_events];
+    } data;
+
+    if (::read(m_fds[0], &data, sizeof(data)) != static_cast<ssize_t>(sizeof(data)) || data.nr != n_events || data.time_running == 0) {
+        return false;
+    }
+
+    // Scale up, if the group had to share the PMU with other events
+    double scale = static_cast<double>(data.time_enabled) / data.time_running;
+    auto scaled = [&](int i) { return static_cast<unsigned long long>(data.values[i] * scale); };
+
+    c.valid = true;
+    c.cycles = scaled(0);
+    c.instructions = scaled(1);
+    c.llc_references = scaled(2);
+    c.llc_misses = scaled(3);
+    c.branch_misses = scaled(4);
+    return true;
+}
+
+#else
+
+bool perf_counters::open() {
+    return false;
+}
+
+bool perf_counters::read(kernel_counters &) const {
+    return false;
+}
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef XPU_DRIVER_CPU_PERF_COUNTERS_H
+#define XPU_DRIVER_CPU_PERF_COUNTERS_H
+
+#include "../../common.h"
+
+namespace xpu::detail {
+
+/**
+ * Hardware counters of a single thread, opened with perf_event_open.
+ * Cycles, instructions, last level cache references and misses and branch misses
+ * are opened as one group, so the kernel always schedules them together.
+ * Only events in user space are counted, which works with the default perf_event_paranoid setting.
+ */
+class perf_counters {
+
+public:
+    /**
+     * Counters of the calling thread, opened on the first call.
+     * Returns nullptr if they're not available (e.g. no PMU in a VM, or perf events are disabled).
+     */
+    static perf_counters *this_thread();
+
+    ~perf_counters();
+
+    perf_counters(const perf_counters &) = delete;
+    perf_counters &operator=(const perf_counters &) = delete;
+
+    // Events counted since the counters were opened.
+    bool read(kernel_counters &) const;
+
+private:
+    static constexpr int n_events = 5;
+
+    int m_fds[n_events];
+
+    perf_counters();
+    bool open();
+};
+
+} // namespace xpu::detail
+
+#endif
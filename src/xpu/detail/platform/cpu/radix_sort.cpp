@@ -0,0 +1,255 @@
+#include "radix_sort.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+using namespace xpu::detail;
+
+namespace {
+
+constexpr int digit_bits = 8;
+constexpr size_t num_digits = size_t{1} << digit_bits;
+
+// Minimum number of keys per chunk. Smaller inputs are sorted by a single thread.
+constexpr size_t min_chunk_size = 16384;
+
+using histogram = std::array<size_t, num_digits>;
+
+enum class key_kind {
+    unsigned_int,
+    signed_int,
+    floating_point,
+};
+
+struct no_value {};
+
+// Call f(i) for i in [0, n) on the pool.
+template<typename F>
+void parallel_for(thread_pool &pool, size_t n, F &f) {
+    pool.parallel_for(n, [](void *args, size_t begin, size_t end) {
+        F &fn = *static_cast<F *>(args);
+        for (size_t i = begin; i < end; i++) {
+            fn(i);
+        }
+    }, &f, 1);
+}
+
+template<typename UKey>
+constexpr UKey sign_bit = UKey{1} << (sizeof(UKey) * 8 - 1);
+
+// Map keys to unsigned integers with the same order.
+// Negative floats have all bits flipped, positive floats only the sign bit.
+template<key_kind K, typename UKey>
+UKey encode(UKey k) {
+    if constexpr (K == key_kind::signed_int) {
+        return k ^ sign_bit<UKey>;
+    } else if constexpr (K == key_kind::floating_point) {
+        return k ^ ((k & sign_bit<UKey>) ? ~UKey{0} : sign_bit<UKey>);
+    } else {
+        return k;
+    }
+}
+
+template<key_kind K, typename UKey>
+UKey decode(UKey k) {
+    if constexpr (K == key_kind::signed_int) {
+        return k ^ sign_bit<UKey>;
+    } else if constexpr (K == key_kind::floating_point) {
+        return k ^ ((k & sign_bit<UKey>) ? sign_bit<UKey> : ~UKey{0});
+    } else {
+        return k;
+    }
+}
+
+template<key_kind K, typename UKey, typename Value>
+void sort_encoded(thread_pool &pool, UKey *keys, Value *values, size_t n) {
+    constexpr bool has_values = !std::is_same_v<Value, no_value>;
+    constexpr int npasses = sizeof(UKey) * 8 / digit_bits;
+
+    size_t nchunks = std::clamp<size_t>(n / min_chunk_size, 1, static_cast<size_t>(pool.num_threads()) * 2);
+    auto chunk_begin = [&](size_t c) { return n * c / nchunks; };
+
+    // Encode keys and count the digits of all passes at once,
+    // so passes where all keys share the same digit can be skipped.
+    std::vector<std::array<histogram, npasses>> counts(nchunks);
+    auto encode_and_count = [&](size_t c) {
+        auto &h = counts[c];
+        for (histogram &p : h) {
+            p.fill(0);
+        }
+        for (size_t i = chunk_begin(c); i < chunk_begin(c + 1); i++) {
+            UKey k = encode<K>(keys[i]);
+            keys[i] = k;
+            for (int p = 0; p < npasses; p++) {
+                h[p][(k >> (p * digit_bits)) & (num_digits - 1)]++;
+            }
+        }
+    };
+    parallel_for(pool, nchunks, encode_and_count);
+
+    std::unique_ptr<UKey[]> key_buf{new UKey[n]};
+    std::unique_ptr<Value[]> value_buf{has_values ? new Value[n] : nullptr};
+
+    UKey *src = keys;
+    UKey *dst = key_buf.get();
+    Value *vsrc = values;
+    Value *vdst = value_buf.get();
+
+    std::vector<histogram> offsets(nchunks);
+    bool first_pass = true;
+    for (int p = 0; p < npasses; p++) {
+        int shift = p * digit_bits;
+
+        bool trivial = false;
+        for (size_t d = 0; d < num_digits && !trivial; d++) {
+            size_t total = 0;
+            for (size_t c = 0; c < nchunks; c++) {
+                total += counts[c][p][d];
+            }
+            trivial = (total == n);
+        }
+        if (trivial) {
+            continue;
+        }
+
+        // The initial counts are only valid for the original order of keys.
+        if (first_pass) {
+            for (size_t c = 0; c < nchunks; c++) {
+                offsets[c] = counts[c][p];
+            }
+        } else {
+            auto count = [&](size_t c) {
+                histogram &h = offsets[c];
+                h.fill(0);
+                for (size_t i = chunk_begin(c); i < chunk_begin(c + 1); i++) {
+                    h[(src[i] >> shift) & (num_digits - 1)]++;
+                }
+            };
+            parallel_for(pool, nchunks, count);
+        }
+        first_pass = false;
+
+        // Keys with a digit d from chunk c go after all keys with smaller digits
+        // and after keys with digit d from earlier chunks. This keeps the sort stable.
+        size_t sum = 0;
+        for (size_t d = 0; d < num_digits; d++) {
+            for (size_t c = 0; c < nchunks; c++) {
+                size_t cnt = offsets[c][d];
+                offsets[c][d] = sum;
+                sum += cnt;
+            }
+        }
+
+        auto scatter = [&](size_t c) {
+            histogram off = offsets[c];
+            for (size_t i = chunk_begin(c); i < chunk_begin(c + 1); i++) {
+                UKey k = src[i];
+                size_t o = off[(k >> shift) & (num_digits - 1)]++;
+                dst[o] = k;
+                if constexpr (has_values) {
+                    vdst[o] = vsrc[i];
+                }
+            }
+        };
+        parallel_for(pool, nchunks, scatter);
+
+        std::swap(src, dst);
+        std::swap(vsrc, vdst);
+    }
+
+    // Move results back into the input buffers, if needed, and restore the original key representation.
+    auto finish = [&](size_t c) {
+        for (size_t i = chunk_begin(c); i < chunk_begin(c + 1); i++) {
+            keys[i] = decode<K>(src[i]);
+            if constexpr (has_values) {
+                if (vsrc != values) {
+                    values[i] = vsrc[i];
+                }
+            }
+        }
+    };
+    parallel_for(pool, nchunks, finish);
+}
+
+// Sort keys with payloads of arbitrary size, by sorting indices and gathering the payloads afterwards.
+template<key_kind K, typename UKey, typename Index>
+void sort_gather(thread_pool &pool, UKey *keys, std::byte *values, size_t n, size_t value_size) {
+    size_t nchunks = std::clamp<size_t>(n / min_chunk_size, 1, static_cast<size_t>(pool.num_threads()) * 2);
+    auto chunk_begin = [&](size_t c) { return n * c / nchunks; };
+
+    std::unique_ptr<Index[]> index{new Index[n]};
+    auto iota = [&](size_t c) {
+        for (size_t i = chunk_begin(c); i < chunk_begin(c + 1); i++) {
+            index[i] = static_cast<Index>(i);
+        }
+    };
+    parallel_for(pool, nchunks, iota);
+
+    sort_encoded<K>(pool, keys, index.get(), n);
+
+    std::unique_ptr<std::byte[]> tmp{new std::byte[n * value_size]};
+    auto gather = [&](size_t c) {
+        for (size_t i = chunk_begin(c); i < chunk_begin(c + 1); i++) {
+            std::memcpy(&tmp[i * value_size], &values[index[i] * value_size], value_size);
+        }
+    };
+    parallel_for(pool, nchunks, gather);
+
+    auto copy_back = [&](size_t c) {
+        size_t begin = chunk_begin(c);
+        size_t end = chunk_begin(c + 1);
+        std::memcpy(&values[begin * value_size], &tmp[begin * value_size], (end - begin) * value_size);
+    };
+    parallel_for(pool, nchunks, copy_back);
+}
+
+template<key_kind K, typename UKey>
+void sort_keys(thread_pool &pool, void *keys_, void *values, size_t n, size_t value_size) {
+    UKey *keys = static_cast<UKey *>(keys_);
+    if (values == nullptr || value_size == 0) {
+        sort_encoded<K, UKey, no_value>(pool, keys, nullptr, n);
+    } else if (value_size == sizeof(uint32_t)) {
+        sort_encoded<K>(pool, keys, static_cast<uint32_t *>(values), n);
+    } else if (value_size == sizeof(uint64_t)) {
+        sort_encoded<K>(pool, keys, static_cast<uint64_t *>(values), n);
+    } else if (n <= UINT32_MAX) {
+        sort_gather<K, UKey, uint32_t>(pool, keys, static_cast<std::byte *>(values), n, value_size);
+    } else {
+        sort_gather<K, UKey, uint64_t>(pool, keys, static_cast<std::byte *>(values), n, value_size);
+    }
+}
+
+} // namespace
+
+void xpu::detail::radix_sort(thread_pool &pool, void *keys, void *values, size_t n, sort_key_t type, size_t value_size) {
+    if (n <= 1) {
+        return;
+    }
+
+    switch (type) {
+    case sort_key_int32:
+        sort_keys<key_kind::signed_int, uint32_t>(pool, keys, values, n, value_size);
+        break;
+    case sort_key_uint32:
+        sort_keys<key_kind::unsigned_int, uint32_t>(pool, keys, values, n, value_size);
+        break;
+    case sort_key_int64:
+        sort_keys<key_kind::signed_int, uint64_t>(pool, keys, values, n, value_size);
+        break;
+    case sort_key_uint64:
+        sort_keys<key_kind::unsigned_int, uint64_t>(pool, keys, values, n, value_size);
+        break;
+    case sort_key_float:
+        sort_keys<key_kind::floating_point, uint32_t>(pool, keys, values, n, value_size);
+        break;
+    case sort_key_double:
+        sort_keys<key_kind::floating_point, uint64_t>(pool, keys, values, n, value_size);
+        break;
+    }
+}
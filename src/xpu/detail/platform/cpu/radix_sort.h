@@ -0,0 +1,25 @@
+#ifndef XPU_DRIVER_CPU_RADIX_SORT_H
+#define XPU_DRIVER_CPU_RADIX_SORT_H
+
+#include "../../common.h"
+
+#include <cstddef>
+
+namespace xpu::detail {
+
+class thread_pool;
+
+/**
+ * Stable LSD radix sort of n keys on the threads of a pool.
+ * If values is not null, each key carries a payload of value_size bytes.
+ *
+ * Keys are processed in 8 bit digits. Each pass counts digits per chunk of the
+ * input in parallel, computes the output offsets of every chunk and then scatters
+ * all chunks in parallel. Passes where all keys share the same digit are skipped.
+ * Signed and floating point keys are mapped to unsigned integers that sort in the same order.
+ */
+void radix_sort(thread_pool &, void *keys, void *values, size_t n, sort_key_t, size_t value_size);
+
+} // namespace xpu::detail
+
+#endif
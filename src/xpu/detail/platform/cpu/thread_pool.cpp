@@ -0,0 +1,346 @@
+#include "thread_pool.h"
+#include "numa.h"
+#include "perf_counters.h"
+
+#include <algorithm>
+#include <cstdint>
+
+using namespace xpu::detail;
+
+// Number of times an idle worker looks for work before it parks.
+static constexpr int spin_limit = 4096;
+
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+// Call fn and add the hardware events it caused on the calling thread to 'counters'.
+static void run_counted(thread_pool::task_fn fn, void *args, size_t begin, size_t end, kernel_counters &counters, std::mutex *mutex) {
+    perf_counters *pc = perf_counters::this_thread();
+    kernel_counters before;
+    if (pc == nullptr || !pc->read(before)) {
+        fn(args, begin, end);
+        return;
+    }
+
+    fn(args, begin, end);
+
+    kernel_counters after;
+    if (!pc->read(after)) {
+        return;
+    }
+    if (mutex == nullptr) {
+        counters.add(kernel_counters::delta(before, after));
+    } else {
+        std::lock_guard<std::mutex> lock{*mutex};
+        counters.add(kernel_counters::delta(before, after));
+    }
+}
+
+struct thread_pool::job {
+    task_fn fn;
+    void *args;
+    size_t chunk_size;
+    std::atomic<size_t> remaining;
+
+    kernel_counters *counters = nullptr;
+    std::mutex counters_mutex;
+
+    std::atomic<bool> done{false};
+    std::mutex mutex;
+    std::condition_variable cv;
+
+    void finish(size_t items) {
+        if (remaining.fetch_sub(items, std::memory_order_acq_rel) == items) {
+            std::lock_guard<std::mutex> lock{mutex};
+            done.store(true, std::memory_order_release);
+            cv.notify_all();
+        }
+    }
+
+    void wait() {
+        for (int i = 0; i < spin_limit && !done.load(std::memory_order_acquire); i++) {
+            cpu_relax();
+        }
+        // Always acquire the lock, so the finishing thread is guaranteed
+        // to be done with the job before it goes out of scope.
+        std::unique_lock<std::mutex> lock{mutex};
+        cv.wait(lock, [&] { return done.load(std::memory_order_acquire); });
+    }
+};
+
+// Chase-Lev work-stealing deque with a fixed capacity.
+// See: Le et al., "Correct and Efficient Work-Stealing for Weak Memory Models", PPoPP 2013.
+// The owning worker pushes and pops at the bottom, other threads steal from the top.
+class thread_pool::work_deque {
+
+public:
+    bool push(const task &t) {
+        int64_t b = m_bottom.load(std::memory_order_relaxed);
+        int64_t top = m_top.load(std::memory_order_acquire);
+        if (b - top >= capacity) {
+            return false;
+        }
+        store(b, t);
+        std::atomic_thread_fence(std::memory_order_release);
+        m_bottom.store(b + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    bool pop(task &t) {
+        int64_t b = m_bottom.load(std::memory_order_relaxed) - 1;
+        m_bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t top = m_top.load(std::memory_order_relaxed);
+
+        if (top > b) { // Empty
+            m_bottom.store(b + 1, std::memory_order_relaxed);
+            return false;
+        }
+
+        t = load(b);
+        if (top == b) { // Last item, race against thieves
+            bool won = m_top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+            m_bottom.store(b + 1, std::memory_order_relaxed);
+            return won;
+        }
+        return true;
+    }
+
+    bool steal(task &t) {
+        int64_t top = m_top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t b = m_bottom.load(std::memory_order_acquire);
+        if (top >= b) {
+            return false;
+        }
+        t = load(top);
+        return m_top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+    }
+
+private:
+    static constexpr int64_t capacity = 1024;
+
+    // Slots are atomic, as a thief may read a slot while the owner overwrites it.
+    // The thief discards the value in this case, as its CAS on m_top fails.
+    struct slot {
+        std::atomic<job *> j;
+        std::atomic<size_t> begin;
+        std::atomic<size_t> end;
+    };
+
+    alignas(64) std::atomic<int64_t> m_top{0};
+    alignas(64) std::atomic<int64_t> m_bottom{0};
+    slot m_slots[capacity];
+
+    void store(int64_t i, const task &t) {
+        slot &s = m_slots[i % capacity];
+        s.j.store(t.j, std::memory_order_relaxed);
+        s.begin.store(t.begin, std::memory_order_relaxed);
+        s.end.store(t.end, std::memory_order_relaxed);
+    }
+
+    task load(int64_t i) const {
+        const slot &s = m_slots[i % capacity];
+        return task{
+            s.j.load(std::memory_order_relaxed),
+            s.begin.load(std::memory_order_relaxed),
+            s.end.load(std::memory_order_relaxed),
+        };
+    }
+
+};
+
+struct thread_pool::worker {
+    int id;
+    work_deque deque;
+    std::thread thread;
+};
+
+thread_pool::thread_pool(int nthreads, size_t chunk_size, std::vector<int> cpus) : m_chunk_size(chunk_size), m_cpus(std::move(cpus)) {
+    if (nthreads <= 0) {
+        nthreads = std::max<int>(std::thread::hardware_concurrency(), 1);
+    }
+
+    for (int i = 0; i < nthreads - 1; i++) {
+        auto w = std::make_unique<worker>();
+        w->id = i;
+        m_workers.emplace_back(std::move(w));
+    }
+    // Start threads only after all workers exist, as they steal from each other.
+    for (auto &w : m_workers) {
+        w->thread = std::thread{[this, wp = w.get()] { worker_loop(*wp); }};
+    }
+}
+
+thread_pool::~thread_pool() {
+    m_stop.store(true);
+    wake_workers();
+    for (auto &w : m_workers) {
+        w->thread.join();
+    }
+}
+
+void thread_pool::parallel_for(size_t n, task_fn fn, void *args, size_t chunk_size, kernel_counters *counters) {
+    if (n == 0) {
+        return;
+    }
+
+    size_t nthreads = num_threads();
+    if (chunk_size == 0) {
+        chunk_size = m_chunk_size;
+    }
+    if (chunk_size == 0) {
+        // Aim for several chunks per thread, so stealing can even out the load.
+        chunk_size = std::max<size_t>(1, n / (nthreads * 8));
+    }
+
+    if (m_workers.empty() || n <= chunk_size) {
+        if (counters == nullptr) {
+            fn(args, 0, n);
+        } else {
+            run_counted(fn, args, 0, n, *counters, nullptr);
+        }
+        return;
+    }
+
+    job j;
+    j.fn = fn;
+    j.args = args;
+    j.chunk_size = chunk_size;
+    j.counters = counters;
+    j.remaining.store(n, std::memory_order_relaxed);
+
+    // Hand out one range per thread right away, instead of waiting for
+    // workers to split a single range.
+    size_t nchunks = (n + chunk_size - 1) / chunk_size;
+    size_t nparts = std::min(nthreads, nchunks);
+    {
+        std::lock_guard<std::mutex> lock{m_inject_mutex};
+        for (size_t i = 0; i < nparts; i++) {
+            size_t begin = (nchunks * i / nparts) * chunk_size;
+            size_t end = std::min(n, (nchunks * (i + 1) / nparts) * chunk_size);
+            m_inject.push_back(task{&j, begin, end});
+        }
+        m_inject_size.store(m_inject.size(), std::memory_order_release);
+    }
+    wake_workers();
+
+    // Help out until there is nothing left to take.
+    task t;
+    while (j.remaining.load(std::memory_order_acquire) > 0 && (pop_external(t) || steal(nullptr, t))) {
+        execute(nullptr, t);
+    }
+
+    j.wait();
+}
+
+void thread_pool::worker_loop(worker &w) {
+    numa::bind_thread(m_cpus);
+
+    int spins = 0;
+    while (!m_stop.load(std::memory_order_relaxed)) {
+        task t;
+        if (find_task(&w, t)) {
+            execute(&w, t);
+            spins = 0;
+            continue;
+        }
+
+        if (++spins < spin_limit) {
+            cpu_relax();
+            continue;
+        }
+
+        unsigned long long epoch = m_epoch.load();
+        m_parked.fetch_add(1);
+        if (find_task(&w, t)) {
+            m_parked.fetch_sub(1);
+            execute(&w, t);
+            spins = 0;
+            continue;
+        }
+        {
+            std::unique_lock<std::mutex> lock{m_park_mutex};
+            m_park_cv.wait(lock, [&] { return m_stop.load() || m_epoch.load() != epoch; });
+        }
+        m_parked.fetch_sub(1);
+        spins = 0;
+    }
+}
+
+bool thread_pool::find_task(worker *w, task &t) {
+    return w->deque.pop(t) || pop_external(t) || steal(w, t);
+}
+
+bool thread_pool::steal(worker *self, task &t) {
+    size_t nworkers = m_workers.size();
+    size_t start = (self == nullptr ? 0 : self->id + 1);
+    for (size_t i = 0; i < nworkers; i++) {
+        worker &victim = *m_workers[(start + i) % nworkers];
+        if (&victim != self && victim.deque.steal(t)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void thread_pool::execute(worker *w, task t) {
+    job &j = *t.j;
+
+    // Split off the right half until a single chunk is left. Other threads
+    // may steal the split off ranges in the meantime.
+    while (t.end - t.begin > j.chunk_size) {
+        size_t nchunks = (t.end - t.begin + j.chunk_size - 1) / j.chunk_size;
+        size_t mid = t.begin + (nchunks / 2) * j.chunk_size;
+        task right{&j, mid, t.end};
+        if (w == nullptr) {
+            push_external(right);
+        } else if (!w->deque.push(right)) {
+            break; // Deque is full, process the remaining range directly.
+        }
+        if (m_parked.load() > 0) {
+            wake_workers();
+        }
+        t.end = mid;
+    }
+
+    if (j.counters == nullptr) {
+        j.fn(j.args, t.begin, t.end);
+    } else {
+        run_counted(j.fn, j.args, t.begin, t.end, *j.counters, &j.counters_mutex);
+    }
+    j.finish(t.end - t.begin);
+}
+
+void thread_pool::push_external(task t) {
+    std::lock_guard<std::mutex> lock{m_inject_mutex};
+    m_inject.push_back(t);
+    m_inject_size.store(m_inject.size(), std::memory_order_release);
+}
+
+bool thread_pool::pop_external(task &t) {
+    if (m_inject_size.load(std::memory_order_acquire) == 0) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock{m_inject_mutex};
+    if (m_inject.empty()) {
+        return false;
+    }
+    t = m_inject.front();
+    m_inject.pop_front();
+    m_inject_size.store(m_inject.size(), std::memory_order_release);
+    return true;
+}
+
+void thread_pool::wake_workers() {
+    m_epoch.fetch_add(1);
+    if (m_parked.load() > 0 || m_stop.load()) {
+        std::lock_guard<std::mutex> lock{m_park_mutex};
+        m_park_cv.notify_all();
+    }
+}
@@ -0,0 +1,92 @@
+#ifndef XPU_DRIVER_CPU_THREAD_POOL_H
+#define XPU_DRIVER_CPU_THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace xpu::detail {
+
+struct kernel_counters;
+
+/**
+ * Persistent pool of worker threads used to run CPU kernels.
+ *
+ * Work is split into ranges that are pushed into per-worker work-stealing
+ * deques (Chase-Lev). Workers split large ranges in half and keep the left
+ * half, so idle workers can steal the larger right halves from the top of the
+ * deque. Idle workers spin for a short time before parking on a condition variable.
+ *
+ * The thread calling parallel_for takes part in the work, so a pool with
+ * N threads spawns N - 1 workers.
+ */
+class thread_pool {
+
+public:
+    using task_fn = void(*)(void *, size_t, size_t);
+
+    /**
+     * @param nthreads Number of threads working on a parallel_for (including the caller).
+     *   If 0, the number of hardware threads is used.
+     * @param chunk_size Default number of items a thread processes at once.
+     *   If 0, chunk sizes are picked automatically.
+     * @param cpus Cores the workers are restricted to. If empty, workers may run on any core.
+     */
+    thread_pool(int nthreads, size_t chunk_size, std::vector<int> cpus = {});
+    ~thread_pool();
+
+    /**
+     * Call fn(args, begin, end) on disjoint chunks covering [0, n).
+     * Blocks until all chunks have been processed.
+     * Safe to call from multiple threads at the same time.
+     * If 'counters' is set, hardware events of all threads while calling fn are added to it.
+     */
+    void parallel_for(size_t n, task_fn fn, void *args, size_t chunk_size = 0, kernel_counters *counters = nullptr);
+
+    int num_threads() const { return static_cast<int>(m_workers.size()) + 1; }
+
+private:
+    struct job;
+    struct task {
+        job *j = nullptr;
+        size_t begin = 0;
+        size_t end = 0;
+    };
+
+    class work_deque;
+    struct worker;
+
+    size_t m_chunk_size;
+    std::vector<int> m_cpus;
+    std::vector<std::unique_ptr<worker>> m_workers;
+    std::atomic<bool> m_stop{false};
+
+    // Tasks submitted by threads outside the pool.
+    std::mutex m_inject_mutex;
+    std::deque<task> m_inject;
+    std::atomic<size_t> m_inject_size{0};
+
+    // Parking of idle workers.
+    std::mutex m_park_mutex;
+    std::condition_variable m_park_cv;
+    std::atomic<unsigned long long> m_epoch{0};
+    std::atomic<int> m_parked{0};
+
+    void worker_loop(worker &);
+    bool find_task(worker *, task &);
+    bool steal(worker *, task &);
+    void execute(worker *, task);
+    void push_external(task);
+    bool pop_external(task &);
+    void wake_workers();
+
+};
+
+} // namespace xpu::detail
+
+#endif
@@ -1,30 +1,52 @@
 #ifndef XPU_DRIVER_CPU_TPOS_IMPL_H
 #define XPU_DRIVER_CPU_TPOS_IMPL_H
 
-#include "this_thread.h"
+#include "../../../common.h"
 
 namespace xpu::detail {
 
 class tpos_impl {
 
 public:
-    inline int thread_idx_x() const { return 0; }
-    inline int thread_idx_y() const { return 0; }
-    inline int thread_idx_z() const { return 0; }
-
-    inline int block_dim_x() const { return 1; }
-    inline int block_dim_y() const { return 1; }
-    inline int block_dim_z() const { return 1; }
-
-    inline int block_idx_x() const { return detail::this_thread::block_idx.x; }
-    inline int block_idx_y() const { return detail::this_thread::block_idx.y; }
-    inline int block_idx_z() const { return detail::this_thread::block_idx.z; }
-
-    inline int grid_dim_x() const { return detail::this_thread::grid_dim.x; }
-    inline int grid_dim_y() const { return detail::this_thread::grid_dim.y; }
-    inline int grid_dim_z() const { return detail::this_thread::grid_dim.z; }
+    tpos_impl(dim thread_idx, dim block_dim, dim block_idx, dim grid_dim, int instance_idx = 0)
+        : m_thread_idx(thread_idx)
+        , m_block_dim(block_dim)
+        , m_block_idx(block_idx)
+        , m_grid_dim(grid_dim)
+        , m_instance_idx(instance_idx) {}
+
+    inline int thread_idx_x() const { return m_thread_idx.x; }
+    inline int thread_idx_y() const { return m_thread_idx.y; }
+    inline int thread_idx_z() const { return m_thread_idx.z; }
+
+    inline int block_dim_x() const { return m_block_dim.x; }
+    inline int block_dim_y() const { return m_block_dim.y; }
+    inline int block_dim_z() const { return m_block_dim.z; }
+
+    inline int block_idx_x() const { return m_block_idx.x; }
+    inline int block_idx_y() const { return m_block_idx.y; }
+    inline int block_idx_z() const { return m_block_idx.z; }
+
+    inline int grid_dim_x() const { return m_grid_dim.x; }
+    inline int grid_dim_y() const { return m_grid_dim.y; }
+    inline int grid_dim_z() const { return m_grid_dim.z; }
+
+    inline int instance_idx() const { return m_instance_idx; }
+
+    inline int thread_idx_linear() const {
+        return m_thread_idx.x + m_block_dim.x * (m_thread_idx.y + m_block_dim.y * m_thread_idx.z);
+    }
+
+    inline int block_dim_linear() const { return m_block_dim.linear(); }
+
+private:
+    dim m_thread_idx;
+    dim m_block_dim;
+    dim m_block_idx;
+    dim m_grid_dim;
+    int m_instance_idx;
 };
 
 } // namespace xpu::detail
 
-#endif
\ No newline at end of file
+#endif
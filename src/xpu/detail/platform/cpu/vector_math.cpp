@@ -0,0 +1,61 @@
+#include "vector_math_impl.h"
+
+using namespace xpu::detail;
+
+const vmath::kernel_table *vmath::generic() {
+    static constexpr kernel_table table = make_table("generic");
+    return &table;
+}
+
+static bool cpu_supports(const vmath::kernel_table *table) {
+    if (table == nullptr) {
+        return false;
+    }
+#if defined(__x86_64__) && defined(__GNUC__)
+    __builtin_cpu_init();
+    if (table == vmath::avx512()) {
+        return __builtin_cpu_supports("avx512f");
+    }
+    if (table == vmath::avx2()) {
+        return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    }
+#endif
+    return table == vmath::generic();
+}
+
+static const vmath::kernel_table *detect() {
+    for (const vmath::kernel_table *table : {vmath::avx512(), vmath::avx2()}) {
+        if (cpu_supports(table)) {
+            return table;
+        }
+    }
+    return vmath::generic();
+}
+
+static const vmath::kernel_table *&active() {
+    static const vmath::kernel_table *table = detect();
+    return table;
+}
+
+const vmath::kernel_table &vmath::kernels() {
+    return *active();
+}
+
+bool vmath::select(std::string_view isa) {
+    const kernel_table *table = nullptr;
+    if (isa == "auto") {
+        table = detect();
+    } else if (isa == "generic") {
+        table = generic();
+    } else if (isa == "avx2") {
+        table = avx2();
+    } else if (isa == "avx512") {
+        table = avx512();
+    }
+
+    if (!cpu_supports(table)) {
+        return false;
+    }
+    active() = table;
+    return true;
+}
@@ -0,0 +1,48 @@
+#ifndef XPU_DRIVER_CPU_VECTOR_MATH_H
+#define XPU_DRIVER_CPU_VECTOR_MATH_H
+
+#include <cstddef>
+#include <string_view>
+
+namespace xpu::detail::vmath {
+
+using unary_fn = void(*)(const float *, float *, size_t);
+using binary_fn = void(*)(const float *, const float *, float *, size_t);
+using sincos_fn = void(*)(const float *, float *, float *, size_t);
+
+/**
+ * Batch math functions compiled for one instruction set.
+ */
+struct kernel_table {
+    const char *isa;
+    unary_fn exp;
+    unary_fn log;
+    unary_fn sin;
+    unary_fn cos;
+    sincos_fn sincos;
+    unary_fn rsqrt;
+    binary_fn pow;
+    unary_fn erf;
+};
+
+// One table per instruction set. avx2 and avx512 return nullptr,
+// if the library wasn't built for x86-64.
+const kernel_table *generic();
+const kernel_table *avx2();
+const kernel_table *avx512();
+
+/**
+ * Kernels used by xpu::math. Picks the best instruction set supported
+ * by the CPU, unless another one was selected with select().
+ */
+const kernel_table &kernels();
+
+/**
+ * Select the instruction set by name ("auto", "generic", "avx2" or "avx512").
+ * Returns false if the instruction set is unknown or not supported by the CPU.
+ */
+bool select(std::string_view isa);
+
+} // namespace xpu::detail::vmath
+
+#endif
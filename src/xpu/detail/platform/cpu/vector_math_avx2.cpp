@@ -0,0 +1,16 @@
+#if defined(__x86_64__)
+#include "vector_math_impl.h"
+#else
+#include "vector_math.h"
+#endif
+
+using namespace xpu::detail;
+
+const vmath::kernel_table *vmath::avx2() {
+#if defined(__x86_64__)
+    static constexpr kernel_table table = make_table("avx2");
+    return &table;
+#else
+    return nullptr;
+#endif
+}
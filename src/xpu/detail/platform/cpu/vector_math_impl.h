@@ -0,0 +1,435 @@
+#ifndef XPU_DRIVER_CPU_VECTOR_MATH_IMPL_H
+#define XPU_DRIVER_CPU_VECTOR_MATH_IMPL_H
+
+// Batch math kernels. Included once by every vector_math*.cpp file, which are
+// compiled with different instruction sets (see CMakeLists.txt). Everything
+// here has internal linkage, so the copies for different instruction sets
+// can't be mixed up by the linker.
+//
+// The kernels are written as branch free loops over blocks of fixed size, so the
+// compiler vectorizes them with the widest vectors of the target. Polynomials
+// and range reductions follow Cephes (http://www.netlib.org/cephes/).
+
+#include "vector_math.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <limits>
+
+namespace xpu::detail::vmath {
+
+namespace {
+
+// Elements processed per iteration. Fixed trip counts allow vectorization
+// at -O2 without runtime alias checks.
+constexpr size_t block_size = 16;
+
+// |x| up to which sin and cos use the vectorized range reduction.
+// Larger arguments, infinities and NaNs fall back to libm.
+constexpr float trig_limit = 8192.f;
+
+inline uint32_t as_uint(float x) {
+    uint32_t u;
+    std::memcpy(&u, &x, sizeof(u));
+    return u;
+}
+
+inline float as_float(uint32_t u) {
+    float x;
+    std::memcpy(&x, &u, sizeof(x));
+    return x;
+}
+
+inline double as_double(uint64_t u) {
+    double x;
+    std::memcpy(&x, &u, sizeof(x));
+    return x;
+}
+
+void exp_block(const float *__restrict in, float *__restrict out) {
+    constexpr float log2e = 1.44269504088896341f;
+    constexpr float ln2_hi = 0.693359375f;
+    constexpr float ln2_lo = -2.12194440e-4f;
+    constexpr float shifter = 12582912.f; // 1.5 * 2^23, rounds to nearest integer when added
+
+    for (size_t i = 0; i < block_size; i++) {
+        // Clamp, so 2^n stays representable in two steps. Results still over- or underflow properly.
+        // Comparisons are false for NaN, which is passed on.
+        float x = in[i];
+        x = x < -104.f ? -104.f : x;
+        x = x > 89.f ? 89.f : x;
+
+        float t = x * log2e + shifter;
+        uint32_t n = as_uint(t) - as_uint(shifter);
+        float fn = t - shifter;
+
+        float r = x - fn * ln2_hi - fn * ln2_lo;
+        float z = r * r;
+        float p = 1.9875691500e-4f;
+        p = p * r + 1.3981999507e-3f;
+        p = p * r + 8.3334519073e-3f;
+        p = p * r + 4.1665795894e-2f;
+        p = p * r + 1.6666665459e-1f;
+        p = p * r + 5.0000001201e-1f;
+        p = p * z + r + 1.f;
+
+        // Scale by 2^n in two steps, as n may exceed the exponent range of a float.
+        uint32_t n1 = static_cast<uint32_t>(static_cast<int32_t>(n) >> 1);
+        uint32_t n2 = n - n1;
+        p *= as_float((n1 + 127u) << 23);
+        p *= as_float((n2 + 127u) << 23);
+        out[i] = p;
+    }
+}
+
+void log_block(const float *__restrict in, float *__restrict out) {
+    constexpr float sqrt2 = 1.41421356237309505f;
+    constexpr float ln2_hi = 0.693359375f;
+    constexpr float ln2_lo = -2.12194440e-4f;
+    constexpr float inf = std::numeric_limits<float>::infinity();
+    constexpr float nan = std::numeric_limits<float>::quiet_NaN();
+
+    for (size_t i = 0; i < block_size; i++) {
+        float x = in[i];
+
+        // Normalize subnormals
+        bool subnormal = x < std::numeric_limits<float>::min();
+        float xs = subnormal ? x * 8388608.f : x;
+        int32_t e = subnormal ? -23 : 0;
+
+        // x = m * 2^e with m in [sqrt(2)/2, sqrt(2))
+        uint32_t bits = as_uint(xs);
+        e += static_cast<int32_t>((bits >> 23) & 0xff) - 127;
+        float m = as_float((bits & 0x007fffffu) | 0x3f800000u);
+        bool big = m > sqrt2;
+        m = big ? m * 0.5f : m;
+        e = big ? e + 1 : e;
+
+        float f = m - 1.f;
+        float z = f * f;
+        float fe = static_cast<float>(e);
+
+        float p = 7.0376836292e-2f;
+        p = p * f - 1.1514610310e-1f;
+        p = p * f + 1.1676998740e-1f;
+        p = p * f - 1.2420140846e-1f;
+        p = p * f + 1.4249322787e-1f;
+        p = p * f - 1.6668057665e-1f;
+        p = p * f + 2.0000714765e-1f;
+        p = p * f - 2.4999993993e-1f;
+        p = p * f + 3.3333331174e-1f;
+
+        float y = p * f * z;
+        y += fe * ln2_lo;
+        y -= 0.5f * z;
+        float r = f + y;
+        r += fe * ln2_hi;
+
+        r = x < 0.f ? nan : r;
+        r = x == 0.f ? -inf : r;
+        r = x == inf ? inf : r;
+        r = x != x ? x : r;
+        out[i] = r;
+    }
+}
+
+// log(x) for positive and finite x, in double precision.
+inline double log_d(float x) {
+    constexpr float sqrt2 = 1.41421356237309505f;
+    constexpr double ln2 = 6.93147180559945309e-1;
+
+    // Normalize subnormals
+    bool subnormal = x < std::numeric_limits<float>::min();
+    float xs = subnormal ? x * 8388608.f : x;
+    int32_t e = subnormal ? -23 : 0;
+
+    // x = m * 2^e with m in [sqrt(2)/2, sqrt(2))
+    uint32_t bits = as_uint(xs);
+    e += static_cast<int32_t>((bits >> 23) & 0xff) - 127;
+    float m = as_float((bits & 0x007fffffu) | 0x3f800000u);
+    bool big = m > sqrt2;
+    m = big ? m * 0.5f : m;
+    e = big ? e + 1 : e;
+
+    // log(m) = 2 atanh(s), |s| < 0.172
+    double md = m;
+    double s = (md - 1.) / (md + 1.);
+    double z = s * s;
+    double p = 1. / 15.;
+    p = p * z + 1. / 13.;
+    p = p * z + 1. / 11.;
+    p = p * z + 1. / 9.;
+    p = p * z + 1. / 7.;
+    p = p * z + 1. / 5.;
+    p = p * z + 1. / 3.;
+    p = p * z + 1.;
+    return 2. * s * p + static_cast<double>(e) * ln2;
+}
+
+// exp(x) in double precision. Results over- or underflow when converted to float.
+inline double exp_d(double x) {
+    constexpr double log2e = 1.44269504088896341;
+    constexpr double ln2_hi = 6.93147180369123816490e-1;
+    constexpr double ln2_lo = 1.90821492927058770002e-10;
+    constexpr double shifter = 6755399441055744.; // 1.5 * 2^52, rounds to nearest integer when added
+
+    // Comparisons are false for NaN, which is passed on.
+    x = x < -110. ? -110. : x;
+    x = x > 100. ? 100. : x;
+
+    double fn = (x * log2e + shifter) - shifter;
+    int32_t n = static_cast<int32_t>(fn);
+    double r = x - fn * ln2_hi - fn * ln2_lo;
+
+    // Taylor series, |r| <= ln(2) / 2
+    double p = 1. / 39916800.;
+    p = p * r + 1. / 3628800.;
+    p = p * r + 1. / 362880.;
+    p = p * r + 1. / 40320.;
+    p = p * r + 1. / 5040.;
+    p = p * r + 1. / 720.;
+    p = p * r + 1. / 120.;
+    p = p * r + 1. / 24.;
+    p = p * r + 1. / 6.;
+    p = p * r + 0.5;
+    p = p * r + 1.;
+    p = p * r + 1.;
+    return p * as_double(static_cast<uint64_t>(n + 1023) << 52);
+}
+
+// x^y, computed as exp(y * log(x)) in double precision, so the result is correctly rounded in almost all cases.
+// Special cases follow C99 pow.
+void pow_block(const float *__restrict xin, const float *__restrict yin, float *__restrict out) {
+    constexpr float inf = std::numeric_limits<float>::infinity();
+    constexpr float nan = std::numeric_limits<float>::quiet_NaN();
+    constexpr float two23 = 8388608.f;
+
+    for (size_t i = 0; i < block_size; i++) {
+        float x = xin[i];
+        float y = yin[i];
+        float ax = std::abs(x);
+        float ay = std::abs(y);
+
+        // Floats >= 2^23 are even integers. Comparisons are false for NaN.
+        float yt = ay < two23 ? y : 0.f;
+        int32_t yi = static_cast<int32_t>(yt);
+        // Bitwise operators, as short circuiting would add branches that prevent vectorization.
+        bool y_int = (ay >= two23) | (static_cast<float>(yi) == y);
+        uint32_t y_odd = static_cast<float>(yi) == y ? static_cast<uint32_t>(yi) & 1u : 0u;
+        bool y_finite = ay < inf;
+
+        // log(|x|) for zero, infinity and NaN is patched below.
+        bool x_regular = (ax > 0.f) & (ax < inf);
+        double l = log_d(x_regular ? ax : 1.f);
+        l = ax == 0.f ? -static_cast<double>(inf) : l;
+        l = ax == inf ? static_cast<double>(inf) : l;
+        l = x != x ? static_cast<double>(nan) : l;
+
+        float r = static_cast<float>(exp_d(static_cast<double>(y) * l));
+
+        r = as_float(as_uint(r) ^ ((as_uint(x) & 0x80000000u) * y_odd)); // Odd powers keep the sign of x
+        r = (x < 0.f) & (ax < inf) & y_finite & !y_int ? nan : r;
+        r = (ax == 1.f) & !y_finite & (y == y) ? 1.f : r; // (-1)^(+-inf) = 1
+        r = y == 0.f ? 1.f : r;
+        r = x == 1.f ? 1.f : r;
+        out[i] = r;
+    }
+}
+
+void erf_block(const float *__restrict in, float *__restrict out) {
+    for (size_t i = 0; i < block_size; i++) {
+        float x = in[i];
+        // erf rounds to +-1 for |x| > 3.92. Comparison is false for NaN, which is patched below.
+        float ax = std::abs(x);
+        ax = ax < 4.f ? ax : 4.f;
+
+        double xd = ax;
+        double t = xd * xd * 0.125 - 1.;
+        // erf(x) / x as polynomial in t. Interpolates at the Chebyshev nodes of |x| <= 4
+        // and is converted to monomial form. Max. relative error is 4e-10.
+        double p = 9.40381120783154292e-05;
+        p = p * t - 2.46422021614546951e-04;
+        p = p * t + 1.73229752028036257e-04;
+        p = p * t - 3.25519601191397038e-04;
+        p = p * t + 1.41015240597210448e-03;
+        p = p * t - 2.90971299461106371e-03;
+        p = p * t + 4.77494674515511336e-03;
+        p = p * t - 8.38404424592011435e-03;
+        p = p * t + 1.43810384086690071e-02;
+        p = p * t - 2.25625583072794969e-02;
+        p = p * t + 3.30532918249279301e-02;
+        p = p * t - 4.57443126704657685e-02;
+        p = p * t + 5.98878295546205475e-02;
+        p = p * t - 7.47304867981224280e-02;
+        p = p * t + 9.02089413459930545e-02;
+        p = p * t - 1.07710292886265532e-01;
+        p = p * t + 1.31675117775691242e-01;
+        p = p * t - 1.76576235800398967e-01;
+        p = p * t + 3.53530995643405732e-01;
+
+        float r = static_cast<float>(xd * p);
+        r = as_float(as_uint(r) | (as_uint(x) & 0x80000000u)); // erf(-x) = -erf(x), including -0
+        out[i] = x != x ? x : r;
+    }
+}
+
+// Computes sin (S = true) and / or cos (C = true) of a block.
+template<bool S, bool C>
+void sincos_block(const float *__restrict in, float *__restrict sout, float *__restrict cout) {
+    constexpr float four_over_pi = 1.27323954473516268f;
+    // pi/4 split into three parts. The reduction is done in double precision,
+    // as the float version from Cephes loses several bits close to multiples of pi.
+    constexpr double dp1 = 7.85398125648498535156e-1;
+    constexpr double dp2 = 3.77489470793079817668e-8;
+    constexpr double dp3 = 2.69515142907905952645e-15;
+
+    for (size_t i = 0; i < block_size; i++) {
+        float x = in[i];
+        float ax = std::abs(x);
+        // Arguments outside the limit are fixed up by the caller.
+        // Replace them here, so the conversion to int below is well defined.
+        ax = ax <= trig_limit ? ax : 0.f;
+
+        // Reduce to [-pi/4, pi/4] and find the octant.
+        int32_t j = static_cast<int32_t>(ax * four_over_pi);
+        j = (j + 1) & ~1;
+        double fj = static_cast<double>(j);
+        float r = static_cast<float>(((static_cast<double>(ax) - fj * dp1) - fj * dp2) - fj * dp3);
+        float z = r * r;
+
+        float s = -1.9515295891e-4f;
+        s = s * z + 8.3321608736e-3f;
+        s = s * z - 1.6666654611e-1f;
+        s = s * z * r + r;
+
+        float c = 2.443315711809948e-5f;
+        c = c * z - 1.388731625493765e-3f;
+        c = c * z + 4.166664568298827e-2f;
+        c = c * z * z - 0.5f * z + 1.f;
+
+        int32_t q = (j >> 1) & 3;
+        bool swap = (q & 1) != 0;
+        if constexpr (S) {
+            float v = swap ? c : s;
+            bool neg = (q & 2) != 0;
+            v = neg ? -v : v;
+            sout[i] = as_float(as_uint(v) ^ (as_uint(x) & 0x80000000u)); // sin(-x) = -sin(x), including -0
+        }
+        if constexpr (C) {
+            float v = swap ? s : c;
+            bool neg = q == 1 || q == 2;
+            cout[i] = neg ? -v : v;
+        }
+    }
+}
+
+// True if any element of the block is outside the range handled by sincos_block.
+bool outside_trig_limit(const float *in) {
+    int outside = 0;
+    for (size_t i = 0; i < block_size; i++) {
+        outside |= !(std::abs(in[i]) <= trig_limit);
+    }
+    return outside != 0;
+}
+
+void rsqrt_block(const float *__restrict in, float *__restrict out) {
+    for (size_t i = 0; i < block_size; i++) {
+        out[i] = 1.f / std::sqrt(in[i]);
+    }
+}
+
+// Apply a block kernel to n elements. Results go to a local buffer first,
+// so x and y may alias.
+template<void(*Block)(const float *, float *)>
+void apply(const float *x, float *y, size_t n) {
+    float tmp[block_size];
+    size_t i = 0;
+    for (; i + block_size <= n; i += block_size) {
+        Block(x + i, tmp);
+        std::memcpy(y + i, tmp, sizeof(tmp));
+    }
+    if (i < n) {
+        float in[block_size] = {};
+        std::memcpy(in, x + i, (n - i) * sizeof(float));
+        Block(in, tmp);
+        std::memcpy(y + i, tmp, (n - i) * sizeof(float));
+    }
+}
+
+// Same as apply, for functions with two arguments.
+template<void(*Block)(const float *, const float *, float *)>
+void apply2(const float *x, const float *y, float *z, size_t n) {
+    float tmp[block_size];
+    size_t i = 0;
+    for (; i + block_size <= n; i += block_size) {
+        Block(x + i, y + i, tmp);
+        std::memcpy(z + i, tmp, sizeof(tmp));
+    }
+    if (i < n) {
+        float xin[block_size] = {};
+        float yin[block_size] = {};
+        std::memcpy(xin, x + i, (n - i) * sizeof(float));
+        std::memcpy(yin, y + i, (n - i) * sizeof(float));
+        Block(xin, yin, tmp);
+        std::memcpy(z + i, tmp, (n - i) * sizeof(float));
+    }
+}
+
+template<bool S, bool C>
+void sincos_n(const float *x, float *s, float *c, size_t n) {
+    float in[block_size];
+    float stmp[block_size];
+    float ctmp[block_size];
+    for (size_t i = 0; i < n; i += block_size) {
+        size_t len = std::min(block_size, n - i);
+        const float *src = x + i;
+        if (len < block_size) {
+            std::fill(std::begin(in), std::end(in), 0.f);
+            std::memcpy(in, x + i, len * sizeof(float));
+            src = in;
+        }
+
+        sincos_block<S, C>(src, stmp, ctmp);
+        if (outside_trig_limit(src)) {
+            for (size_t k = 0; k < len; k++) {
+                if (std::abs(src[k]) <= trig_limit) {
+                    continue;
+                }
+                if constexpr (S) {
+                    stmp[k] = std::sin(src[k]);
+                }
+                if constexpr (C) {
+                    ctmp[k] = std::cos(src[k]);
+                }
+            }
+        }
+
+        if constexpr (S) {
+            std::memcpy(s + i, stmp, len * sizeof(float));
+        }
+        if constexpr (C) {
+            std::memcpy(c + i, ctmp, len * sizeof(float));
+        }
+    }
+}
+
+void exp_n(const float *x, float *y, size_t n) { apply<exp_block>(x, y, n); }
+void log_n(const float *x, float *y, size_t n) { apply<log_block>(x, y, n); }
+void sin_n(const float *x, float *y, size_t n) { sincos_n<true, false>(x, y, nullptr, n); }
+void cos_n(const float *x, float *y, size_t n) { sincos_n<false, true>(x, nullptr, y, n); }
+void rsqrt_n(const float *x, float *y, size_t n) { apply<rsqrt_block>(x, y, n); }
+void pow_n(const float *x, const float *y, float *z, size_t n) { apply2<pow_block>(x, y, z, n); }
+void erf_n(const float *x, float *y, size_t n) { apply<erf_block>(x, y, n); }
+
+constexpr kernel_table make_table(const char *isa) {
+    return kernel_table{isa, exp_n, log_n, sin_n, cos_n, sincos_n<true, true>, rsqrt_n, pow_n, erf_n};
+}
+
+} // namespace
+
+} // namespace xpu::detail::vmath
+
+#endif
@@ -3,9 +3,25 @@
 #include "../../backend_base.h"
 #include "../../log.h"
 
+#include <climits>
+#include <cstdint>
+#include <type_traits>
+
+#if XPU_IS_CUDA
+#include <cub/device/device_radix_sort.cuh>
+#else
+#include <hipcub/device/device_radix_sort.hpp>
+#endif
+
 
 namespace xpu::detail {
 
+#if XPU_IS_CUDA
+namespace cub = ::cub;
+#else // XPU_IS_HIP
+namespace cub = ::hipcub;
+#endif
+
 class CUHIP(driver) : public backend_base {
 
 public:
@@ -22,11 +38,16 @@ public:
         return err;
     }
 
-    error malloc_device(void **ptr, size_t bytes) override {
+    error malloc_device(void **ptr, size_t bytes, int device) override {
+        error err = set_device(device);
+        if (err != 0) {
+            return err;
+        }
         return CUHIP(Malloc)(ptr, bytes);
     }
 
-    error malloc_host(void **ptr, size_t bytes) override {
+    error malloc_host(void **ptr, size_t bytes, int /*device*/) override {
+        // Pinned host memory is accessible from all devices
         return
             #if XPU_IS_HIP
                 hipHostMalloc(ptr, bytes, hipHostMallocDefault)
@@ -36,7 +57,11 @@ public:
         ;
     }
 
-    error malloc_shared(void **ptr, size_t bytes) override {
+    error malloc_shared(void **ptr, size_t bytes, int device) override {
+        error err = set_device(device);
+        if (err != 0) {
+            return err;
+        }
         return CUHIP(MallocManaged)(ptr, bytes, CUHIP(MemAttachGlobal));
     }
 
@@ -54,6 +79,18 @@ public:
         }
     }
 
+    error register_host(void *ptr, size_t bytes, bool read_only) override {
+        unsigned int flags = CUHIP(HostRegisterDefault);
+        if (read_only) {
+            flags |= CUHIP(HostRegisterReadOnly);
+        }
+        return CUHIP(HostRegister)(ptr, bytes, flags);
+    }
+
+    error unregister_host(void *ptr) override {
+        return CUHIP(HostUnregister)(ptr);
+    }
+
     error create_queue(void **queue, int device) override {
         int err = 0;
         int current_device = 0;
@@ -83,6 +120,50 @@ public:
         return CUHIP(StreamSynchronize)(static_cast<CUHIP(Stream_t)>(queue));
     }
 
+    error create_event(void **event, int device) override {
+        int err = 0;
+        int current_device = 0;
+        err = CUHIP(GetDevice)(&current_device);
+        if (err != 0) {
+            return err;
+        }
+        err = set_device(device);
+        if (err != 0) {
+            return err;
+        }
+        CUHIP(Event_t) ev;
+        err = CUHIP(EventCreate)(&ev);
+        *event = static_cast<void *>(ev);
+        if (err != 0) {
+            return err;
+        }
+        err = CUHIP(SetDevice)(current_device);
+        return err;
+    }
+
+    error destroy_event(void *event) override {
+        return CUHIP(EventDestroy)(static_cast<CUHIP(Event_t)>(event));
+    }
+
+    error record_event(void *event, void *queue) override {
+        return CUHIP(EventRecord)(static_cast<CUHIP(Event_t)>(event), static_cast<CUHIP(Stream_t)>(queue));
+    }
+
+    error wait_event(void *queue, void *event) override {
+        return CUHIP(StreamWaitEvent)(static_cast<CUHIP(Stream_t)>(queue), static_cast<CUHIP(Event_t)>(event), 0);
+    }
+
+    error synchronize_event(void *event) override {
+        return CUHIP(EventSynchronize)(static_cast<CUHIP(Event_t)>(event));
+    }
+
+    error event_elapsed_time(double *ms, void *start, void *end) override {
+        float elapsed = 0;
+        error err = CUHIP(EventElapsedTime)(&elapsed, static_cast<CUHIP(Event_t)>(start), static_cast<CUHIP(Event_t)>(end));
+        *ms = elapsed;
+        return err;
+    }
+
     error memcpy(void *dst, const void *src, size_t bytes) override {
         error err = CUHIP(Memcpy)(dst, src, bytes, CUHIP(MemcpyDefault));
         device_synchronize();
@@ -241,6 +322,43 @@ public:
         return CUHIP(MemGetInfo)(free, total);
     }
 
+    error sort_pairs(void *keys, void *values, size_t n, sort_key_t type, size_t value_size) override {
+        switch (type) {
+        case sort_key_int32: return sort_pairs<int32_t>(keys, values, n, value_size);
+        case sort_key_uint32: return sort_pairs<uint32_t>(keys, values, n, value_size);
+        case sort_key_int64: return sort_pairs<int64_t>(keys, values, n, value_size);
+        case sort_key_uint64: return sort_pairs<uint64_t>(keys, values, n, value_size);
+        case sort_key_float: return sort_pairs<float>(keys, values, n, value_size);
+        case sort_key_double: return sort_pairs<double>(keys, values, n, value_size);
+        }
+        return not_supported;
+    }
+
+    error begin_capture(void *queue) override {
+        return CUHIP(StreamBeginCapture)(static_cast<CUHIP(Stream_t)>(queue), CUHIP(StreamCaptureModeThreadLocal));
+    }
+
+    error end_capture(void *queue, void **graph) override {
+        CUHIP(Graph_t) g = nullptr;
+        error err = CUHIP(StreamEndCapture)(static_cast<CUHIP(Stream_t)>(queue), &g);
+        if (err != 0) {
+            return err;
+        }
+        CUHIP(GraphExec_t) exec = nullptr;
+        err = CUHIP(GraphInstantiateWithFlags)(&exec, g, 0);
+        CUHIP(GraphDestroy)(g); // Only the executable graph is kept
+        *graph = exec;
+        return err;
+    }
+
+    error launch_graph(void *graph, void *queue) override {
+        return CUHIP(GraphLaunch)(static_cast<CUHIP(GraphExec_t)>(graph), static_cast<CUHIP(Stream_t)>(queue));
+    }
+
+    error destroy_graph(void *graph) override {
+        return CUHIP(GraphExecDestroy)(static_cast<CUHIP(GraphExec_t)>(graph));
+    }
+
     const char *error_to_string(error err) override {
         return CUHIP(GetErrorString)(static_cast<CUHIP(Error_t)>(err));
     }
@@ -249,6 +367,79 @@ public:
         return (XPU_IS_CUDA ? cuda : hip);
     }
 
+    template<typename Key>
+    error sort_pairs(void *keys, void *values, size_t n, size_t value_size) {
+        // Older versions of cub only support 32 bit item counts.
+        if (n > INT_MAX) {
+            return not_supported;
+        }
+        if (values == nullptr || value_size == 0) {
+            return radix_sort<Key, cub::NullType>(static_cast<Key *>(keys), nullptr, n);
+        }
+        switch (value_size) {
+        case sizeof(uint32_t): return radix_sort<Key, uint32_t>(static_cast<Key *>(keys), static_cast<uint32_t *>(values), n);
+        case sizeof(uint64_t): return radix_sort<Key, uint64_t>(static_cast<Key *>(keys), static_cast<uint64_t *>(values), n);
+        }
+        return not_supported;
+    }
+
+    template<typename Key, typename Value>
+    error radix_sort(Key *keys, Value *values, size_t n) {
+        constexpr bool has_values = !std::is_same_v<Value, cub::NullType>;
+        int num_items = static_cast<int>(n);
+
+        Key *keys_alt = nullptr;
+        Value *values_alt = nullptr;
+        void *temp = nullptr;
+        size_t temp_bytes = 0;
+
+        error err = CUHIP(Malloc)(reinterpret_cast<void **>(&keys_alt), n * sizeof(Key));
+        if (err == 0 && has_values) {
+            err = CUHIP(Malloc)(reinterpret_cast<void **>(&values_alt), n * sizeof(Value));
+        }
+
+        cub::DoubleBuffer<Key> dkeys{keys, keys_alt};
+        cub::DoubleBuffer<Value> dvalues{values, values_alt};
+        auto sort = [&]() {
+            if constexpr (has_values) {
+                return cub::DeviceRadixSort::SortPairs(temp, temp_bytes, dkeys, dvalues, num_items);
+            } else {
+                return cub::DeviceRadixSort::SortKeys(temp, temp_bytes, dkeys, num_items);
+            }
+        };
+
+        if (err == 0) {
+            err = sort(); // Query size of temporary storage
+        }
+        if (err == 0) {
+            err = CUHIP(Malloc)(&temp, temp_bytes);
+        }
+        if (err == 0) {
+            err = sort();
+        }
+        // cub may leave the result in the alternate buffers
+        if (err == 0 && dkeys.Current() != keys) {
+            err = CUHIP(Memcpy)(keys, dkeys.Current(), n * sizeof(Key), CUHIP(MemcpyDeviceToDevice));
+        }
+        if constexpr (has_values) {
+            if (err == 0 && dvalues.Current() != values) {
+                err = CUHIP(Memcpy)(values, dvalues.Current(), n * sizeof(Value), CUHIP(MemcpyDeviceToDevice));
+            }
+        }
+        if (err == 0) {
+            err = CUHIP(DeviceSynchronize)();
+        }
+
+        // Free buffers in any case, but report the first error
+        for (void *ptr : {static_cast<void *>(keys_alt), static_cast<void *>(values_alt), temp}) {
+            if (ptr != nullptr) {
+                error free_err = CUHIP(Free)(ptr);
+                err = (err == 0 ? free_err : err);
+            }
+        }
+        return err;
+    }
+
     bool resides_on_host(const void *ptr) {
         cuhip_pointer_attributes ptrattrs;
         error err = CUHIP(PointerGetAttributes)(&ptrattrs, ptr);
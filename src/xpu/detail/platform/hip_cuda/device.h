@@ -276,6 +276,8 @@ XPU_D XPU_FORCE_INLINE unsigned int xpu::atomic_xor_block(unsigned int *addr, un
 
 XPU_D XPU_FORCE_INLINE void xpu::barrier(tpos &) { __syncthreads(); }
 
+XPU_D XPU_FORCE_INLINE void xpu::thread_fence() { __threadfence(); }
+
 XPU_D XPU_FORCE_INLINE int xpu::float_as_int(float val) { return __float_as_int(val); }
 XPU_D XPU_FORCE_INLINE float xpu::int_as_float(int val) { return __int_as_float(val); }
 
@@ -533,12 +535,12 @@ __global__ void kernel_entry(Args... args) {
 }
 
 template<typename F, int MaxThreadsPerBlock, typename... Args>
-__global__ void __launch_bounds__(MaxThreadsPerBlock) kernel_entry_bounded(Args... args) {
+__global__ void __launch_bounds__(MaxThreadsPerBlock) kernel_entry_bounded(int instance, Args... args) {
     using shared_memory = typename F::shared_memory;
     using constants = typename F::constants;
     using context = kernel_context<shared_memory, constants>;
     __shared__ shared_memory smem;
-    tpos pos{internal_ctor};
+    tpos pos{internal_ctor, instance};
     constants cmem{internal_ctor};
     context ctx{internal_ctor, pos, smem, cmem};
     F{}(ctx, args...);
@@ -561,7 +563,11 @@ struct action_runner<kernel_tag, K, void(K::*)(kernel_context<typename K::shared
         dim block_dim = K::block_size::value;
         dim grid_dim{};
 
-        launch_info.g.get_compute_grid(block_dim, grid_dim);
+        int resident_blocks = 1;
+        if (launch_info.g.persistent()) {
+            SAFE_CALL(get_resident_blocks(&resident_blocks));
+        }
+        launch_info.g.get_compute_grid(block_dim, grid_dim, resident_blocks);
 
         XPU_LOG("Calling kernel '%s' [block_dim = (%d, %d, %d), grid_dim = (%d, %d, %d)] with CUDA driver.", type_name<K>(), block_dim.x, block_dim.y, block_dim.z, grid_dim.x, grid_dim.y, grid_dim.z);
 
@@ -579,17 +585,22 @@ struct action_runner<kernel_tag, K, void(K::*)(kernel_context<typename K::shared
         }
 
         if (launch_info.queue_handle == nullptr) {
-            kernel_entry_bounded<K, K::block_size::value.linear(), Args...><<<grid_dim.as_cuda_grid(), block_dim.as_cuda_grid()>>>(args...);
+            kernel_entry_bounded<K, K::block_size::value.linear(), Args...><<<grid_dim.as_cuda_grid(), block_dim.as_cuda_grid()>>>(launch_info.instance, args...);
         } else {
             cudaStream_t stream = static_cast<cudaStream_t>(launch_info.queue_handle);
-            kernel_entry_bounded<K, K::block_size::value.linear(), Args...><<<grid_dim.as_cuda_grid(), block_dim.as_cuda_grid(), 0, stream>>>(args...);
+            kernel_entry_bounded<K, K::block_size::value.linear(), Args...><<<grid_dim.as_cuda_grid(), block_dim.as_cuda_grid(), 0, stream>>>(launch_info.instance, args...);
         }
 
 
         if (measure_time) {
             ON_ERROR_GOTO(err, cudaEventRecord(end), cleanup_events);
         }
-        SAFE_CALL(cudaDeviceSynchronize());
+        // Launches on a queue stay asynchronous. Required for stream capture, which forbids synchronization.
+        if (launch_info.queue_handle == nullptr || measure_time) {
+            SAFE_CALL(cudaDeviceSynchronize());
+        } else {
+            SAFE_CALL(cudaGetLastError());
+        }
 
         if (measure_time) {
             ON_ERROR_GOTO(err, cudaEventSynchronize(end), cleanup_events);
@@ -611,6 +622,19 @@ struct action_runner<kernel_tag, K, void(K::*)(kernel_context<typename K::shared
         return err;
     }
 
+
+    // Number of blocks that can run on the current device at the same time.
+    static int get_resident_blocks(int *nblocks) {
+        int device = 0;
+        int nsm = 0;
+        int per_sm = 0;
+        SAFE_CALL(cudaGetDevice(&device));
+        SAFE_CALL(cudaDeviceGetAttribute(&nsm, cudaDevAttrMultiProcessorCount, device));
+        SAFE_CALL(cudaOccupancyMaxActiveBlocksPerMultiprocessor(&per_sm, kernel_entry_bounded<K, K::block_size::value.linear(), Args...>, K::block_size::value.linear(), 0));
+        *nblocks = nsm * per_sm;
+        return 0;
+    }
+
 };
 
 #elif XPU_IS_HIP
@@ -630,7 +654,11 @@ struct action_runner<kernel_tag, K, void(K::*)(kernel_context<typename K::shared
         dim block_dim = K::block_size::value;
         dim grid_dim{};
 
-        launch_info.g.get_compute_grid(block_dim, grid_dim);
+        int resident_blocks = 1;
+        if (launch_info.g.persistent()) {
+            SAFE_CALL(get_resident_blocks(&resident_blocks));
+        }
+        launch_info.g.get_compute_grid(block_dim, grid_dim, resident_blocks);
 
         XPU_LOG("Calling kernel '%s' [block_dim = (%d, %d, %d), grid_dim = (%d, %d, %d)] with HIP driver.", type_name<K>(), block_dim.x, block_dim.y, block_dim.z, grid_dim.x, grid_dim.y, grid_dim.z);
 
@@ -647,11 +675,16 @@ struct action_runner<kernel_tag, K, void(K::*)(kernel_context<typename K::shared
         if (measure_time) {
             ON_ERROR_GOTO(err, hipEventRecord(start), cleanup_events);
         }
-        hipLaunchKernelGGL(HIP_KERNEL_NAME(kernel_entry_bounded<K, K::block_size::value.linear(), Args...>), grid_dim.as_cuda_grid(), block_dim.as_cuda_grid(), 0, stream, std::forward<Args>(args)...);
+        hipLaunchKernelGGL(HIP_KERNEL_NAME(kernel_entry_bounded<K, K::block_size::value.linear(), Args...>), grid_dim.as_cuda_grid(), block_dim.as_cuda_grid(), 0, stream, launch_info.instance, std::forward<Args>(args)...);
         if (measure_time) {
             ON_ERROR_GOTO(err, hipEventRecord(end), cleanup_events);
         }
-        SAFE_CALL(hipDeviceSynchronize());
+        // Launches on a queue stay asynchronous. Required for stream capture, which forbids synchronization.
+        if (launch_info.queue_handle == nullptr || measure_time) {
+            SAFE_CALL(hipDeviceSynchronize());
+        } else {
+            SAFE_CALL(hipGetLastError());
+        }
 
         if (measure_time) {
             ON_ERROR_GOTO(err, hipEventSynchronize(end), cleanup_events);
@@ -673,6 +706,19 @@ struct action_runner<kernel_tag, K, void(K::*)(kernel_context<typename K::shared
         return err;
     }
 
+
+    // Number of blocks that can run on the current device at the same time.
+    static int get_resident_blocks(int *nblocks) {
+        int device = 0;
+        int nsm = 0;
+        int per_sm = 0;
+        SAFE_CALL(hipGetDevice(&device));
+        SAFE_CALL(hipDeviceGetAttribute(&nsm, hipDeviceAttributeMultiprocessorCount, device));
+        SAFE_CALL(hipOccupancyMaxActiveBlocksPerMultiprocessor(&per_sm, reinterpret_cast<const void *>(kernel_entry_bounded<K, K::block_size::value.linear(), Args...>), K::block_size::value.linear(), 0));
+        *nblocks = nsm * per_sm;
+        return 0;
+    }
+
 };
 
 #endif
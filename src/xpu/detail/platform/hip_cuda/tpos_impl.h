@@ -16,6 +16,8 @@ namespace xpu::detail {
 class tpos_impl {
 
 public:
+    XPU_D tpos_impl(int instance_idx = 0) : m_instance_idx(instance_idx) {}
+
     XPU_D int thread_idx_x() const { return XPU_CHOOSE(hipThreadIdx_x, threadIdx.x); }
     XPU_D int thread_idx_y() const { return XPU_CHOOSE(hipThreadIdx_y, threadIdx.y); }
     XPU_D int thread_idx_z() const { return XPU_CHOOSE(hipThreadIdx_z, threadIdx.z); }
@@ -31,6 +33,11 @@ public:
     XPU_D int grid_dim_x() const { return XPU_CHOOSE(hipGridDim_x, gridDim.x); }
     XPU_D int grid_dim_y() const { return XPU_CHOOSE(hipGridDim_y, gridDim.y); }
     XPU_D int grid_dim_z() const { return XPU_CHOOSE(hipGridDim_z, gridDim.z); }
+
+    XPU_D int instance_idx() const { return m_instance_idx; }
+
+private:
+    int m_instance_idx;
 };
 
 } // namespace xpu::detail
@@ -146,6 +146,10 @@ void xpu::barrier(tpos &pos) {
     sycl::group_barrier(impl.group());
 }
 
+void xpu::thread_fence() {
+    sycl::atomic_fence(sycl::memory_order::seq_cst, sycl::memory_scope::device);
+}
+
 template<typename T, int BlockSize>
 class xpu::block_scan<T, BlockSize, xpu::sycl> {
 
@@ -326,15 +330,20 @@ struct xpu::detail::action_runner<xpu::detail::kernel_tag, K, void(K::*)(xpu::ke
     using context = kernel_context<shared_memory, constants>;
 
     static int call(kernel_launch_info launch_info, Args... args) {
+        auto *driver = static_cast<sycl_driver *>(backend::get(sycl));
+        sycl::queue queue = (launch_info.queue_handle == nullptr ? driver->default_queue() : driver->get_queue(launch_info.queue_handle));
+
+        // Persistent grids get one block per compute unit
+        int resident_blocks = 1;
+        if (launch_info.g.persistent()) {
+            resident_blocks = queue.get_device().get_info<sycl::info::device::max_compute_units>();
+        }
         dim block_dim = K::block_size::value;
         dim grid_dim{};
-        launch_info.g.get_compute_grid(block_dim, grid_dim);
+        launch_info.g.get_compute_grid(block_dim, grid_dim, resident_blocks);
 
         XPU_LOG("Calling kernel '%s' [block_dim = (%d, %d, %d), grid_dim = (%d, %d, %d)] with SYCL driver.", type_name<K>(), block_dim.x, block_dim.y, block_dim.z, grid_dim.x, grid_dim.y, grid_dim.z);
 
-        auto *driver = static_cast<sycl_driver *>(backend::get(sycl));
-        sycl::queue queue = (launch_info.queue_handle == nullptr ? driver->default_queue() : driver->get_queue(launch_info.queue_handle));
-
         sycl::range<3> global_range{size_t(grid_dim.x), size_t(grid_dim.y), size_t(grid_dim.z)};
         sycl::range<3> local_range{size_t(block_dim.x), size_t(block_dim.y), size_t(block_dim.z)};
         cmem_traits<constants> cmem_traits{};
@@ -342,6 +351,7 @@ struct xpu::detail::action_runner<xpu::detail::kernel_tag, K, void(K::*)(xpu::ke
 
         global_range = global_range * local_range;
 
+        int instance = launch_info.instance;
         sycl::event ev = queue.submit([&](sycl::handler &cgh) {
             sycl::local_accessor<shared_memory, 0> shared_memory_acc{cgh};
             auto cmem_accessors = cmem_traits.make_accessors(cmem_buffers, cgh);
@@ -355,7 +365,7 @@ struct xpu::detail::action_runner<xpu::detail::kernel_tag, K, void(K::*)(xpu::ke
                     out << "";
                 }
                 shared_memory &smem = shared_memory_acc;
-                tpos pos{internal_ctor, item};
+                tpos pos{internal_ctor, item, instance};
                 context ctx{internal_ctor, pos, smem, cmem};
                 K{}(ctx, args...);
             });
@@ -18,18 +18,18 @@ error sycl_driver::setup() {
     return 0;
 }
 
-error sycl_driver::malloc_device(void **ptr, size_t bytes) {
-    *ptr = sycl::malloc_device(bytes, m_default_queue);
+error sycl_driver::malloc_device(void **ptr, size_t bytes, int device) {
+    *ptr = sycl::malloc_device(bytes, sycl::device::get_devices()[device], m_default_queue.get_context());
     return 0;
 }
 
-error sycl_driver::malloc_host(void **ptr, size_t bytes) {
+error sycl_driver::malloc_host(void **ptr, size_t bytes, int /*device*/) {
     *ptr = sycl::malloc_host(bytes, m_default_queue);
     return 0;
 }
 
-error sycl_driver::malloc_shared(void **ptr, size_t bytes) {
-    *ptr = sycl::malloc_shared(bytes, m_default_queue);
+error sycl_driver::malloc_shared(void **ptr, size_t bytes, int device) {
+    *ptr = sycl::malloc_shared(bytes, sycl::device::get_devices()[device], m_default_queue.get_context());
     return 0;
 }
 
@@ -38,6 +38,15 @@ error sycl_driver::free(void *ptr) {
     return 0;
 }
 
+error sycl_driver::register_host(void * /*ptr*/, size_t /*bytes*/, bool /*read_only*/) {
+    // SYCL has no portable way to pin existing memory.
+    return not_supported;
+}
+
+error sycl_driver::unregister_host(void * /*ptr*/) {
+    return not_supported;
+}
+
 error sycl_driver::create_queue(void **queue, int device) {
     auto q = std::make_unique<sycl::queue>(sycl::device::get_devices()[device], m_prop_list);
     m_queues.emplace_back(std::move(q));
@@ -60,6 +69,54 @@ error sycl_driver::synchronize_queue(void *handle) {
     return 0;
 }
 
+error sycl_driver::create_event(void **event, int /*device*/) {
+    // Events are bound to the queue they are recorded in, so the device is not needed here.
+    *event = new sycl::event{};
+    return 0;
+}
+
+error sycl_driver::destroy_event(void *event) {
+    delete static_cast<sycl::event *>(event);
+    return 0;
+}
+
+error sycl_driver::record_event(void *event, void *handle) {
+    sycl::queue q = (handle == nullptr ? m_default_queue : get_queue(handle));
+    *static_cast<sycl::event *>(event) = q.ext_oneapi_submit_barrier();
+    return 0;
+}
+
+error sycl_driver::wait_event(void *handle, void *event) {
+    sycl::event ev = *static_cast<sycl::event *>(event);
+    if (handle == nullptr) {
+        ev.wait();
+    } else {
+        get_queue(handle).ext_oneapi_submit_barrier({ev});
+    }
+    return 0;
+}
+
+error sycl_driver::synchronize_event(void *event) {
+    static_cast<sycl::event *>(event)->wait();
+    return 0;
+}
+
+error sycl_driver::event_elapsed_time(double *ms, void *start, void *end) {
+    sycl::event ev_start = *static_cast<sycl::event *>(start);
+    sycl::event ev_end = *static_cast<sycl::event *>(end);
+    try {
+        ev_start.wait();
+        ev_end.wait();
+        double ns = ev_end.get_profiling_info<sycl::info::event_profiling::command_end>() -
+                    ev_start.get_profiling_info<sycl::info::event_profiling::command_end>();
+        *ms = ns / 1000000.0;
+    } catch (sycl::exception &e) {
+        // Queues are only created with profiling enabled if XPU_PROFILE is set
+        return 1;
+    }
+    return 0;
+}
+
 error sycl_driver::memcpy(void *dst, const void *src, size_t bytes) {
     m_default_queue.memcpy(dst, src, bytes).wait();
     return 0;
@@ -180,6 +237,28 @@ error sycl_driver::meminfo(size_t *free, size_t *total) {
     return 0;
 }
 
+error sycl_driver::sort_pairs(void * /*keys*/, void * /*values*/, size_t /*n*/, sort_key_t, size_t /*value_size*/) {
+    // No device-wide sort in SYCL itself. Without oneDPL the runtime sorts on the host.
+    return not_supported;
+}
+
+error sycl_driver::begin_capture(void * /*queue*/) {
+    // Graphs are only available as a vendor extension. The runtime replays recorded commands instead.
+    return not_supported;
+}
+
+error sycl_driver::end_capture(void * /*queue*/, void ** /*graph*/) {
+    return not_supported;
+}
+
+error sycl_driver::launch_graph(void * /*graph*/, void * /*queue*/) {
+    return not_supported;
+}
+
+error sycl_driver::destroy_graph(void * /*graph*/) {
+    return not_supported;
+}
+
 const char *sycl_driver::error_to_string(error /*err*/) {
     return "Unknown error";
 }
@@ -18,15 +18,24 @@ public:
     sycl::queue get_queue(void *);
 
     error setup() override;
-    error malloc_device(void **, size_t) override;
-    error malloc_host(void **, size_t) override;
-    error malloc_shared(void **, size_t) override;
+    error malloc_device(void **, size_t, int) override;
+    error malloc_host(void **, size_t, int) override;
+    error malloc_shared(void **, size_t, int) override;
     error free(void *) override;
+    error register_host(void *, size_t, bool) override;
+    error unregister_host(void *) override;
 
     error create_queue(void **, int) override;
     error destroy_queue(void *) override;
     error synchronize_queue(void *) override;
 
+    error create_event(void **, int) override;
+    error destroy_event(void *) override;
+    error record_event(void *, void *) override;
+    error wait_event(void *, void *) override;
+    error synchronize_event(void *) override;
+    error event_elapsed_time(double *, void *, void *) override;
+
     error memcpy(void *, const void *, size_t) override;
     error memcpy_async(void *, const void *, size_t, void *, double *) override;
     error memset(void *, int, size_t) override;
@@ -39,6 +48,11 @@ public:
     error get_properties(device_prop *, int) override;
     error get_ptr_prop(const void *, int *, mem_type *) override;
     error meminfo(size_t *, size_t *) override;
+    error sort_pairs(void *, void *, size_t, sort_key_t, size_t) override;
+    error begin_capture(void *) override;
+    error end_capture(void *, void **) override;
+    error launch_graph(void *, void *) override;
+    error destroy_graph(void *) override;
     const char *error_to_string(error) override;
     driver_t get_type() override;
 
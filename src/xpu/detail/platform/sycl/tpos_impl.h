@@ -8,7 +8,7 @@ namespace xpu::detail {
 class tpos_impl {
 
 public:
-    tpos_impl(sycl::nd_item<3> nd_item) : m_nd_item(nd_item) {}
+    tpos_impl(sycl::nd_item<3> nd_item, int instance_idx = 0) : m_nd_item(nd_item), m_instance_idx(instance_idx) {}
 
     int thread_idx_x() const { return m_nd_item.get_local_id(0); }
     int thread_idx_y() const { return m_nd_item.get_local_id(1); }
@@ -26,12 +26,15 @@ public:
     int grid_dim_y() const { return m_nd_item.get_group_range(1); }
     int grid_dim_z() const { return m_nd_item.get_group_range(2); }
 
+    int instance_idx() const { return m_instance_idx; }
+
     void barrier() const { m_nd_item.barrier(sycl::access::fence_space::local_space); }
 
     sycl::group<3> group() const { return m_nd_item.get_group(); }
 
 private:
     sycl::nd_item<3> m_nd_item;
+    int m_instance_idx;
 
 };
 
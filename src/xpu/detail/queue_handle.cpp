@@ -9,8 +9,10 @@ queue_handle::queue_handle() : queue_handle(runtime::instance().active_device())
 
 queue_handle::queue_handle(device dev_) : dev(dev_) {
     backend::call(dev.backend, &backend_base::create_queue, &handle, dev.device_nr);
+    runtime::instance().add_queue(dev, handle);
 }
 
 queue_handle::~queue_handle() {
+    runtime::instance().remove_queue(dev, handle);
     backend::call(dev.backend, &backend_base::destroy_queue, handle);
 }
@@ -1,8 +1,12 @@
 #include "backend.h"
 #include "runtime.h"
+#include "platform/cpu/cpu_driver.h"
+#include "platform/cpu/vector_math.h"
+#include "trace.h"
 #include "../host.h"
 
 #include <cstdlib>
+#include <cstddef>
 #include <sstream>
 
 #define DRIVER_CALL_I(type, func) throw_on_driver_error(static_cast<detail::driver_t>(type), \
@@ -13,6 +17,13 @@
 
 using namespace xpu::detail;
 
+static void trace_bytes(trace_span &span, const device &dev, size_t bytes) {
+    if (span.active()) {
+        span.event().device = dev.id;
+        span.event().bytes = bytes;
+    }
+}
+
 bool runtime::getenv_bool(std::string driver_name, bool fallback) {
     const char *env = getenv(driver_name.c_str());
     return (env == nullptr ? fallback : (strcmp(env, "0") != 0));
@@ -23,6 +34,21 @@ std::string runtime::getenv_str(std::string driver_name, std::string_view fallba
     return (env == nullptr ? std::string{fallback} : std::string{env});
 }
 
+long runtime::getenv_int(std::string driver_name, long fallback) {
+    const char *env = getenv(driver_name.c_str());
+    if (env == nullptr) {
+        return fallback;
+    }
+    char *end = nullptr;
+    long value = std::strtol(env, &end, 10);
+    // Values are sizes or counts. Negative values would wrap around when converted to size_t.
+    if (end == env || *end != '\0' || value < 0) {
+        XPU_LOG("Ignoring invalid value %s='%s', expected a non-negative integer. Using %ld instead.", driver_name.c_str(), env, fallback);
+        return fallback;
+    }
+    return value;
+}
+
 runtime &runtime::instance() {
     static runtime the_runtime{};
     return the_runtime;
@@ -33,13 +59,32 @@ void runtime::initialize(const settings &settings) {
     bool verbose = getenv_bool("XPU_VERBOSE", settings.verbose);
     config::logging = verbose;
     if (verbose) {
-        logger::instance().initialize(settings.logging_sink);
+        logger::instance().initialize(settings.logging_sink, getenv_bool("XPU_ASYNC_LOGGING", settings.async_logging));
     }
 
     config::profile = getenv_bool("XPU_PROFILE", settings.profile);
+    config::profile_samples = getenv_bool("XPU_PROFILE_SAMPLES", settings.profile_samples);
+    config::perf_counters = getenv_bool("XPU_PERF_COUNTERS", settings.perf_counters);
+
+    config::trace = settings.trace;
+    if (std::string trace_file = getenv_str("XPU_TRACE", ""); not trace_file.empty()) {
+        config::trace = true;
+        write_trace_at_exit(trace_file);
+    }
+    config::trace_max_events = getenv_int("XPU_TRACE_MAX_EVENTS", settings.trace_max_events);
+    config::cpu_threads = getenv_int("XPU_CPU_THREADS", settings.cpu_threads);
+    config::cpu_chunk_size = getenv_int("XPU_CPU_CHUNK_SIZE", settings.cpu_chunk_size);
+    config::memory_cache = getenv_bool("XPU_MEMORY_CACHE", settings.memory_cache);
+    config::memory_cache_limit = getenv_int("XPU_MEMORY_CACHE_LIMIT", settings.memory_cache_limit);
+
+    if (auto math_isa = getenv_str("XPU_CPU_MATH_ISA", settings.cpu_math_isa); not vmath::select(math_isa)) {
+        raise_error(format("Requested unknown or unsupported instruction set with XPU_CPU_MATH_ISA='%s'", math_isa.c_str()));
+    }
 
     backend::load();
 
+    XPU_LOG("Using %s kernels for xpu::math.", vmath::kernels().isa);
+
     XPU_LOG("Found devices:");
     for (driver_t driver : {cpu, cuda, hip, sycl}) {
         if (not backend::is_available(driver)) {
@@ -80,42 +125,89 @@ void runtime::initialize(const settings &settings) {
     }
 }
 
-void *runtime::malloc_host(size_t bytes) {
+void *runtime::malloc_host(size_t bytes, const device &dev) {
+    trace_span span{trace_alloc, "malloc_host"};
+    trace_bytes(span, dev, bytes);
     void *ptr = nullptr;
-    DRIVER_CALL(malloc_host(&ptr, bytes));
-    XPU_LOG("Allocating %lu bytes @ address %p on host memory with driver %s.", bytes, ptr, driver_to_str(m_active_device.backend));
+    throw_on_driver_error(dev.backend, m_memory_cache.allocate(&ptr, dev, mem_host, bytes));
+    XPU_LOG("Allocating %lu bytes @ address %p on host memory with driver %s.", bytes, ptr, driver_to_str(dev.backend));
     return ptr;
 }
 
-void *runtime::malloc_device(size_t bytes) {
+void *runtime::malloc_device(size_t bytes, const device &dev) {
+    trace_span span{trace_alloc, "malloc_device"};
+    trace_bytes(span, dev, bytes);
     if (logger::instance().active()) {
         size_t free, total;
-        DRIVER_CALL(meminfo(&free, &total));
-        device_prop props = device_properties(m_active_device.id);
+        DRIVER_CALL_I(dev.backend, meminfo(&free, &total));
+        device_prop props = device_properties(dev.id);
         XPU_LOG("Allocating %lu bytes on device %s. [%lu / %lu available]", bytes, props.name.c_str(), free, total);
     }
     void *ptr = nullptr;
-    DRIVER_CALL(malloc_device(&ptr, bytes));
+    throw_on_driver_error(dev.backend, m_memory_cache.allocate(&ptr, dev, mem_device, bytes));
     return ptr;
 }
 
-void *runtime::malloc_shared(size_t bytes) {
+void *runtime::malloc_shared(size_t bytes, const device &dev) {
+    trace_span span{trace_alloc, "malloc_shared"};
+    trace_bytes(span, dev, bytes);
     if (logger::instance().active()) {
         size_t free, total;
-        DRIVER_CALL(meminfo(&free, &total));
-        device_prop props = device_properties(m_active_device.id);
+        DRIVER_CALL_I(dev.backend, meminfo(&free, &total));
+        device_prop props = device_properties(dev.id);
         XPU_LOG("Allocating %lu bytes of managed memory on device %s. [%lu / %lu available]", bytes, props.name.c_str(), free, total);
     }
     void *ptr = nullptr;
-    DRIVER_CALL(malloc_shared(&ptr, bytes));
+    throw_on_driver_error(dev.backend, m_memory_cache.allocate(&ptr, dev, mem_shared, bytes));
     return ptr;
 }
 
 void runtime::free(void *ptr) {
-    DRIVER_CALL(free(ptr));
+    trace_span span{trace_free, "free"};
+    trace_bytes(span, m_active_device, 0);
+    if (m_active_device.backend == cpu) {
+        // CPU queues run on their own threads, so pending commands may still use the memory.
+        // Wait for them, before the memory cache hands the memory out again.
+        static_cast<cpu_driver *>(backend::get(cpu))->drain_queues();
+    }
+    throw_on_driver_error(m_active_device.backend, m_memory_cache.free(m_active_device.backend, ptr));
+}
+
+bool runtime::register_host(driver_t d, void *ptr, size_t bytes, bool read_only) {
+    error err = backend::get(d)->register_host(ptr, bytes, read_only);
+    if (err == backend_base::not_supported) {
+        return false;
+    }
+    throw_on_driver_error(d, err);
+    XPU_LOG("Registered %lu bytes @ address %p as host memory with driver %s.", bytes, ptr, driver_to_str(d));
+    return true;
+}
+
+void runtime::unregister_host(driver_t d, void *ptr) {
+    DRIVER_CALL_I(d, unregister_host(ptr));
+}
+
+void runtime::trim_memory_cache() {
+    XPU_LOG("Releasing cached memory.");
+    throw_on_driver_error(m_active_device.backend, m_memory_cache.trim());
+}
+
+void runtime::get_memory_cache_stats(memory_cache_stats *stats) {
+    m_memory_cache.get_stats(stats);
+}
+
+void runtime::add_queue(device dev, void *handle) {
+    m_memory_cache.add_queue(dev, handle);
+}
+
+void runtime::remove_queue(device dev, void *handle) {
+    m_memory_cache.remove_queue(dev, handle);
 }
 
 void runtime::memcpy(void *dst, const void *src, size_t bytes) {
+    trace_span span{trace_copy, "copy"};
+    trace_bytes(span, m_active_device, bytes);
+
     if (logger::instance().active()) {
         xpu::ptr_prop src_prop{src};
         xpu::ptr_prop dst_prop{dst};
@@ -132,6 +224,9 @@ void runtime::memcpy(void *dst, const void *src, size_t bytes) {
 }
 
 void runtime::memset(void *dst, int ch, size_t bytes) {
+    trace_span span{trace_memset, "memset"};
+    trace_bytes(span, m_active_device, bytes);
+
     if (logger::instance().active()) {
         xpu::ptr_prop dst_prop{dst};
         device_prop dev;
@@ -141,6 +236,142 @@ void runtime::memset(void *dst, int ch, size_t bytes) {
     DRIVER_CALL(memset(dst, ch, bytes));
 }
 
+void runtime::host_parallel_for(size_t n, void(*fn)(void *, size_t, size_t), void *args, size_t chunk_size) {
+    auto *cpu_drv = static_cast<cpu_driver *>(backend::get(cpu));
+    cpu_drv->pool(cpu_drv->active_device()).parallel_for(n, fn, args, chunk_size);
+}
+
+void runtime::instantiate_graph(graph_impl &g, void *queue_handle) {
+    if (g.native != nullptr || !g.native_supported) {
+        return;
+    }
+
+    backend_base *drv = backend::get(g.dev.backend);
+    error err = drv->begin_capture(queue_handle);
+    if (err == backend_base::not_supported) {
+        XPU_LOG("Driver %s has no native graphs. Replaying recorded commands instead.", driver_to_str(g.dev.backend));
+        g.native_supported = false;
+        return;
+    }
+    throw_on_driver_error(g.dev.backend, err);
+
+    for (const auto &node : *g.nodes) {
+        err = node->run(queue_handle);
+        if (err != 0) {
+            void *partial = nullptr;
+            if (drv->end_capture(queue_handle, &partial) == 0 && partial != nullptr) {
+                drv->destroy_graph(partial);
+            }
+            throw_on_driver_error(g.dev.backend, err);
+        }
+    }
+    DRIVER_CALL_I(g.dev.backend, end_capture(queue_handle, &g.native));
+}
+
+void runtime::launch_graph(const std::shared_ptr<graph_impl> &g, const queue_handle &q) {
+    if (q.dev.backend == cpu) {
+        // Submit the whole graph as one command. Nodes notice they run on the executor
+        // and execute immediately instead of submitting themselves again.
+        // Replay stops at the first failing node, the error is thrown by the next queue::wait.
+        auto *queue = static_cast<cpu_queue *>(q.handle);
+        queue->submit([nodes = g->nodes, queue]() {
+            for (size_t i = 0; i < nodes->size(); i++) {
+                if (error err = (*nodes)[i]->run(queue); err != 0) {
+                    XPU_LOG("Graph node %zu failed with error %d, skipping remaining nodes.", i, err);
+                    queue->fail(err);
+                    return;
+                }
+            }
+        });
+        return;
+    }
+
+    instantiate_graph(*g, q.handle);
+    if (g->native != nullptr) {
+        DRIVER_CALL_I(q.dev.backend, launch_graph(g->native, q.handle));
+        return;
+    }
+
+    for (const auto &node : *g->nodes) {
+        throw_on_driver_error(q.dev.backend, node->run(q.handle));
+    }
+}
+
+static size_t sort_key_size(sort_key_t type) {
+    switch (type) {
+    case sort_key_int32:
+    case sort_key_uint32:
+    case sort_key_float:
+        return 4;
+    case sort_key_int64:
+    case sort_key_uint64:
+    case sort_key_double:
+        break;
+    }
+    return 8;
+}
+
+void runtime::sort_pairs(void *keys, void *values, size_t n, sort_key_t type, size_t value_size) {
+    XPU_LOG("Sorting %lu keys on %s.", n, driver_to_str(m_active_device.backend));
+    error err = get_active_driver()->sort_pairs(keys, values, n, type, value_size);
+    if (err != backend_base::not_supported) {
+        throw_on_driver_error(m_active_device.backend, err);
+        return;
+    }
+
+    // Backend can't sort these keys, fall back to sorting on the host.
+    XPU_LOG("Driver %s can't sort these keys. Sorting on the host instead.", driver_to_str(m_active_device.backend));
+    size_t key_bytes = n * sort_key_size(type);
+    size_t value_bytes = (values == nullptr ? 0 : n * value_size);
+    std::unique_ptr<std::byte[]> h_keys{new std::byte[key_bytes]};
+    std::unique_ptr<std::byte[]> h_values{value_bytes > 0 ? new std::byte[value_bytes] : nullptr};
+
+    DRIVER_CALL(memcpy(h_keys.get(), keys, key_bytes));
+    if (h_values != nullptr) {
+        DRIVER_CALL(memcpy(h_values.get(), values, value_bytes));
+    }
+    CPU_DRIVER_CALL(sort_pairs(h_keys.get(), h_values.get(), n, type, value_size));
+    DRIVER_CALL(memcpy(keys, h_keys.get(), key_bytes));
+    if (h_values != nullptr) {
+        DRIVER_CALL(memcpy(values, h_values.get(), value_bytes));
+    }
+}
+
+void runtime::sort_items(void *items, size_t n, size_t item_size, sort_key_t type, key_getter_fn get_keys, void *getter) {
+    XPU_LOG("Sorting %lu items of %lu bytes on the host.", n, item_size);
+
+    // Items are sorted as payload of their keys. So they have to be copied to the host,
+    // unless they are already there.
+    bool on_host = (m_active_device.backend == cpu);
+    std::unique_ptr<std::byte[]> h_items;
+    void *data = items;
+    if (!on_host) {
+        h_items.reset(new std::byte[n * item_size]);
+        DRIVER_CALL(memcpy(h_items.get(), items, n * item_size));
+        data = h_items.get();
+    }
+
+    std::unique_ptr<std::byte[]> keys{new std::byte[n * sort_key_size(type)]};
+
+    struct extract_args {
+        key_getter_fn get_keys;
+        void *getter;
+        const void *items;
+        void *keys;
+    } args{get_keys, getter, data, keys.get()};
+
+    host_parallel_for(n, [](void *a, size_t begin, size_t end) {
+        auto *e = static_cast<extract_args *>(a);
+        e->get_keys(e->getter, e->items, e->keys, begin, end);
+    }, &args);
+
+    CPU_DRIVER_CALL(sort_pairs(keys.get(), data, n, type, item_size));
+
+    if (!on_host) {
+        DRIVER_CALL(memcpy(items, h_items.get(), n * item_size));
+    }
+}
+
 xpu::detail::device_prop runtime::device_properties(int id) {
     detail::device_prop props;
     detail::device d = m_devices.at(id);
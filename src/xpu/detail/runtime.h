@@ -6,10 +6,13 @@
 #include "config.h"
 #include "dl_utils.h"
 #include "dynamic_loader.h"
+#include "graph.h"
 #include "timers.h"
 #include "log.h"
+#include "memory_cache.h"
 
 #include <array>
+#include <atomic>
 #include <memory>
 #include <optional>
 #include <string>
@@ -18,6 +21,7 @@
 
 namespace xpu {
 class ptr_prop;
+struct memory_cache_stats;
 struct settings;
 }
 
@@ -61,14 +65,41 @@ public:
 
     void initialize(const settings &);
 
-    void *malloc_host(size_t);
-    void *malloc_device(size_t);
-    void *malloc_shared(size_t);
+    // Allocate memory on the given device. xpu::malloc_* pass the active device.
+    void *malloc_host(size_t, const device &);
+    void *malloc_device(size_t, const device &);
+    void *malloc_shared(size_t, const device &);
     void free(void *);
 
+    // Page-lock host memory that wasn't allocated by xpu. Returns false if the driver can't.
+    // Takes the backend explicitly, memory has to be unregistered with the same driver even if the active device changed.
+    bool register_host(driver_t, void *, size_t, bool read_only);
+    void unregister_host(driver_t, void *);
+
+    void trim_memory_cache();
+    void get_memory_cache_stats(memory_cache_stats *);
+
+    // Queues that the memory cache has to order reused blocks with.
+    void add_queue(device, void *handle);
+    void remove_queue(device, void *handle);
+
     void memcpy(void *, const void *, size_t);
     void memset(void *, int, size_t);
 
+    // Call fn(args, begin, end) on disjoint chunks of [0, n) on the threads of the CPU driver.
+    // Used by algorithms that run on the host.
+    void host_parallel_for(size_t n, void(*fn)(void *, size_t, size_t), void *args, size_t chunk_size = 0);
+
+    // Sort n keys (and values) in device memory of the active device.
+    void sort_pairs(void *keys, void *values, size_t n, sort_key_t, size_t value_size);
+
+    // Extracts the keys of items [begin, end) into keys[begin, end).
+    using key_getter_fn = void(*)(void *getter, const void *items, void *keys, size_t begin, size_t end);
+
+    // Sort n items of item_size bytes by the keys returned from a key getter.
+    // Keys are extracted on the host.
+    void sort_items(void *items, size_t n, size_t item_size, sort_key_t, key_getter_fn, void *getter);
+
     std::vector<detail::device> get_devices() { return m_devices; }
     detail::device active_device() const { return m_active_device; }
     detail::device get_device(int id) const { return m_devices.at(id); }
@@ -84,23 +115,83 @@ public:
         static_assert(std::is_same_v<typename Kernel::tag, kernel_tag>);
 
         double ms;
+        kernel_counters counters;
         kernel_launch_info launch_info {
             .g = g,
             .queue_handle = queue_handle,
-            .ms = (config::profile ? &ms : nullptr)
+            .ms = (config::profiling() ? &ms : nullptr),
+            .counters = (config::profiling() && config::perf_counters ? &counters : nullptr)
         };
-        error err = get_image<Kernel>(backend)->template run_kernel<Kernel>(launch_info, std::forward<Args>(args)...);
+        error err = get_action<Kernel>(backend)(launch_info, std::forward<Args>(args)...);
         throw_on_driver_error(m_active_device.backend, err);
 
-        if (config::profile) {
-            add_kernel_time(type_name<Kernel>(), ms);
+        if (config::profiling()) {
+            add_kernel_time(linear_type_id<Kernel>::get(), type_name<Kernel>(), ms, counters);
         }
     }
 
+    // Run independent instances of a kernel. The CPU driver runs all instances in one parallel region.
+    // On other backends this is only a loop over regular launches, there is no device side batch.
+    template<typename Kernel>
+    void run_kernel_batch(const grid *grids, const kernel_args_t<Kernel> *args, size_t n, driver_t backend, void *queue_handle) {
+        static_assert(std::is_same_v<typename Kernel::tag, kernel_tag>);
+        if (n == 0) {
+            return;
+        }
+
+        double ms = 0;
+        kernel_counters counters;
+        action_interface_t<Kernel> fn = get_action<Kernel>(backend);
+
+        if (backend == cpu) {
+            kernel_batch batch{grids, args, n};
+            kernel_launch_info launch_info {
+                .g = grids[0],
+                .queue_handle = queue_handle,
+                .ms = (config::profiling() ? &ms : nullptr),
+                .batch = &batch,
+                .counters = (config::profiling() && config::perf_counters ? &counters : nullptr)
+            };
+            // The driver reads arguments from the batch. Arguments of the first instance are only passed to match the signature.
+            error err = std::apply([&](const auto &... a) { return fn(launch_info, a...); }, args[0]);
+            throw_on_driver_error(backend, err);
+        } else {
+            for (size_t i = 0; i < n; i++) {
+                double instance_ms = 0;
+                kernel_launch_info launch_info {
+                    .g = grids[i],
+                    .queue_handle = queue_handle,
+                    .ms = (config::profiling() ? &instance_ms : nullptr),
+                    .instance = static_cast<int>(i)
+                };
+                error err = std::apply([&](const auto &... a) { return fn(launch_info, a...); }, args[i]);
+                throw_on_driver_error(backend, err);
+                ms += instance_ms;
+            }
+        }
+
+        if (config::profiling()) {
+            add_kernel_time(linear_type_id<Kernel>::get(), type_name<Kernel>(), ms, counters);
+        }
+    }
+
+    // Record a kernel launch into a graph. Arguments are copied into the node.
+    template<typename Kernel, typename... Args>
+    std::shared_ptr<const graph_node> make_kernel_node(driver_t backend, grid g, Args&&... args) {
+        static_assert(std::is_same_v<typename Kernel::tag, kernel_tag>);
+        return std::make_shared<const kernel_node<Kernel, std::decay_t<Args>...>>(
+            get_action<Kernel>(backend), g, std::forward<Args>(args)...);
+    }
+
+    // Prepare a captured graph for launching. Creates the native graph, if the backend supports them.
+    void instantiate_graph(graph_impl &, void *queue_handle);
+
+    void launch_graph(const std::shared_ptr<graph_impl> &, const queue_handle &);
+
     template<typename Func, typename... Args>
     void call(Args&&... args) {
         static_assert(std::is_same_v<typename Func::tag, function_tag>);
-        error err = get_image<Func>(m_active_device.backend)->template call<Func>(std::forward<Args>(args)...);
+        error err = get_action<Func>(m_active_device.backend)(std::forward<Args>(args)...);
         throw_on_driver_error(m_active_device.backend, err);
     }
 
@@ -108,7 +199,7 @@ public:
     void set_constant(const typename C::data_t &symbol) {
         static_assert(std::is_same_v<typename C::tag, constant_tag>);
         XPU_LOG("Updating constant '%s'.", type_name<C>());
-        error err = get_image<C>(m_active_device.backend)->template set<C>(symbol);
+        error err = get_action<C>(m_active_device.backend)(symbol);
         throw_on_driver_error(m_active_device.backend, err);
     }
 
@@ -127,12 +218,28 @@ public:
 
 private:
     image_pool m_images;
+    memory_cache m_memory_cache;
 
     detail::device m_active_device;
     std::vector<detail::device> m_devices;
 
     static bool getenv_bool(std::string name, bool fallback);
     static std::string getenv_str(std::string name, std::string_view fallback);
+    static long getenv_int(std::string name, long fallback);
+
+    // Entry points are resolved once per action and backend and cached in a static table,
+    // so a launch costs a single indirect call afterwards. Images are never unloaded,
+    // so cached entries stay valid.
+    template<typename A>
+    action_interface_t<A> get_action(driver_t backend) {
+        static std::array<std::atomic<action_interface_t<A>>, num_drivers> cache{};
+        action_interface_t<A> fn = cache[backend].load(std::memory_order_acquire);
+        if (fn == nullptr) {
+            fn = get_image<A>(backend)->template get_action<A>();
+            cache[backend].store(fn, std::memory_order_release);
+        }
+        return fn;
+    }
 
     template<typename A>
     image<typename A::image> *get_image(driver_t backend) {
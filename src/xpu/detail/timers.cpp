@@ -1,7 +1,7 @@
 #include "timers.h"
 #include "config.h"
+#include "trace.h"
 
-#include <algorithm>
 #include <chrono>
 #include <stdexcept>
 
@@ -11,88 +11,126 @@ using MS = std::chrono::duration<double, std::milli>;
 
 struct timer {
     std::chrono::time_point<std::chrono::high_resolution_clock> start;
+    double trace_begin_us = 0;
     timings ts;
 
+    // Linear type id of each entry in ts.kernels, and the reverse lookup (-1 if the kernel has no entry yet)
+    std::vector<size_t> kernel_ids;
+    std::vector<int> kernel_index;
+
     timer() : start(std::chrono::high_resolution_clock::now()) {}
+
+    kernel_timings &kernel(size_t id, std::string_view name) {
+        if (id >= kernel_index.size()) {
+            kernel_index.resize(id + 1, -1);
+        }
+        int &idx = kernel_index[id];
+        if (idx < 0) {
+            idx = static_cast<int>(ts.kernels.size());
+            ts.kernels.emplace_back(name);
+            kernel_ids.push_back(id);
+        }
+        return ts.kernels[idx];
+    }
+
+    // Add copy, memset and kernel times of a finished child timer.
+    void merge_details(const timer &child) {
+        ts.copy_h2d += child.ts.copy_h2d;
+        ts.bytes_h2d += child.ts.bytes_h2d;
+        ts.copy_d2h += child.ts.copy_d2h;
+        ts.bytes_d2h += child.ts.bytes_d2h;
+        ts.memset += child.ts.memset;
+        ts.bytes_memset += child.ts.bytes_memset;
+
+        for (size_t i = 0; i < child.ts.kernels.size(); i++) {
+            const kernel_timings &ck = child.ts.kernels[i];
+            kernel(child.kernel_ids[i], ck.name).merge(ck);
+        }
+    }
 };
 
-static struct {
-    std::vector<timer> stack;
-} T;
+// Every thread has its own stack of timers. Measurements only go to the innermost timer
+// and are merged into its parent when it's popped, so recording them takes constant time.
+static thread_local std::vector<timer> t_stack;
 
 void xpu::detail::push_timer(std::string_view name) {
-    timer &t = T.stack.emplace_back();
+    timer &t = t_stack.emplace_back();
     t.ts.name = name;
-    t.ts.has_details = config::profile;
+    t.ts.has_details = config::profiling();
+    if (config::trace) {
+        t.trace_begin_us = trace_now_us();
+    }
 }
 
 timings xpu::detail::pop_timer() {
-    if (T.stack.empty()) {
+    if (t_stack.empty()) {
         throw std::runtime_error("xpu::pop_timer call, but timer stack is empty");
     }
 
-    auto t = T.stack.back();
-    T.stack.pop_back();
+    timer t = std::move(t_stack.back());
+    t_stack.pop_back();
 
     auto end = std::chrono::high_resolution_clock::now();
     MS duration = std::chrono::duration_cast<MS>(end - t.start);
     t.ts.wall = duration.count();
 
-    if (!T.stack.empty()) {
-        T.stack.back().ts.children.push_back(t.ts);
+    if (config::trace) {
+        trace_event ev;
+        ev.name = t.ts.name;
+        ev.category = trace_region;
+        ev.begin_us = t.trace_begin_us;
+        ev.end_us = trace_now_us();
+        trace_record(std::move(ev));
     }
 
-    return t.ts;
+    if (!t_stack.empty()) {
+        timer &parent = t_stack.back();
+        parent.merge_details(t);
+        parent.ts.children.push_back(t.ts);
+    }
+
+    return std::move(t.ts);
 }
 
 void xpu::detail::add_memset_time(double ms, size_t bytes) {
-    for (auto &t : T.stack) {
-        t.ts.memset += ms;
-        t.ts.bytes_memset += bytes;
+    if (t_stack.empty()) {
+        return;
     }
+    timer &t = t_stack.back();
+    t.ts.memset += ms;
+    t.ts.bytes_memset += bytes;
 }
 
 void xpu::detail::add_memcpy_time(double ms, direction_t dir, size_t bytes) {
-    for (auto &t : T.stack) {
-        if (dir == dir_h2d) {
-            t.ts.copy_h2d += ms;
-            t.ts.bytes_h2d += bytes;
-        } else {
-            t.ts.copy_d2h += ms;
-            t.ts.bytes_d2h += bytes;
-        }
+    if (t_stack.empty()) {
+        return;
+    }
+    timer &t = t_stack.back();
+    if (dir == dir_h2d) {
+        t.ts.copy_h2d += ms;
+        t.ts.bytes_h2d += bytes;
+    } else {
+        t.ts.copy_d2h += ms;
+        t.ts.bytes_d2h += bytes;
     }
 }
 
-void xpu::detail::add_kernel_time(std::string_view name, double ms) {
-    for (auto &t : T.stack) {
-        auto &k = t.ts.kernels;
-        auto it = std::find_if(k.begin(), k.end(),
-            [&](const auto &krnl) { return krnl.name == name; });
-        if (it == k.end()) {
-            k.emplace_back(name, ms);
-        } else {
-            it->times.emplace_back(ms);
-        }
+void xpu::detail::add_kernel_time(size_t kernel_id, std::string_view name, double ms, const kernel_counters &counters) {
+    if (t_stack.empty()) {
+        return;
     }
+    kernel_timings &k = t_stack.back().kernel(kernel_id, name);
+    k.add(ms, config::profile_samples);
+    k.counters.add(counters);
 }
 
 void xpu::detail::add_bytes_timer(size_t bytes) {
-    T.stack.back().ts.bytes_input += bytes;
+    t_stack.back().ts.bytes_input += bytes;
 }
 
-void xpu::detail::add_bytes_kernel(std::string_view name, size_t bytes) {
-
-    for (auto &t : T.stack) {
-        auto &k = t.ts.kernels;
-        auto it = std::find_if(k.begin(), k.end(),
-            [&](const auto &krnl) { return krnl.name == name; });
-
-        if (it == k.end()) {
-            k.emplace_back(name);
-            it = k.end() - 1;
-        }
-        it->bytes_input += bytes;
+void xpu::detail::add_bytes_kernel(size_t kernel_id, std::string_view name, size_t bytes) {
+    if (t_stack.empty()) {
+        return;
     }
-
+    t_stack.back().kernel(kernel_id, name).bytes_input += bytes;
 }
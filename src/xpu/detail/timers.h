@@ -12,10 +12,11 @@ timings pop_timer();
 
 void add_memset_time(double, size_t);
 void add_memcpy_time(double, direction_t, size_t);
-void add_kernel_time(std::string_view, double);
+// Kernels are identified by their linear_type_id, the name is only stored.
+void add_kernel_time(size_t kernel_id, std::string_view name, double, const kernel_counters & = {});
 
 void add_bytes_timer(size_t);
-void add_bytes_kernel(std::string_view, size_t);
+void add_bytes_kernel(size_t kernel_id, std::string_view name, size_t);
 
 } // namespace xpu::detail
 
@@ -0,0 +1,359 @@
+#include "trace.h"
+#include "backend.h"
+#include "log.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+
+using namespace xpu::detail;
+
+namespace {
+
+// Events of one thread (or GPU queue). Only the owning thread appends, but the trace may be written from any thread.
+struct thread_events {
+    int tid;
+    std::string name;
+    std::mutex mutex;
+    std::vector<trace_event> events; // Ring buffer once it holds config::trace_max_events
+    size_t oldest = 0;
+    size_t dropped = 0;
+
+    void append(trace_event &&ev) {
+        size_t max_events = config::trace_max_events;
+        if (max_events == 0 || events.size() < max_events) {
+            events.emplace_back(std::move(ev));
+            return;
+        }
+        events[oldest] = std::move(ev);
+        oldest = (oldest + 1) % events.size();
+        dropped++;
+    }
+
+    template<typename F>
+    void for_each(F &&f) const {
+        for (size_t i = 0; i < events.size(); i++) {
+            f(events[(oldest + i) % events.size()]);
+        }
+    }
+};
+
+// Command on a GPU queue, timed with device events.
+struct device_command {
+    trace_event ev;
+    device dev;
+    void *start;
+    void *end;
+};
+
+// Device events are converted to host time relative to an event recorded at a known host time.
+struct device_clock {
+    void *anchor = nullptr;
+    double anchor_us = 0;
+};
+
+struct trace_registry {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    std::mutex mutex;
+    // Kept after their thread exits, so its events still end up in the trace.
+    std::vector<std::shared_ptr<thread_events>> threads;
+
+    std::string exit_file;
+
+    // Commands whose device times weren't read back yet, and the track of each GPU queue.
+    // Kept separate from the host threads, so resolving them doesn't block recording.
+    std::mutex device_mutex;
+    std::deque<device_command> device_commands;
+    std::unordered_map<int, device_clock> device_clocks;
+    std::unordered_map<const void *, std::shared_ptr<thread_events>> queue_tracks;
+
+    // Resolve old commands once this many are pending, they have most likely finished by then.
+    static constexpr size_t max_pending_commands = 4096;
+
+    static trace_registry &instance() {
+        // Never destroyed, as the trace may be written at exit.
+        static trace_registry *the_registry = new trace_registry{};
+        return *the_registry;
+    }
+
+    thread_events &this_thread() {
+        static thread_local std::shared_ptr<thread_events> events = [this] {
+            std::lock_guard<std::mutex> lock{mutex};
+            return add_track(format("thread %zu", threads.size()));
+        }();
+        return *events;
+    }
+
+    // Call with mutex held.
+    std::shared_ptr<thread_events> add_track(std::string name) {
+        auto t = std::make_shared<thread_events>();
+        t->tid = static_cast<int>(threads.size());
+        t->name = std::move(name);
+        threads.push_back(t);
+        return t;
+    }
+
+    // Returns nullptr if the device can't be timed. Call with device_mutex held.
+    device_clock *clock_of(const device &dev) {
+        auto it = device_clocks.find(dev.id);
+        if (it != device_clocks.end()) {
+            return it->second.anchor == nullptr ? nullptr : &it->second;
+        }
+
+        device_clock &clock = device_clocks[dev.id];
+        backend_base *b = backend::get(dev.backend);
+        void *anchor = nullptr;
+        if (b->create_event(&anchor, dev.device_nr) != 0) {
+            return nullptr;
+        }
+        if (b->record_event(anchor, nullptr) != 0 || b->synchronize_event(anchor) != 0) {
+            b->destroy_event(anchor);
+            return nullptr;
+        }
+        clock.anchor = anchor;
+        clock.anchor_us = trace_now_us();
+        return &clock;
+    }
+
+    // Read back the device times of the oldest pending command. Call with device_mutex held.
+    void resolve_oldest() {
+        device_command cmd = std::move(device_commands.front());
+        device_commands.pop_front();
+
+        backend_base *b = backend::get(cmd.dev.backend);
+        device_clock &clock = device_clocks.at(cmd.dev.id);
+        double start_ms = 0;
+        double end_ms = 0;
+        bool ok = b->synchronize_event(cmd.end) == 0
+            && b->event_elapsed_time(&start_ms, clock.anchor, cmd.start) == 0
+            && b->event_elapsed_time(&end_ms, clock.anchor, cmd.end) == 0;
+        b->destroy_event(cmd.start);
+        b->destroy_event(cmd.end);
+        if (not ok) {
+            // E.g. SYCL queues without profiling enabled
+            return;
+        }
+
+        cmd.ev.begin_us = clock.anchor_us + start_ms * 1000.;
+        cmd.ev.end_us = clock.anchor_us + end_ms * 1000.;
+
+        auto track = queue_tracks.find(cmd.ev.queue);
+        if (track == queue_tracks.end()) {
+            std::string name = format("xpu queue %zu (%s%d)", queue_tracks.size(), driver_to_str(cmd.dev.backend, true), cmd.dev.device_nr);
+            std::lock_guard<std::mutex> lock{mutex};
+            track = queue_tracks.emplace(cmd.ev.queue, add_track(std::move(name))).first;
+        }
+        std::lock_guard<std::mutex> lock{track->second->mutex};
+        track->second->append(std::move(cmd.ev));
+    }
+};
+
+thread_local trace_span *t_current_span = nullptr;
+
+const char *category_name(trace_category category) {
+    switch (category) {
+    case trace_kernel: return "kernel";
+    case trace_copy: return "copy";
+    case trace_memset: return "memset";
+    case trace_alloc: return "alloc";
+    case trace_free: return "free";
+    case trace_graph: return "graph";
+    case trace_region: return "region";
+    }
+    return "unknown";
+}
+
+void write_json_string(std::FILE *f, std::string_view str) {
+    std::fputc('"', f);
+    for (char c : str) {
+        if (c == '"' || c == '\\') {
+            std::fputc('\\', f);
+            std::fputc(c, f);
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            std::fprintf(f, "\\u%04x", c);
+        } else {
+            std::fputc(c, f);
+        }
+    }
+    std::fputc('"', f);
+}
+
+void write_dims(std::FILE *f, const char *key, const int *dims) {
+    std::fprintf(f, ",\"%s\":[%d", key, dims[0]);
+    for (int i = 1; i < 3 && dims[i] > 0; i++) {
+        std::fprintf(f, ",%d", dims[i]);
+    }
+    std::fputc(']', f);
+}
+
+} // namespace
+
+double xpu::detail::trace_now_us() {
+    std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - trace_registry::instance().start;
+    return elapsed.count();
+}
+
+void xpu::detail::trace_record(trace_event &&ev) {
+    thread_events &t = trace_registry::instance().this_thread();
+    std::lock_guard<std::mutex> lock{t.mutex};
+    t.append(std::move(ev));
+}
+
+void xpu::detail::trace_thread_name(std::string name) {
+    thread_events &t = trace_registry::instance().this_thread();
+    std::lock_guard<std::mutex> lock{t.mutex};
+    t.name = std::move(name);
+}
+
+void xpu::detail::write_trace(const std::string &file) {
+    std::FILE *f = std::fopen(file.c_str(), "w");
+    if (f == nullptr) {
+        throw std::runtime_error(format("xpu::write_trace: can't open '%s'", file.c_str()));
+    }
+
+    trace_registry &reg = trace_registry::instance();
+    {
+        std::lock_guard<std::mutex> lock{reg.device_mutex};
+        while (!reg.device_commands.empty()) {
+            reg.resolve_oldest();
+        }
+    }
+
+    std::vector<std::shared_ptr<thread_events>> threads;
+    {
+        std::lock_guard<std::mutex> lock{reg.mutex};
+        threads = reg.threads;
+    }
+
+    // Queues are numbered in the order they first appear.
+    std::unordered_map<const void *, int> queue_ids;
+
+    std::fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n", f);
+    bool first = true;
+    for (const auto &t : threads) {
+        std::lock_guard<std::mutex> lock{t->mutex};
+
+        std::fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%d,\"args\":{\"name\":", (first ? "" : ",\n"), t->tid);
+        write_json_string(f, t->name);
+        if (t->dropped > 0) {
+            std::fprintf(f, ",\"dropped_events\":%zu", t->dropped);
+            XPU_LOG("Trace of '%s' is missing its %zu oldest events, increase settings::trace_max_events to keep them.", t->name.c_str(), t->dropped);
+        }
+        std::fputs("}}", f);
+        first = false;
+
+        t->for_each([&](const trace_event &ev) {
+            std::fputs(",\n{\"name\":", f);
+            write_json_string(f, ev.name);
+            std::fprintf(f, ",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":0,\"tid\":%d,\"args\":{\"device\":%d",
+                category_name(ev.category), ev.begin_us, ev.end_us - ev.begin_us, t->tid, ev.device);
+            if (ev.queue != nullptr) {
+                auto it = queue_ids.emplace(ev.queue, static_cast<int>(queue_ids.size())).first;
+                std::fprintf(f, ",\"queue\":%d", it->second);
+            }
+            if (ev.blocks[0] > 0) {
+                write_dims(f, "blocks", ev.blocks);
+            }
+            if (ev.threads[0] > 0) {
+                write_dims(f, "threads", ev.threads);
+            }
+            if (ev.bytes > 0) {
+                std::fprintf(f, ",\"bytes\":%zu", ev.bytes);
+            }
+            std::fputs("}}", f);
+        });
+    }
+    std::fputs("\n]}\n", f);
+
+    if (std::fclose(f) != 0) {
+        throw std::runtime_error(format("xpu::write_trace: failed to write '%s'", file.c_str()));
+    }
+}
+
+void xpu::detail::write_trace_at_exit(std::string file) {
+    trace_registry &reg = trace_registry::instance();
+    bool registered = !reg.exit_file.empty();
+    reg.exit_file = std::move(file);
+    if (registered) {
+        return;
+    }
+    std::atexit([] {
+        try {
+            write_trace(trace_registry::instance().exit_file);
+        } catch (const std::exception &e) {
+            std::fprintf(stderr, "%s\n", e.what());
+        }
+    });
+}
+
+void trace_span::start(trace_category category, std::string_view name) {
+    m_event.emplace();
+    m_event->name = name;
+    m_event->category = category;
+    m_parent = t_current_span;
+    t_current_span = this;
+    m_event->begin_us = trace_now_us();
+}
+
+void trace_span::time_on_device(const device &dev, void *queue) {
+    if (dev.backend == cpu || queue == nullptr || m_device_start != nullptr) {
+        return;
+    }
+
+    trace_registry &reg = trace_registry::instance();
+    {
+        std::lock_guard<std::mutex> lock{reg.device_mutex};
+        if (reg.clock_of(dev) == nullptr) {
+            return;
+        }
+    }
+
+    backend_base *b = backend::get(dev.backend);
+    void *start = nullptr;
+    if (b->create_event(&start, dev.device_nr) != 0) {
+        return;
+    }
+    if (b->record_event(start, queue) != 0) {
+        b->destroy_event(start);
+        return;
+    }
+    m_device = dev;
+    m_queue = queue;
+    m_device_start = start;
+}
+
+void trace_span::finish() {
+    m_event->end_us = trace_now_us();
+    t_current_span = m_parent;
+
+    if (m_device_start != nullptr) {
+        backend_base *b = backend::get(m_device.backend);
+        void *end = nullptr;
+        if (b->create_event(&end, m_device.device_nr) == 0 && b->record_event(end, m_queue) == 0) {
+            trace_registry &reg = trace_registry::instance();
+            std::lock_guard<std::mutex> lock{reg.device_mutex};
+            reg.device_commands.push_back(device_command{*m_event, m_device, m_device_start, end});
+            if (reg.device_commands.size() > trace_registry::max_pending_commands) {
+                reg.resolve_oldest();
+            }
+        } else {
+            if (end != nullptr) {
+                b->destroy_event(end);
+            }
+            b->destroy_event(m_device_start);
+        }
+    }
+
+    trace_record(std::move(*m_event));
+}
+
+const trace_event *trace_span::current() {
+    return t_current_span == nullptr ? nullptr : &*t_current_span->m_event;
+}
@@ -0,0 +1,98 @@
+#ifndef XPU_DETAIL_TRACE_H
+#define XPU_DETAIL_TRACE_H
+
+#include "common.h"
+#include "config.h"
+
+#include <cstddef>
+#include <optional>
+#include <string>
+#include <string_view>
+
+namespace xpu::detail {
+
+enum trace_category {
+    trace_kernel,
+    trace_copy,
+    trace_memset,
+    trace_alloc,
+    trace_free,
+    trace_graph,
+    trace_region,
+};
+
+struct trace_event {
+    std::string name;
+    trace_category category = trace_region;
+    double begin_us = 0;
+    double end_us = 0;
+    int device = -1; // Linear device id, -1 if unknown
+    const void *queue = nullptr; // Native queue handle, nullptr for synchronous calls
+    int blocks[3] = {-1, -1, -1}; // Requested grid of kernel launches
+    int threads[3] = {-1, -1, -1};
+    size_t bytes = 0;
+};
+
+// Microseconds since the process started.
+double trace_now_us();
+
+void trace_record(trace_event &&);
+
+// Name shown for the calling thread in the trace.
+void trace_thread_name(std::string name);
+
+// Write all events recorded so far as Chrome Trace Event JSON (readable by chrome://tracing and Perfetto).
+void write_trace(const std::string &file);
+
+// Write the trace to 'file' when the program exits.
+void write_trace_at_exit(std::string file);
+
+/**
+ * Records its lifetime as one event on the calling thread. Does nothing unless tracing is enabled.
+ * The innermost span of a thread is passed along with commands submitted to a CPU queue,
+ * so the executor records the same event again for the time the command actually ran.
+ * Commands on GPU queues are timed with device events instead, see time_on_device.
+ */
+class trace_span {
+
+public:
+    // Names of kernels are set later through event(), so the name isn't looked up unless tracing is enabled.
+    explicit trace_span(trace_category category, std::string_view name = {}) {
+        if (config::trace) {
+            start(category, name);
+        }
+    }
+    ~trace_span() {
+        if (active()) {
+            finish();
+        }
+    }
+
+    trace_span(const trace_span &) = delete;
+    trace_span &operator=(const trace_span &) = delete;
+
+    bool active() const { return m_event.has_value(); }
+    trace_event &event() { return *m_event; }
+
+    // Also record when the command runs on a GPU queue, using device events around it.
+    // The device times are resolved when the trace is written. CPU queues record their commands on the executor instead.
+    void time_on_device(const device &dev, void *queue);
+
+    // Event of the innermost span on the calling thread, nullptr if there is none.
+    static const trace_event *current();
+
+private:
+    trace_span *m_parent = nullptr;
+    std::optional<trace_event> m_event; // Only constructed while tracing, keeps disabled spans cheap
+
+    device m_device{};
+    void *m_queue = nullptr;
+    void *m_device_start = nullptr; // Event recorded before the command, nullptr if not timed on the device
+
+    void start(trace_category, std::string_view);
+    void finish();
+};
+
+} // namespace xpu::detail
+
+#endif
@@ -15,6 +15,7 @@
 #include "common.h"
 
 #include "detail/common.h"
+#include "detail/merge_path.h"
 #include "detail/type_info.h"
 
 #if XPU_IS_CPU
@@ -48,6 +49,32 @@ struct block_size {
     static inline constexpr xpu::dim value{X, Y, Z};
 };
 
+/**
+ * Opt-in CPU execution mode for kernels.
+ * If Width > 1, the CPU backend runs the threads of a block in batches of
+ * 'Width' consecutive threads from a plain loop, which the compiler can vectorize.
+ * Kernels using this mode must not call xpu::barrier (or block-level primitives
+ * that rely on it), and threads must not depend on each other.
+ * Has no effect on GPU backends.
+ *
+ * By default the compiler only vectorizes the lanes if it can prove that their
+ * memory accesses don't overlap, which often fails for pointer arguments.
+ * Set 'Independent' to true to assert that no thread reads memory written
+ * by another thread of the same block. Vectorization then skips that check;
+ * kernels that break the assertion compute wrong results.
+ *
+ * The CPU backend can only vectorize kernels it can inline. Compile the image
+ * library with '-fno-semantic-interposition' (or hidden visibility) for this.
+ *
+ * Example: `using cpu_simd_width = xpu::cpu_simd_width<8>;`
+ */
+template<int Width, bool Independent = false>
+struct cpu_simd_width {
+    static_assert(Width > 0, "cpu_simd_width must be positive");
+    static inline constexpr int value = Width;
+    static inline constexpr bool independent = Independent;
+};
+
 struct no_smem {};
 
 class tpos {
@@ -69,6 +96,12 @@ public:
     XPU_D int grid_dim_y() const { return m_impl.grid_dim_y(); }
     XPU_D int grid_dim_z() const { return m_impl.grid_dim_z(); }
 
+    /**
+     * Index of the kernel instance, when launched with queue::launch_batch.
+     * Zero for regular launches.
+     */
+    XPU_D int instance_idx() const { return m_impl.instance_idx(); }
+
 private:
     detail::tpos_impl m_impl;
 
@@ -104,6 +137,7 @@ struct kernel : detail::action<Image, detail::kernel_tag> {
     using block_size = xpu::block_size<64>;
     using constants = cmem<>;
     using shared_memory = no_smem;
+    using cpu_simd_width = xpu::cpu_simd_width<1>;
 };
 
 template<typename Image>
@@ -208,6 +242,12 @@ public:
      */
     XPU_D int grid_dim_z() const { return m_pos.grid_dim_z(); }
 
+    /**
+     * Shortcut to access the instance index of a batched launch.
+     * Identical to pos().instance_idx().
+     */
+    XPU_D int instance_idx() const { return m_pos.instance_idx(); }
+
     XPU_D       tpos &pos()       { return m_pos; }
     XPU_D const tpos &pos() const { return m_pos; }
 
@@ -502,6 +542,102 @@ XPU_D float int_as_float(int val);
 
 XPU_D void barrier(tpos &);
 
+/**
+ * Memory fence for the whole device.
+ * Writes issued before the fence become visible to other threads before writes issued after it.
+ */
+XPU_D void thread_fence();
+
+/**
+ * @brief Lock-free FIFO of work items that kernels can push to and pop from.
+ * Handle to storage owned by xpu::work_queue_storage on the host.
+ * The queue is not a ring buffer: it holds at most 'capacity' pushes in total between resets.
+ *
+ * Every popped item must be marked finished with done(), after all items derived from it were pushed.
+ * pop() returns false only once the queue is empty and no popped item is still unfinished,
+ * so persistent kernels (see xpu::persistent_blocks) can run until all work has drained:
+ *
+ *   T item;
+ *   while (q.pop(item)) {
+ *       ... // process, may push new items
+ *       q.done();
+ *   }
+ *
+ * Threads waiting in pop() spin, so kernels must not call xpu::barrier while they hold items.
+ */
+template<typename T>
+class work_queue {
+
+public:
+    work_queue() = default;
+
+    /**
+     * Add an item. Returns false if the queue is full, the item is dropped in that case.
+     */
+    XPU_D bool push(const T &item) {
+        // Count the item as unfinished first. Otherwise consumers could briefly see an empty queue without pending work and stop.
+        atomic_add(&m_state[detail::wq_pending], 1u);
+        unsigned int i = atomic_add(&m_state[detail::wq_tail], 1u);
+        if (i >= m_capacity) {
+            atomic_or(&m_state[detail::wq_overflow], 1u);
+            atomic_sub(&m_state[detail::wq_pending], 1u);
+            return false;
+        }
+        m_items[i] = item;
+        thread_fence();
+        atomic_or(&m_ready[i], 1u);
+        return true;
+    }
+
+    /**
+     * Take the next item. Waits while the queue is empty but other threads still process items.
+     * Returns false once all work is done.
+     */
+    XPU_D bool pop(T &item) {
+        for (;;) {
+            unsigned int head = atomic_add(&m_state[detail::wq_head], 0u);
+            unsigned int tail = atomic_add(&m_state[detail::wq_tail], 0u);
+            tail = (tail < m_capacity ? tail : m_capacity);
+
+            if (head < tail) {
+                if (atomic_cas(&m_state[detail::wq_head], head, head + 1) != head) {
+                    continue;
+                }
+                // Slot is claimed, but the producer might still be writing it.
+                while (atomic_add(&m_ready[head], 0u) == 0) {}
+                thread_fence();
+                item = m_items[head];
+                return true;
+            }
+
+            if (atomic_add(&m_state[detail::wq_pending], 0u) == 0) {
+                return false;
+            }
+        }
+    }
+
+    /**
+     * Mark the last popped item as finished.
+     */
+    XPU_D void done() { atomic_sub(&m_state[detail::wq_pending], 1u); }
+
+    XPU_D unsigned int capacity() const { return m_capacity; }
+
+private:
+    T *m_items = nullptr;
+    unsigned int *m_state = nullptr;
+    unsigned int *m_ready = nullptr;
+    unsigned int m_capacity = 0;
+
+public:
+    XPU_D work_queue(detail::internal_ctor_t, T *items, unsigned int *control, unsigned int capacity)
+        : m_items(items)
+        , m_state(control)
+        , m_ready(control + detail::wq_num_counters)
+        , m_capacity(capacity) {}
+
+};
+
 
 template<typename T, int BlockSize, xpu::driver_t Impl=XPU_COMPILATION_TARGET>
 class block_scan {
@@ -547,6 +683,46 @@ public:
 
 };
 
+/**
+ * Kernel that merges the sorted arrays a and b into dst, using the whole grid.
+ * The output is split evenly across all blocks. Every block finds its input ranges
+ * with a merge path search and merges them with block_merge.
+ * Items that compare equal keep their order and items from a go before items from b.
+ *
+ * Compare must be default constructible and callable on the device.
+ * Export the kernel through an alias (not a derived struct) and launch it with xpu::device_merge:
+ * ```
+ * using merge_floats = xpu::merge_kernel<MyImage, float, float_less>;
+ * XPU_EXPORT(merge_floats);
+ * ...
+ * xpu::device_merge<merge_floats>(a, b, dst);
+ * ```
+ */
+template<typename Image, typename Key, typename Compare, int BlockSize = 64, int ItemsPerThread = 8>
+struct merge_kernel : kernel<Image> {
+    using data_t = Key;
+    using block_size = xpu::block_size<BlockSize>;
+    using merge_t = block_merge<Key, BlockSize, ItemsPerThread>;
+    using shared_memory = typename merge_t::storage_t;
+    using context = kernel_context<shared_memory>;
+
+    // Output items per block, when launched by xpu::device_merge on a GPU.
+    static constexpr size_t items_per_block = size_t{BlockSize} * ItemsPerThread;
+
+    XPU_D void operator()(context &ctx, const Key *a, size_t size_a, const Key *b, size_t size_b, Key *dst) {
+        Compare comp{};
+        size_t n = size_a + size_b;
+        size_t nblocks = ctx.pos().grid_dim_x();
+        size_t block = ctx.pos().block_idx_x();
+        size_t diag = n * block / nblocks;
+        size_t diag_next = n * (block + 1) / nblocks;
+
+        size_t mp = detail::merge_path<detail::merge_path_lower>(a, size_a, b, size_b, diag, comp);
+        size_t mp_next = detail::merge_path<detail::merge_path_lower>(a, size_a, b, size_b, diag_next, comp);
+        merge_t(ctx.pos(), ctx.smem()).merge(a + mp, mp_next - mp, b + (diag - mp), (diag_next - mp_next) - (diag - mp), dst + diag, comp);
+    }
+};
+
 } // namespace xpu
 
 #include "detail/dynamic_loader.h"
@@ -81,6 +81,8 @@ struct settings {
     /**
      * @brief Set a custom logging sink.
      * By default messages are written to stderr. Has no effect if 'verbose' is false.
+     * Messages are prefixed with the time since initialization and an id of the calling thread.
+     * With 'async_logging', the sink is called from a background thread.
      */
     std::function<void(std::string_view)> logging_sink = [](std::string_view msg) {
         // Use c functions for output to avoid including iostream in host.h ...
@@ -88,12 +90,93 @@ struct settings {
         std::fputc('\n', stderr);
     };
 
+    /**
+     * @brief Pass messages to the logging sink from a background thread.
+     * Messages are queued instead, so logging barely slows down the calling thread.
+     * If too many messages are queued, new ones are dropped and the number of dropped messages is logged.
+     * Disable to see every message before a crash.
+     * Value may be overwritten by setting environment variable XPU_ASYNC_LOGGING.
+     */
+    bool async_logging = true;
+
     /**
      * @brief Enable profiling of kernels.
      * Value may be overwritten by setting environment variable XPU_PROFILE.
      * @see xpu::timings
      */
     bool profile = false;
+
+    /**
+     * @brief Keep the time of every kernel launch when profiling.
+     * By default only a histogram of fixed size is kept per kernel, see xpu::kernel_timings.
+     * Memory use grows with each launch otherwise, so leave this disabled for long running programs.
+     * Value may be overwritten by setting environment variable XPU_PROFILE_SAMPLES.
+     */
+    bool profile_samples = false;
+
+    /**
+     * @brief Count hardware events (cycles, instructions, cache and branch misses) of kernels on the CPU.
+     * Requires profiling. Counters are read with perf_event_open on every thread running the kernel.
+     * Ignored if hardware counters are not available, e.g. in most virtual machines.
+     * Value may be overwritten by setting environment variable XPU_PERF_COUNTERS.
+     * @see xpu::kernel_timings::has_counters
+     */
+    bool perf_counters = false;
+
+    /**
+     * @brief Record a timeline of kernel launches, copies, memsets, allocations and timer regions.
+     * Write it with xpu::write_trace.
+     * Setting environment variable XPU_TRACE=<file> enables tracing and writes the trace to <file> at exit.
+     */
+    bool trace = false;
+
+    /**
+     * @brief Maximum number of trace events kept per thread (and per GPU queue).
+     * Once reached, the oldest events are overwritten. The trace reports how many were dropped.
+     * If 0, the number of events is not limited.
+     * Value may be overwritten by setting environment variable XPU_TRACE_MAX_EVENTS.
+     */
+    size_t trace_max_events = 1 << 20;
+
+    /**
+     * @brief Number of threads used to run kernels on the CPU.
+     * If 0, the number of hardware threads is used.
+     * Value may be overwritten by setting environment variable XPU_CPU_THREADS.
+     */
+    int cpu_threads = 0;
+
+    /**
+     * @brief Number of blocks a CPU thread processes at once.
+     * Idle threads steal work from busy threads in units of this size.
+     * If 0, the chunk size is picked based on the grid size and number of threads.
+     * Value may be overwritten by setting environment variable XPU_CPU_CHUNK_SIZE.
+     */
+    size_t cpu_chunk_size = 0;
+
+    /**
+     * @brief Cache freed memory and reuse it for later allocations.
+     * Avoids the cost of calling the driver (e.g. cudaMalloc / cudaFree) when
+     * buffers of similar size are allocated and freed repeatedly.
+     * Cached allocations are rounded up by at most 25%.
+     * Value may be overwritten by setting environment variable XPU_MEMORY_CACHE.
+     * @see xpu::trim_memory_cache
+     */
+    bool memory_cache = true;
+
+    /**
+     * @brief Maximum number of bytes kept in the memory cache per device.
+     * If 0, the cache size is not limited.
+     * Value may be overwritten by setting environment variable XPU_MEMORY_CACHE_LIMIT.
+     */
+    size_t memory_cache_limit = 0;
+
+    /**
+     * @brief Instruction set used by the batch math functions in xpu::math.
+     * Possible values are `auto`, `generic`, `avx2` and `avx512`.
+     * `auto` picks the widest instruction set supported by the CPU.
+     * Value may be overwritten by setting environment variable XPU_CPU_MATH_ISA.
+     */
+    std::string cpu_math_isa = "auto";
 };
 
 /**
@@ -163,10 +246,51 @@ T *malloc_shared(size_t);
 
 /**
  * @brief Free memory allocated with malloc_device, malloc_host or malloc_shared.
+ * On the CPU, waits until all commands already submitted to queues have finished,
+ * as they may still use the memory.
  * @param ptr Pointer to the memory to free.
  */
 inline void free(void *);
 
+/**
+ * @brief Statistics of the memory cache.
+ * @see xpu::get_memory_cache_stats
+ */
+struct memory_cache_stats {
+    /**
+     * @brief Number of allocations served from the cache.
+     */
+    size_t hits = 0;
+
+    /**
+     * @brief Number of allocations that required a call to the driver.
+     */
+    size_t misses = 0;
+
+    /**
+     * @brief Bytes of freed memory currently held by the cache.
+     */
+    size_t cached_bytes = 0;
+
+    /**
+     * @brief Bytes currently allocated through the cache.
+     * Includes padding, as allocations are rounded up to the next power of two.
+     */
+    size_t live_bytes = 0;
+};
+
+/**
+ * @brief Return all memory held by the memory cache to the drivers.
+ * Memory that is still in use is not affected.
+ * @see xpu::settings::memory_cache
+ */
+inline void trim_memory_cache();
+
+/**
+ * @brief Get statistics about the memory cache.
+ */
+inline memory_cache_stats get_memory_cache_stats();
+
 inline void memcpy(void *, const void *, size_t);
 inline void memset(void *, int, size_t);
 
@@ -181,6 +305,62 @@ void stack_alloc(size_t size);
  */
 void stack_pop(void *head=nullptr);
 
+/**
+ * @brief Stack memory on the active device that is independent of the stack allocated with xpu::stack_alloc.
+ * Threads may each use their own arena to allocate buf_stack buffers without interfering with each other.
+ * Pushing to and popping from an arena are O(1).
+ *
+ * Example:
+ * ```
+ * xpu::stack_arena arena{1 << 20};
+ * {
+ *     xpu::stack_arena::scope s{arena}; // buf_stack buffers of this thread are now taken from 'arena'
+ *     xpu::buffer<float> tmp{n, xpu::buf_stack};
+ *     ...
+ * }
+ * arena.pop();
+ * ```
+ */
+class stack_arena {
+
+public:
+    /**
+     * @brief Select the arena used for buf_stack allocations of the calling thread.
+     * The previous arena is restored when the scope ends.
+     * xpu::stack_pop also operates on the selected arena.
+     */
+    class scope {
+
+    public:
+        explicit scope(stack_arena &);
+        ~scope();
+
+        scope(const scope &) = delete;
+        scope &operator=(const scope &) = delete;
+
+    private:
+        detail::stack_entry *m_prev;
+    };
+
+    /**
+     * @brief Allocate an arena of 'size' bytes on the active device.
+     */
+    explicit stack_arena(size_t size);
+    ~stack_arena();
+
+    stack_arena(const stack_arena &) = delete;
+    stack_arena &operator=(const stack_arena &) = delete;
+
+    /**
+     * @brief Pop entries from the arena.
+     * @param head Pointer to the stack entry to pop or nullptr to pop the entire arena.
+     */
+    void pop(void *head = nullptr);
+
+private:
+    detail::stack_entry *m_stack;
+};
+
 /**
  * Represents a device found on the system.
  */
@@ -335,6 +515,43 @@ private:
     detail::device_prop m_prop;
 };
 
+/**
+ * @brief Marker in the command stream of a queue.
+ * Created by calling queue::record(). An event completes once all commands
+ * submitted to its queue before it have finished.
+ */
+class event {
+
+public:
+    /**
+     * Block until all commands recorded before this event have finished.
+     */
+    void synchronize();
+
+    /**
+     * @returns Time in milliseconds between this event and the event 'end'.
+     * Blocks until both events have completed.
+     * @note On the SYCL backend, this requires profiling to be enabled (XPU_PROFILE=1).
+     */
+    double elapsed_ms(const event &end);
+
+private:
+    friend class queue;
+
+    std::shared_ptr<detail::event_handle> m_handle;
+
+    explicit event(std::shared_ptr<detail::event_handle> handle) : m_handle(std::move(handle)) {}
+};
+
+class graph;
+
+/**
+ * Arguments of a kernel without the context, as a tuple of values.
+ * Used to pass the arguments of each instance to queue::launch_batch.
+ */
+template<typename Kernel>
+using kernel_args = detail::kernel_args_t<Kernel>;
+
 /**
  * @brief command queue for a device.
  */
@@ -364,15 +581,138 @@ public:
     template<typename Kernel, typename... Args>
     void launch(grid params, Args&&... args);
 
+    /**
+     * Run 'n' independent instances of a kernel.
+     * Instance i runs with grid params[i] and arguments args[i]. Kernels can query
+     * their instance with kernel_context::instance_idx(). Instances may run concurrently.
+     * On the CPU, all blocks of all instances are run as a single parallel region, so the
+     * launch overhead is paid once per batch instead of once per instance.
+     * @note On CUDA, HIP and SYCL this is only a convenience loop: each instance is a separate
+     *   kernel launch on this queue, exactly as if launch was called 'n' times. It's not faster.
+     * Both arrays are copied, so they can be reused once the call returns.
+     */
+    template<typename Kernel>
+    void launch_batch(const grid *params, const kernel_args<Kernel> *args, size_t n);
+
+    template<typename Kernel>
+    void launch_batch(const std::vector<grid> &params, const std::vector<kernel_args<Kernel>> &args);
+
     void wait();
 
+    /**
+     * Record an event in the queue.
+     * The event completes once all commands submitted before it have finished.
+     */
+    event record();
+
+    /**
+     * Make all commands submitted after this call wait until event 'ev' has completed.
+     * Does not block the calling thread. The event may come from a different queue.
+     */
+    void wait_for(const event &ev);
+
+    /**
+     * Start recording commands into a graph.
+     * Until end_capture is called, copy, memset and launch only record the command
+     * and nothing is executed. Calling wait, record or wait_for while capturing throws.
+     */
+    void begin_capture();
+
+    /**
+     * Stop recording and return the graph of all commands issued since begin_capture.
+     */
+    graph end_capture();
+
+    bool is_capturing() const { return m_handle->capture != nullptr; }
+
 private:
+    friend class graph;
+
     std::shared_ptr<detail::queue_handle> m_handle;
 
+    void throw_if_capturing(const char *func) const;
+
     void do_copy(const void *from, void *to, size_t size, double *ms);
     void log_copy(const void *from, const void *to, size_t size);
 };
 
+/**
+ * @brief Sequence of queue commands, recorded with queue::begin_capture and queue::end_capture.
+ * Replaying a graph skips the checks, logging, profiling and entry point lookups of the
+ * individual calls. On CUDA and HIP it's launched as a native graph. On the CPU all commands
+ * are submitted to the queue at once. Launches of a graph are not profiled.
+ */
+class graph {
+
+public:
+    /**
+     * Construct an empty graph.
+     */
+    graph() = default;
+
+    /**
+     * Replay all recorded commands on queue 'q' in the order they were recorded.
+     * The queue must belong to the device the graph was captured on.
+     */
+    void launch(queue &q);
+
+    /**
+     * Replace grid and arguments of a recorded kernel launch.
+     * Nodes are numbered in the order the commands were recorded, starting at 0.
+     * Throws if node 'node' isn't a launch of 'Kernel'. Launches already submitted are not affected.
+     */
+    template<typename Kernel, typename... Args>
+    void update(size_t node, grid params, Args&&... args);
+
+    /**
+     * Number of recorded commands.
+     */
+    size_t size() const;
+
+private:
+    friend class queue;
+
+    std::shared_ptr<detail::graph_impl> m_impl;
+
+    explicit graph(std::shared_ptr<detail::graph_impl> impl) : m_impl(std::move(impl)) {}
+};
+
+template<typename T>
+class work_queue;
+
+/**
+ * @brief Owns the memory of an xpu::work_queue.
+ * Kernels take the queue returned by get().
+ */
+template<typename T>
+class work_queue_storage {
+
+public:
+    /**
+     * Allocate device memory for up to 'capacity' pushes. The queue starts out empty.
+     */
+    explicit work_queue_storage(size_t capacity);
+
+    /**
+     * Remove all items. Must not be called while kernels use the queue.
+     */
+    void reset();
+
+    /**
+     * True if a push failed since the last reset, because the queue was full.
+     */
+    bool overflowed() const;
+
+    work_queue<T> get() const;
+
+    size_t capacity() const { return m_capacity; }
+
+private:
+    buffer<T> m_items;
+    buffer<unsigned int> m_control;
+    size_t m_capacity;
+};
+
 template<typename Kernel>
 const char *get_name();
 
@@ -413,6 +753,12 @@ public:
      */
     explicit h_view(buffer<T> &);
 
+    /**
+     * @brief Create a view of const elements from a view of mutable elements.
+     */
+    template<typename U, typename = std::enable_if_t<std::is_same_v<const U, T>>>
+    h_view(const h_view<U> &other) : m_data(other.data()), m_size(other.size()) {}
+
     /**
      * @returns Pointer to the underlying data.
      */
@@ -478,6 +824,55 @@ public:
     h_view(T *data, size_t size) : m_data(data), m_size(size) {}
 };
 
+/**
+ * @brief Process a stream of input chunks on the device, overlapping transfers with compute.
+ * Keeps up to 'depth' chunks in flight, each on its own queue with its own buf_io buffers.
+ * While chunk k is computed, chunk k+1 is uploaded and chunk k-1 downloaded.
+ * Throughput then approaches the slowest of the three stages, instead of their sum.
+ * @note With profiling enabled, every copy and kernel launch waits until it's finished,
+ *   so the stages run one after another and nothing overlaps. Use xpu::scoped_profiling_pause
+ *   around xpu::stream_pipeline::run to keep them overlapping.
+ */
+template<typename In, typename Out>
+class stream_pipeline {
+
+public:
+    /**
+     * Allocate buffers for 'depth' chunks on the active device.
+     * @param in_chunk_size Maximum number of input elements per chunk.
+     * @param out_chunk_size Number of output elements per chunk.
+     * @param depth Number of chunks in flight. With 3, uploads, kernels and downloads can all overlap.
+     */
+    stream_pipeline(size_t in_chunk_size, size_t out_chunk_size, size_t depth = 3);
+
+    /**
+     * Run until the source is exhausted. All callbacks are invoked on the calling thread.
+     * - source(h_view<In> in) -> size_t:
+     *     Fill the next input chunk and return the number of elements written. Return 0 to stop.
+     * - compute(queue &q, buffer<In> in, buffer<Out> out, size_t n):
+     *     Issue the kernels for a chunk with n input elements on q. Must not wait for q.
+     * - sink(h_view<const Out> out, size_t n):
+     *     Consume the output of a chunk with n input elements.
+     * Chunks reach the sink in the order the source produced them.
+     * @returns Number of chunks processed.
+     */
+    template<typename Source, typename Compute, typename Sink>
+    size_t run(Source &&source, Compute &&compute, Sink &&sink);
+
+    size_t depth() const { return m_slots.size(); }
+
+private:
+    struct slot {
+        queue q;
+        buffer<In> in;
+        buffer<Out> out;
+        size_t n; // Input elements of the chunk in flight, 0 if the slot is idle
+    };
+
+    std::vector<slot> m_slots;
+    size_t m_in_chunk_size;
+};
+
 /**
  * Different types of allocated memory.
  */
@@ -591,13 +986,82 @@ public:
     /**
      * Total time spent in this kernel. [ms]
      */
-    double total() const { return std::accumulate(m_t.times.begin(), m_t.times.end(), 0.0); }
+    double total() const { return m_t.hist.sum; }
+
+    /**
+     * Number of invocations of this kernel.
+     */
+    size_t count() const { return m_t.hist.count; }
+
+    /**
+     * Shortest invocation of this kernel. [ms]
+     */
+    double min() const { return m_t.hist.min; }
+
+    /**
+     * Longest invocation of this kernel. [ms]
+     */
+    double max() const { return m_t.hist.max; }
+
+    /**
+     * Average time of an invocation. [ms]
+     */
+    double mean() const { return count() == 0 ? 0 : total() / count(); }
+
+    /**
+     * Time at the given quantile, e.g. percentile(0.99) for the 99th percentile. [ms]
+     * Computed from a histogram, accurate to about 3%.
+     */
+    double percentile(double q) const { return m_t.hist.percentile(q); }
 
     /**
      * Times of each invocation of this kernel.
+     * @note Only collected if xpu::settings::profile_samples is enabled, empty otherwise.
      */
     const std::vector<double> &times() const { return m_t.times; }
 
+    /**
+     * Returns true if hardware counters were collected for this kernel.
+     * @see xpu::settings::perf_counters
+     */
+    bool has_counters() const { return m_t.counters.valid; }
+
+    /**
+     * CPU cycles spent in this kernel, summed over all threads.
+     */
+    unsigned long long cycles() const { return m_t.counters.cycles; }
+
+    /**
+     * Instructions retired in this kernel, summed over all threads.
+     */
+    unsigned long long instructions() const { return m_t.counters.instructions; }
+
+    /**
+     * Last level cache misses in this kernel.
+     */
+    unsigned long long llc_misses() const { return m_t.counters.llc_misses; }
+
+    /**
+     * Mispredicted branches in this kernel.
+     */
+    unsigned long long branch_misses() const { return m_t.counters.branch_misses; }
+
+    /**
+     * Instructions per cycle.
+     */
+    double ipc() const { return m_t.counters.cycles == 0 ? 0 : double(m_t.counters.instructions) / m_t.counters.cycles; }
+
+    /**
+     * Fraction of last level cache references that missed.
+     */
+    double llc_miss_rate() const { return m_t.counters.llc_references == 0 ? 0 : double(m_t.counters.llc_misses) / m_t.counters.llc_references; }
+
+    /**
+     * Memory bandwidth in gigabytes per second.
+     * Estimated from last level cache misses, assuming each miss loads one 64 byte cache line.
+     */
+    double memory_bandwidth() const;
+
     /**
      * Throughput of this kernel in gigabytes per second.
      * Input size in bytes is set via k_add_bytes .
@@ -666,7 +1130,7 @@ public:
      */
     double kernel_time() const {
         return std::accumulate(m_t.kernels.begin(), m_t.kernels.end(), 0.0,
-            [](double a, const auto &b) { return a + std::accumulate(b.times.begin(), b.times.end(), 0.0); });
+            [](double a, const auto &b) { return a + b.hist.sum; });
     }
 
     /**
@@ -717,6 +1181,8 @@ public:
 
 /**
  * Create a new timer.
+ * Each thread has its own stack of timers. Only operations issued by the calling thread
+ * are recorded, a timer's measurements are added to its parent when it's stopped.
  * @see xpu::pop_timer, xpu::timings
  */
 void push_timer(std::string_view name);
@@ -752,6 +1218,35 @@ private:
     xpu::timings* m_t = nullptr;
 };
 
+/**
+ * @brief Suspend profiling on the calling thread while in scope.
+ * Profiled copies and kernel launches wait until they're finished. Use this to measure code that relies
+ * on commands overlapping, e.g. xpu::stream_pipeline, while profiling is enabled.
+ * Commands issued by the calling thread in the meantime are not timed. Other threads keep profiling.
+ * Profiling is resumed on destruction, also if an exception is thrown. Pauses may be nested.
+ */
+class scoped_profiling_pause {
+
+public:
+    scoped_profiling_pause();
+    ~scoped_profiling_pause();
+
+    scoped_profiling_pause(const scoped_profiling_pause&) = delete;
+    scoped_profiling_pause& operator=(const scoped_profiling_pause&) = delete;
+    scoped_profiling_pause(scoped_profiling_pause&&) = delete;
+    scoped_profiling_pause& operator=(scoped_profiling_pause&&) = delete;
+};
+
+/**
+ * @brief Write all events recorded so far in the Chrome Trace Event format.
+ * Open the file in Perfetto (ui.perfetto.dev) or chrome://tracing.
+ * Events are shown on the host thread that issued them. Commands of queues appear a second time,
+ * on a track of their queue, for the time they actually ran on the device.
+ * Tracing must be enabled with settings::trace or XPU_TRACE, otherwise the trace is empty.
+ * Throws std::runtime_error if the file can't be written.
+ */
+inline void write_trace(std::string_view file);
+
 /**
  * Add bytes of input to the current timer. This is used to calculate the throughput.
  */
@@ -769,6 +1264,93 @@ void copy(T *dst, const T *src, size_t entries);
 template<typename T>
 void copy(buffer<T> &buf, direction dir);
 
+/**
+ * @brief Sort the first n keys of a buffer in ascending order on the active device.
+ * Keys may be 32 or 64 bit integers, float or double. The sort is stable.
+ * Floating point keys are ordered by their bit pattern: -0 comes before +0,
+ * NaNs with the sign bit set come first and all other NaNs last.
+ *
+ * On CPU a parallel radix sort runs on the xpu thread pool.
+ * Throws std::length_error, if the buffer holds less than n keys.
+ */
+template<typename Key>
+void device_sort(buffer<Key> &keys, size_t n);
+
+/**
+ * @brief Sort the first n keys of a buffer and reorder the values alongside.
+ * Same as device_sort, values may be any trivially copyable type.
+ */
+template<typename Key, typename Value>
+void sort_pairs(buffer<Key> &keys, buffer<Value> &values, size_t n);
+
+/**
+ * @brief Sort the first n items of a buffer by the key returned from get_key(const T &).
+ * Same interface as the KeyGetter of xpu::block_sort.
+ * get_key is called on the host from multiple threads, so it must be thread-safe.
+ * Items on other devices are copied to the host and back.
+ */
+template<typename T, typename KeyGetter>
+void device_sort(buffer<T> &items, size_t n, KeyGetter &&get_key);
+
+/**
+ * @brief Merge the sorted buffers a and b into dst with a merge kernel (see xpu::merge_kernel).
+ * Items that compare equal keep their order and items from a go before items from b.
+ * dst must hold at least as many items as a and b together, otherwise std::length_error is thrown.
+ *
+ * The kernel runs on the active device. GPUs get one block per Kernel::items_per_block output items.
+ * CPU blocks merge their part serially, so they get larger parts, which are balanced across the thread pool.
+ */
+template<typename Kernel, typename T>
+void device_merge(buffer<T> &a, buffer<T> &b, buffer<T> &dst);
+
+/**
+ * @brief Math functions that process arrays of floats on the host.
+ * Kernels for SSE2, AVX2 and AVX-512 are built into xpu and the widest
+ * instruction set supported by the CPU is picked at runtime (see xpu::settings::cpu_math_isa).
+ * Functions run on the calling thread and are safe to call from multiple threads.
+ * Input and output may point to the same memory.
+ *
+ * Maximum error compared to the correctly rounded result:
+ * - exp: 1.5 ulp. Results below 2^-126 (x < -87.3) are not covered.
+ * - log: 1 ulp.
+ * - sin, cos, sincos: 2 ulp for |x| <= 8192. Larger arguments are passed to the C library.
+ * - rsqrt: 1.5 ulp (computed as 1 / sqrt(x)).
+ * - pow: 1 ulp. Computed as exp(y * log(x)) in double precision.
+ * - erf: 1 ulp.
+ *
+ * Special values (NaN, infinities, zero and negative arguments) behave as in the C library,
+ * except that rsqrt(-0) returns -inf.
+ */
+namespace math {
+
+inline void exp(const float *x, float *y, size_t n);
+inline void log(const float *x, float *y, size_t n);
+inline void sin(const float *x, float *y, size_t n);
+inline void cos(const float *x, float *y, size_t n);
+inline void sincos(const float *x, float *s, float *c, size_t n);
+inline void rsqrt(const float *x, float *y, size_t n);
+inline void erf(const float *x, float *y, size_t n);
+
+/**
+ * Computes z[i] = x[i]^y[i].
+ */
+inline void pow(const float *x, const float *y, float *z, size_t n);
+
+/**
+ * @brief Overloads that operate on views.
+ * Process all elements of x. Throws std::length_error, if an output view is smaller than x.
+ */
+inline void exp(h_view<const float> x, h_view<float> y);
+inline void log(h_view<const float> x, h_view<float> y);
+inline void sin(h_view<const float> x, h_view<float> y);
+inline void cos(h_view<const float> x, h_view<float> y);
+inline void sincos(h_view<const float> x, h_view<float> s, h_view<float> c);
+inline void rsqrt(h_view<const float> x, h_view<float> y);
+inline void erf(h_view<const float> x, h_view<float> y);
+inline void pow(h_view<const float> x, h_view<const float> y, h_view<float> z);
+
+} // namespace math
+
 } // namespace xpu
 
 #include "impl/host.tpp"
@@ -7,10 +7,18 @@ inline xpu::grid xpu::n_blocks(dim blocks) { return grid{blocks, dim{-1}}; }
 
 inline xpu::grid xpu::n_threads(dim threads) { return grid{dim{-1}, threads}; }
 
+inline xpu::grid xpu::persistent_blocks() {
+    grid g{dim{1}, dim{-1}};
+    g.m_persistent = true;
+    return g;
+}
+
 inline xpu::grid::grid(dim b, dim t) : nblocks(b), nthreads(t) {}
 
-inline void xpu::grid::get_compute_grid(dim &block_dim, dim &grid_dim) const {
-    if (nblocks.x == -1) {
+inline void xpu::grid::get_compute_grid(dim &block_dim, dim &grid_dim, int resident_blocks) const {
+    if (m_persistent) {
+        grid_dim = dim{std::max(resident_blocks, 1), 1, 1};
+    } else if (nblocks.x == -1) {
         grid_dim.x = (nthreads.x + block_dim.x - 1) / block_dim.x;
         grid_dim.y = (nthreads.y > -1 ? (nthreads.y + block_dim.y - 1) / block_dim.y : 1);
         grid_dim.z = (nthreads.z > -1 ? (nthreads.z + block_dim.z - 1) / block_dim.z : 1);
@@ -30,6 +38,12 @@ xpu::buffer<T>::buffer(size_t N, xpu::buffer_type type, T *data) {
     m_data = static_cast<T *>(registry.create(N * sizeof(T), static_cast<detail::buffer_type>(type), data));
 }
 
+template<typename T>
+xpu::buffer<T>::buffer(const char *path, size_t offset, size_t N, xpu::mmap_mode mode) {
+    auto &registry = detail::buffer_registry::instance();
+    m_data = static_cast<T *>(registry.create_mmap(path, offset, N * sizeof(T), mode == mmap_copy_on_write));
+}
+
 template<typename T>
 XPU_H XPU_D xpu::buffer<T>::buffer(const xpu::buffer<T> &other) {
     m_data = other.m_data;
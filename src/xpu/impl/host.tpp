@@ -2,11 +2,15 @@
 
 #include "../detail/exceptions.h"
 #include "../detail/runtime.h"
+#include "../detail/platform/cpu/vector_math.h"
 #include "../detail/timers.h"
+#include "../detail/trace.h"
 #include "../detail/type_info.h"
 
 #include "queue.tpp"
 
+#include <limits>
+
 void xpu::initialize(settings settings) {
     detail::runtime::instance().initialize(settings);
 }
@@ -18,7 +22,7 @@ inline void xpu::preload() {
 }
 
 inline void *xpu::malloc_host(size_t bytes) {
-    return detail::runtime::instance().malloc_host(bytes);
+    return detail::runtime::instance().malloc_host(bytes, detail::runtime::instance().active_device());
 }
 
 template<typename T>
@@ -27,7 +31,7 @@ T *xpu::malloc_host(size_t count) {
 }
 
 inline void *xpu::malloc_device(size_t bytes) {
-    return detail::runtime::instance().malloc_device(bytes);
+    return detail::runtime::instance().malloc_device(bytes, detail::runtime::instance().active_device());
 }
 
 template<typename T>
@@ -36,7 +40,7 @@ T *xpu::malloc_device(size_t count) {
 }
 
 inline void *xpu::malloc_shared(size_t bytes) {
-    return detail::runtime::instance().malloc_shared(bytes);
+    return detail::runtime::instance().malloc_shared(bytes, detail::runtime::instance().active_device());
 }
 
 template<typename T>
@@ -48,6 +52,16 @@ void xpu::free(void *ptr) {
     detail::runtime::instance().free(ptr);
 }
 
+void xpu::trim_memory_cache() {
+    detail::runtime::instance().trim_memory_cache();
+}
+
+xpu::memory_cache_stats xpu::get_memory_cache_stats() {
+    memory_cache_stats stats;
+    detail::runtime::instance().get_memory_cache_stats(&stats);
+    return stats;
+}
+
 void xpu::memcpy(void *dst, const void *src, size_t bytes) {
     return detail::runtime::instance().memcpy(dst, src, bytes);
 }
@@ -70,6 +84,29 @@ inline void xpu::stack_pop(void *head) {
     );
 }
 
+inline xpu::stack_arena::stack_arena(size_t bytes) {
+    m_stack = detail::buffer_registry::instance().stack_create(
+        detail::runtime::instance().active_device(),
+        bytes
+    );
+}
+
+inline xpu::stack_arena::~stack_arena() {
+    detail::buffer_registry::instance().stack_destroy(m_stack);
+}
+
+inline void xpu::stack_arena::pop(void *head) {
+    detail::buffer_registry::instance().stack_pop(m_stack, head);
+}
+
+inline xpu::stack_arena::scope::scope(stack_arena &arena) : m_prev(detail::buffer_registry::thread_stack()) {
+    detail::buffer_registry::thread_stack() = arena.m_stack;
+}
+
+inline xpu::stack_arena::scope::~scope() {
+    detail::buffer_registry::thread_stack() = m_prev;
+}
+
 inline std::vector<xpu::device> xpu::device::all() {
     auto dev_impl = detail::runtime::instance().get_devices();
 
@@ -103,6 +140,12 @@ inline xpu::device::device(int id) {
     m_impl = detail::runtime::instance().get_device(id);
 }
 
+template<typename T>
+xpu::buffer<T>::buffer(size_t N, xpu::buffer_type type, device dev, T *data) {
+    auto &registry = detail::buffer_registry::instance();
+    m_data = static_cast<T *>(registry.create(N * sizeof(T), static_cast<detail::buffer_type>(type), data, dev.impl()));
+}
+
 inline xpu::device_prop::device_prop(xpu::device dev) {
     m_prop = detail::runtime::instance().device_properties(dev.id());
 }
@@ -115,6 +158,8 @@ const char *xpu::get_name() {
 template<typename Kernel, typename... Args>
 void xpu::run_kernel(grid params, Args&&... args) {
     detail::device dev = detail::runtime::instance().active_device();
+    detail::trace_span span{detail::trace_kernel};
+    detail::trace_launch<Kernel>(span, dev, nullptr, &params);
     detail::runtime::instance().run_kernel<Kernel>(params, dev.backend, nullptr, std::forward<Args>(args)...);
 }
 
@@ -195,13 +240,25 @@ inline xpu::scoped_timer::~scoped_timer() {
     }
 }
 
+inline xpu::scoped_profiling_pause::scoped_profiling_pause() {
+    detail::config::profile_paused++;
+}
+
+inline xpu::scoped_profiling_pause::~scoped_profiling_pause() {
+    detail::config::profile_paused--;
+}
+
+inline void xpu::write_trace(std::string_view file) {
+    detail::write_trace(std::string{file});
+}
+
 inline void xpu::t_add_bytes(size_t bytes) {
     detail::add_bytes_timer(bytes);
 }
 
 template<typename Kernel>
 inline void xpu::k_add_bytes(size_t bytes) {
-    detail::add_bytes_kernel(detail::type_name<Kernel>(), bytes);
+    detail::add_bytes_kernel(detail::linear_type_id<Kernel>::get(), detail::type_name<Kernel>(), bytes);
 }
 
 namespace xpu::detail {
@@ -214,6 +271,10 @@ inline double xpu::kernel_timings::throughput() const {
     return detail::bytes_per_ms_to_gb_per_sec(m_t.bytes_input, total());
 }
 
+inline double xpu::kernel_timings::memory_bandwidth() const {
+    return detail::bytes_per_ms_to_gb_per_sec(m_t.counters.llc_misses * 64, total());
+}
+
 inline double xpu::timings::throughput() const {
     return detail::bytes_per_ms_to_gb_per_sec(m_t.bytes_input, wall());
 }
@@ -276,14 +337,22 @@ template<typename T>
 void xpu::copy(buffer<T> &buf, direction dir) {
     detail::buffer_data entry = detail::buffer_registry::instance().get(buf.get());
 
-    if (entry.type != detail::buf_io) {
+    if (entry.type != detail::buf_io && entry.type != detail::buf_mmap) {
         throw std::runtime_error("Buffer is not an IO buffer.");
     }
 
+    if (entry.type == detail::buf_mmap && dir == d2h) {
+        throw std::runtime_error("Can't copy to a memory mapped file.");
+    }
+
     if (entry.ptr == entry.host_ptr) {
         return;
     }
 
+    if (entry.type == detail::buf_mmap) {
+        detail::buffer_registry::instance().pin_mapping(buf.get());
+    }
+
     void *dst = nullptr;
     void *src = nullptr;
 
@@ -300,3 +369,217 @@ void xpu::copy(buffer<T> &buf, direction dir) {
 
     xpu::memcpy(dst, src, entry.size);
 }
+
+template<typename Key>
+void xpu::device_sort(buffer<Key> &keys, size_t n) {
+    detail::buffer_data entry = detail::buffer_registry::instance().get(keys.get());
+    XPU_UNLIKELY_IF(entry.size / sizeof(Key) < n) detail::throw_size_mismatch("xpu::device_sort", n, entry.size / sizeof(Key));
+    detail::runtime::instance().sort_pairs(keys.get(), nullptr, n, detail::sort_key_type<Key>(), 0);
+}
+
+template<typename Key, typename Value>
+void xpu::sort_pairs(buffer<Key> &keys, buffer<Value> &values, size_t n) {
+    static_assert(std::is_trivially_copyable_v<Value>, "Values must be trivially copyable");
+    detail::buffer_data kentry = detail::buffer_registry::instance().get(keys.get());
+    detail::buffer_data ventry = detail::buffer_registry::instance().get(values.get());
+    XPU_UNLIKELY_IF(kentry.size / sizeof(Key) < n) detail::throw_size_mismatch("xpu::sort_pairs", n, kentry.size / sizeof(Key));
+    XPU_UNLIKELY_IF(ventry.size / sizeof(Value) < n) detail::throw_size_mismatch("xpu::sort_pairs", n, ventry.size / sizeof(Value));
+    detail::runtime::instance().sort_pairs(keys.get(), values.get(), n, detail::sort_key_type<Key>(), sizeof(Value));
+}
+
+template<typename T, typename KeyGetter>
+void xpu::device_sort(buffer<T> &items, size_t n, KeyGetter &&get_key) {
+    static_assert(std::is_trivially_copyable_v<T>, "Items must be trivially copyable");
+    using sort_key = std::decay_t<std::invoke_result_t<KeyGetter &, const T &>>;
+    using getter_t = std::remove_reference_t<KeyGetter>;
+
+    detail::buffer_data entry = detail::buffer_registry::instance().get(items.get());
+    XPU_UNLIKELY_IF(entry.size / sizeof(T) < n) detail::throw_size_mismatch("xpu::device_sort", n, entry.size / sizeof(T));
+
+    detail::runtime::key_getter_fn get_keys = [](void *getter, const void *items_, void *keys_, size_t begin, size_t end) {
+        getter_t &g = *static_cast<getter_t *>(getter);
+        const T *it = static_cast<const T *>(items_);
+        sort_key *keys = static_cast<sort_key *>(keys_);
+        for (size_t i = begin; i < end; i++) {
+            keys[i] = g(it[i]);
+        }
+    };
+    detail::runtime::instance().sort_items(items.get(), n, sizeof(T), detail::sort_key_type<sort_key>(), get_keys,
+        const_cast<void *>(static_cast<const void *>(std::addressof(get_key))));
+}
+
+template<typename Kernel, typename T>
+void xpu::device_merge(buffer<T> &a, buffer<T> &b, buffer<T> &dst) {
+    static_assert(std::is_same_v<typename Kernel::data_t, T>, "Kernel merges items of a different type");
+    size_t size_a = buffer_prop{a}.size();
+    size_t size_b = buffer_prop{b}.size();
+    size_t size_dst = buffer_prop{dst}.size();
+    XPU_UNLIKELY_IF(size_dst < size_a + size_b) detail::throw_size_mismatch("xpu::device_merge", size_a + size_b, size_dst);
+
+    size_t n = size_a + size_b;
+    if (n == 0) {
+        return;
+    }
+    // CPU blocks merge serially, so they get large parts
+    constexpr size_t cpu_items_per_block = size_t{1} << 16;
+    bool on_cpu = (detail::runtime::instance().active_device().backend == detail::cpu);
+    size_t items_per_block = (on_cpu ? cpu_items_per_block : Kernel::items_per_block);
+    size_t nblocks = (n + items_per_block - 1) / items_per_block;
+    run_kernel<Kernel>(n_blocks(static_cast<int>(nblocks)), a.get(), size_a, b.get(), size_b, dst.get());
+}
+
+template<typename T>
+xpu::work_queue_storage<T>::work_queue_storage(size_t capacity)
+    : m_items(capacity, buf_device)
+    , m_control(capacity + detail::wq_num_counters, buf_device)
+    , m_capacity(capacity) {
+    XPU_UNLIKELY_IF(capacity > std::numeric_limits<unsigned int>::max() - detail::wq_num_counters) {
+        throw std::length_error("xpu::work_queue_storage: capacity exceeds 32 bit range");
+    }
+    reset();
+}
+
+template<typename T>
+void xpu::work_queue_storage<T>::reset() {
+    xpu::memset(m_control.get(), 0, (m_capacity + detail::wq_num_counters) * sizeof(unsigned int));
+}
+
+template<typename T>
+bool xpu::work_queue_storage<T>::overflowed() const {
+    unsigned int overflow = 0;
+    xpu::memcpy(&overflow, m_control.get() + detail::wq_overflow, sizeof(overflow));
+    return overflow != 0;
+}
+
+template<typename T>
+xpu::work_queue<T> xpu::work_queue_storage<T>::get() const {
+    return work_queue<T>{detail::internal_ctor, m_items.get(), m_control.get(), static_cast<unsigned int>(m_capacity)};
+}
+
+template<typename In, typename Out>
+xpu::stream_pipeline<In, Out>::stream_pipeline(size_t in_chunk_size, size_t out_chunk_size, size_t depth)
+    : m_in_chunk_size(in_chunk_size) {
+    XPU_UNLIKELY_IF(depth == 0) {
+        throw std::runtime_error("xpu::stream_pipeline: depth must be at least 1");
+    }
+    for (size_t i = 0; i < depth; i++) {
+        m_slots.push_back(slot{queue{}, buffer<In>{in_chunk_size, buf_io}, buffer<Out>{out_chunk_size, buf_io}, 0});
+    }
+}
+
+template<typename In, typename Out>
+template<typename Source, typename Compute, typename Sink>
+size_t xpu::stream_pipeline<In, Out>::run(Source &&source, Compute &&compute, Sink &&sink) {
+    auto drain = [&](slot &s) {
+        if (s.n == 0) {
+            return;
+        }
+        s.q.wait();
+        h_view<Out> out{s.out};
+        sink(h_view<const Out>{out}, s.n);
+        s.n = 0;
+    };
+
+    size_t chunk = 0;
+    for (;; chunk++) {
+        // Reuse the slot of the oldest chunk. Other slots keep running meanwhile.
+        slot &s = m_slots[chunk % m_slots.size()];
+        drain(s);
+
+        h_view<In> in{s.in};
+        size_t n = source(in);
+        if (n == 0) {
+            break;
+        }
+        XPU_UNLIKELY_IF(n > m_in_chunk_size) detail::throw_size_mismatch("xpu::stream_pipeline::run", m_in_chunk_size, n);
+
+        // Only upload the filled part of the chunk.
+        buffer_prop in_prop{s.in};
+        if (in_prop.h_ptr() != in_prop.d_ptr()) {
+            s.q.copy(in_prop.h_ptr(), in_prop.d_ptr(), n * sizeof(In));
+        }
+        compute(s.q, s.in, s.out, n);
+        s.q.copy(s.out, d2h);
+        s.n = n;
+    }
+
+    // Oldest chunk still in flight comes after the current slot.
+    for (size_t i = 1; i < m_slots.size(); i++) {
+        drain(m_slots[(chunk + i) % m_slots.size()]);
+    }
+    return chunk;
+}
+
+inline void xpu::math::exp(const float *x, float *y, size_t n) {
+    detail::vmath::kernels().exp(x, y, n);
+}
+
+inline void xpu::math::log(const float *x, float *y, size_t n) {
+    detail::vmath::kernels().log(x, y, n);
+}
+
+inline void xpu::math::sin(const float *x, float *y, size_t n) {
+    detail::vmath::kernels().sin(x, y, n);
+}
+
+inline void xpu::math::cos(const float *x, float *y, size_t n) {
+    detail::vmath::kernels().cos(x, y, n);
+}
+
+inline void xpu::math::sincos(const float *x, float *s, float *c, size_t n) {
+    detail::vmath::kernels().sincos(x, s, c, n);
+}
+
+inline void xpu::math::rsqrt(const float *x, float *y, size_t n) {
+    detail::vmath::kernels().rsqrt(x, y, n);
+}
+
+inline void xpu::math::erf(const float *x, float *y, size_t n) {
+    detail::vmath::kernels().erf(x, y, n);
+}
+
+inline void xpu::math::pow(const float *x, const float *y, float *z, size_t n) {
+    detail::vmath::kernels().pow(x, y, z, n);
+}
+
+inline void xpu::math::exp(h_view<const float> x, h_view<float> y) {
+    XPU_UNLIKELY_IF(y.size() < x.size()) detail::throw_size_mismatch("xpu::math::exp", x.size(), y.size());
+    exp(x.data(), y.data(), x.size());
+}
+
+inline void xpu::math::log(h_view<const float> x, h_view<float> y) {
+    XPU_UNLIKELY_IF(y.size() < x.size()) detail::throw_size_mismatch("xpu::math::log", x.size(), y.size());
+    log(x.data(), y.data(), x.size());
+}
+
+inline void xpu::math::sin(h_view<const float> x, h_view<float> y) {
+    XPU_UNLIKELY_IF(y.size() < x.size()) detail::throw_size_mismatch("xpu::math::sin", x.size(), y.size());
+    sin(x.data(), y.data(), x.size());
+}
+
+inline void xpu::math::cos(h_view<const float> x, h_view<float> y) {
+    XPU_UNLIKELY_IF(y.size() < x.size()) detail::throw_size_mismatch("xpu::math::cos", x.size(), y.size());
+    cos(x.data(), y.data(), x.size());
+}
+
+inline void xpu::math::sincos(h_view<const float> x, h_view<float> s, h_view<float> c) {
+    XPU_UNLIKELY_IF(s.size() < x.size()) detail::throw_size_mismatch("xpu::math::sincos", x.size(), s.size());
+    XPU_UNLIKELY_IF(c.size() < x.size()) detail::throw_size_mismatch("xpu::math::sincos", x.size(), c.size());
+    sincos(x.data(), s.data(), c.data(), x.size());
+}
+
+inline void xpu::math::rsqrt(h_view<const float> x, h_view<float> y) {
+    XPU_UNLIKELY_IF(y.size() < x.size()) detail::throw_size_mismatch("xpu::math::rsqrt", x.size(), y.size());
+    rsqrt(x.data(), y.data(), x.size());
+}
+
+inline void xpu::math::erf(h_view<const float> x, h_view<float> y) {
+    XPU_UNLIKELY_IF(y.size() < x.size()) detail::throw_size_mismatch("xpu::math::erf", x.size(), y.size());
+    erf(x.data(), y.data(), x.size());
+}
+
+inline void xpu::math::pow(h_view<const float> x, h_view<const float> y, h_view<float> z) {
+    XPU_UNLIKELY_IF(y.size() < x.size()) detail::throw_size_mismatch("xpu::math::pow", x.size(), y.size());
+    XPU_UNLIKELY_IF(z.size() < x.size()) detail::throw_size_mismatch("xpu::math::pow", x.size(), z.size());
+    pow(x.data(), y.data(), z.data(), x.size());
+}
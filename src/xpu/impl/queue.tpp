@@ -5,7 +5,41 @@
 #include "../detail/log.h"
 #include "../detail/backend.h"
 #include "../detail/config.h"
+#include "../detail/exceptions.h"
+#include "../detail/graph.h"
 #include "../detail/timers.h"
+#include "../detail/trace.h"
+#include "../detail/type_info.h"
+
+namespace xpu::detail {
+
+inline void trace_command(trace_span &span, const device &dev, void *queue, size_t bytes = 0) {
+    if (!span.active()) {
+        return;
+    }
+    trace_event &ev = span.event();
+    ev.device = dev.id;
+    ev.queue = queue;
+    ev.bytes = bytes;
+    span.time_on_device(dev, queue);
+}
+
+// 'g' may be null for launches with more than one grid.
+template<typename Kernel>
+void trace_launch(trace_span &span, const device &dev, void *queue, const grid *g) {
+    if (!span.active()) {
+        return;
+    }
+    trace_command(span, dev, queue);
+    trace_event &ev = span.event();
+    ev.name = type_name<Kernel>();
+    if (g != nullptr) {
+        ev.blocks[0] = g->nblocks.x; ev.blocks[1] = g->nblocks.y; ev.blocks[2] = g->nblocks.z;
+        ev.threads[0] = g->nthreads.x; ev.threads[1] = g->nthreads.y; ev.threads[2] = g->nthreads.z;
+    }
+}
+
+} // namespace xpu::detail
 
 inline xpu::queue::queue() : m_handle(std::make_shared<detail::queue_handle>()) {
 }
@@ -18,7 +52,7 @@ inline void xpu::queue::copy(const void *from, void *to, size_t size_bytes) {
         throw std::runtime_error("xpu::queue::copy: invalid pointer");
     }
 
-    if (!detail::config::profile) {
+    if (!detail::config::profiling() || is_capturing()) {
         do_copy(from, to, size_bytes, nullptr);
     } else {
         double ms;
@@ -35,6 +69,12 @@ void xpu::queue::copy(buffer<T> buf, xpu::direction dir) {
     buffer_prop props{buf};
 
     switch (props.type()) {
+    case buf_mmap:
+        if (dir == d2h) {
+            throw std::runtime_error("xpu::queue::copy: can't copy to a memory mapped file");
+        }
+        detail::buffer_registry::instance().pin_mapping(buf.get());
+        [[fallthrough]];
     case buf_io: {
         T *from = nullptr;
         T *to = nullptr;
@@ -60,7 +100,7 @@ void xpu::queue::copy(buffer<T> buf, xpu::direction dir) {
 
         log_copy(from, to, props.size_bytes());
 
-        if (!detail::config::profile) {
+        if (!detail::config::profiling() || is_capturing()) {
             do_copy(from, to, props.size_bytes(), nullptr);
         } else {
             double ms;
@@ -80,7 +120,15 @@ inline void xpu::queue::memset(void *dst, int value, size_t size) {
         throw std::runtime_error("xpu::queue::memset: invalid pointer");
     }
 
-    if (!detail::config::profile) {
+    if (is_capturing()) {
+        m_handle->capture->add<detail::memset_node>(detail::backend::get(m_handle->dev.backend), dst, value, size);
+        return;
+    }
+
+    detail::trace_span span{detail::trace_memset, "memset"};
+    detail::trace_command(span, m_handle->dev, m_handle->handle, size);
+
+    if (!detail::config::profiling()) {
         detail::backend::call(m_handle->dev.backend, &detail::backend_base::memset_async, dst, value, size, m_handle->handle, nullptr);
     } else {
         double ms;
@@ -104,14 +152,121 @@ void xpu::queue::memset(buffer<T> buf, int value) {
 template<typename Kernel, typename... Args>
 void xpu::queue::launch(grid params, Args&&... args) {
     static_assert(detail::is_kernel_v<Kernel>, "xpu::queue::launch: invalid kernel type");
+    if (is_capturing()) {
+        m_handle->capture->nodes->emplace_back(detail::runtime::instance().make_kernel_node<Kernel>(m_handle->dev.backend, params, std::forward<Args>(args)...));
+        return;
+    }
+    detail::trace_span span{detail::trace_kernel};
+    detail::trace_launch<Kernel>(span, m_handle->dev, m_handle->handle, &params);
     detail::runtime::instance().run_kernel<Kernel>(params, m_handle->dev.backend, m_handle->handle, std::forward<Args>(args)...);
 }
 
+template<typename Kernel>
+void xpu::queue::launch_batch(const grid *params, const kernel_args<Kernel> *args, size_t n) {
+    static_assert(detail::is_kernel_v<Kernel>, "xpu::queue::launch_batch: invalid kernel type");
+    throw_if_capturing("xpu::queue::launch_batch");
+    detail::trace_span span{detail::trace_kernel};
+    detail::trace_launch<Kernel>(span, m_handle->dev, m_handle->handle, nullptr);
+    detail::runtime::instance().run_kernel_batch<Kernel>(params, args, n, m_handle->dev.backend, m_handle->handle);
+}
+
+template<typename Kernel>
+void xpu::queue::launch_batch(const std::vector<grid> &params, const std::vector<kernel_args<Kernel>> &args) {
+    XPU_UNLIKELY_IF(params.size() != args.size()) {
+        detail::throw_size_mismatch("xpu::queue::launch_batch", params.size(), args.size());
+    }
+    launch_batch<Kernel>(params.data(), args.data(), params.size());
+}
+
 inline void xpu::queue::wait() {
+    throw_if_capturing("xpu::queue::wait");
     detail::backend::call(m_handle->dev.backend, &detail::backend_base::synchronize_queue, m_handle->handle);
 }
 
+inline xpu::event xpu::queue::record() {
+    throw_if_capturing("xpu::queue::record");
+    auto ev = std::make_shared<detail::event_handle>(m_handle->dev);
+    detail::backend::call(m_handle->dev.backend, &detail::backend_base::record_event, ev->handle, m_handle->handle);
+    return event{std::move(ev)};
+}
+
+inline void xpu::queue::wait_for(const event &ev) {
+    throw_if_capturing("xpu::queue::wait_for");
+    if (ev.m_handle->dev.backend != m_handle->dev.backend) {
+        throw std::runtime_error("xpu::queue::wait_for: event belongs to a different backend");
+    }
+    detail::backend::call(m_handle->dev.backend, &detail::backend_base::wait_event, m_handle->handle, ev.m_handle->handle);
+}
+
+inline void xpu::queue::begin_capture() {
+    if (is_capturing()) {
+        throw std::runtime_error("xpu::queue::begin_capture: queue is already capturing");
+    }
+    m_handle->capture = std::make_shared<detail::graph_impl>(m_handle->dev);
+}
+
+inline xpu::graph xpu::queue::end_capture() {
+    if (!is_capturing()) {
+        throw std::runtime_error("xpu::queue::end_capture: queue is not capturing");
+    }
+    return graph{std::move(m_handle->capture)};
+}
+
+inline void xpu::queue::throw_if_capturing(const char *func) const {
+    if (is_capturing()) {
+        throw std::runtime_error(std::string{func} + ": not allowed while the queue is capturing");
+    }
+}
+
+inline void xpu::graph::launch(queue &q) {
+    if (m_impl == nullptr) {
+        return;
+    }
+    const detail::queue_handle &qh = *q.m_handle;
+    if (qh.dev.backend != m_impl->dev.backend || qh.dev.device_nr != m_impl->dev.device_nr) {
+        throw std::runtime_error("xpu::graph::launch: graph was captured on a different device");
+    }
+    if (qh.capture != nullptr) {
+        throw std::runtime_error("xpu::graph::launch: queue is capturing");
+    }
+    detail::trace_span span{detail::trace_graph, "graph"};
+    detail::trace_command(span, qh.dev, qh.handle);
+    detail::runtime::instance().launch_graph(m_impl, qh);
+}
+
+template<typename Kernel, typename... Args>
+void xpu::graph::update(size_t node, grid params, Args&&... args) {
+    static_assert(detail::is_kernel_v<Kernel>, "xpu::graph::update: invalid kernel type");
+    if (node >= size() || (*m_impl->nodes)[node]->kernel_id() != detail::linear_type_id<Kernel>::get()) {
+        throw std::runtime_error("xpu::graph::update: node is not a launch of this kernel");
+    }
+    m_impl->replace(node, detail::runtime::instance().make_kernel_node<Kernel>(m_impl->dev.backend, params, std::forward<Args>(args)...));
+}
+
+inline size_t xpu::graph::size() const {
+    return m_impl == nullptr ? 0 : m_impl->nodes->size();
+}
+
+inline void xpu::event::synchronize() {
+    detail::backend::call(m_handle->dev.backend, &detail::backend_base::synchronize_event, m_handle->handle);
+}
+
+inline double xpu::event::elapsed_ms(const event &end) {
+    if (end.m_handle->dev.backend != m_handle->dev.backend) {
+        throw std::runtime_error("xpu::event::elapsed_ms: events belong to different backends");
+    }
+    double ms = 0;
+    detail::backend::call(m_handle->dev.backend, &detail::backend_base::event_elapsed_time, &ms, m_handle->handle, end.m_handle->handle);
+    return ms;
+}
+
 inline void xpu::queue::do_copy(const void *from, void *to, size_t size, double *ms) {
+    if (is_capturing()) {
+        m_handle->capture->add<detail::copy_node>(detail::backend::get(m_handle->dev.backend), from, to, size);
+        return;
+    }
+    detail::trace_span span{detail::trace_copy, "copy"};
+    detail::trace_command(span, m_handle->dev, m_handle->handle, size);
     detail::backend::call(m_handle->dev.backend, &detail::backend_base::memcpy_async,
             to, from, size, m_handle->handle, ms);
 }
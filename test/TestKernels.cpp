@@ -58,6 +58,45 @@ XPU_D void vector_add::operator()(context &ctx, const float *x, const float *y,
     do_vector_add(ctx.pos(), x, y, z, static_cast<size_t>(N));
 }
 
+XPU_EXPORT(write_instance_idx);
+XPU_D void write_instance_idx::operator()(context &ctx, int *out, int n) {
+    int i = ctx.block_idx_x() * ctx.block_dim_x() + ctx.thread_idx_x();
+    if (i < n) {
+        out[i] = ctx.instance_idx();
+    }
+}
+
+XPU_EXPORT(work_queue_seed);
+XPU_D void work_queue_seed::operator()(context &ctx, xpu::work_queue<int> q) {
+    if (ctx.thread_idx_x() == 0) {
+        q.push(0);
+    }
+}
+
+XPU_EXPORT(work_queue_expand);
+XPU_D void work_queue_expand::operator()(context &, xpu::work_queue<int> q, int max_depth, unsigned int *count) {
+    int depth;
+    while (q.pop(depth)) {
+        xpu::atomic_add(count, 1u);
+        if (depth < max_depth) {
+            q.push(depth + 1);
+            q.push(depth + 1);
+        }
+        q.done();
+    }
+}
+
+XPU_EXPORT(vector_add_simd);
+XPU_D void vector_add_simd::operator()(context &ctx, const float *x, const float *y, float *z, int N) {
+    do_vector_add(ctx.pos(), x, y, z, static_cast<size_t>(N));
+}
+
+XPU_EXPORT(vector_add_simd_independent);
+XPU_D void vector_add_simd_independent::operator()(context &ctx, const float *x, const float *y, float *z) {
+    int i = ctx.pos().block_idx_x() * ctx.pos().block_dim_x() + ctx.pos().thread_idx_x();
+    z[i] = x[i] + y[i];
+}
+
 XPU_EXPORT(vector_add_timing0);
 XPU_D void vector_add_timing0::operator()(context &ctx, const float *x, const float *y, float *z, int N) {
     do_vector_add(ctx.pos(), x, y, z, static_cast<size_t>(N));
@@ -104,6 +143,8 @@ XPU_D void merge_single::operator()(context &ctx, const float *a, size_t size_a,
 #endif
 }
 
+XPU_EXPORT(merge_key_values);
+
 XPU_EXPORT(block_scan);
 XPU_D void block_scan::operator()(context &ctx, int *incl, int *excl) {
 #ifndef DONT_TEST_BLOCK_FUNCS
@@ -114,6 +155,15 @@ XPU_D void block_scan::operator()(context &ctx, int *incl, int *excl) {
 #endif
 }
 
+XPU_EXPORT(block_reverse);
+XPU_D void block_reverse::operator()(context &ctx, int *data) {
+    int tid = ctx.thread_idx_x();
+    int offset = ctx.block_idx_x() * ctx.block_dim_x();
+    ctx.smem().items[tid] = data[offset + tid];
+    xpu::barrier(ctx.pos());
+    data[offset + tid] = ctx.smem().items[ctx.block_dim_x() - 1 - tid];
+}
+
 XPU_EXPORT(access_cmem_single);
 XPU_D void access_cmem_single::operator()(context &ctx, float3_ *out) {
     if (ctx.pos().thread_idx_x() > 0) {
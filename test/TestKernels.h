@@ -146,6 +146,39 @@ struct vector_add : xpu::kernel<TestKernels> {
     XPU_D void operator()(context &, const float *, const float *, float *, int);
 };
 
+// Writes the instance index of a batched launch to out[0, n).
+struct write_instance_idx : xpu::kernel<TestKernels> {
+    using context = xpu::kernel_context<xpu::no_smem>;
+    XPU_D void operator()(context &, int *, int);
+};
+
+// Expands a binary tree of depth 'max_depth' through a work queue. Counts the processed nodes in 'count'.
+struct work_queue_seed : xpu::kernel<TestKernels> {
+    using context = xpu::kernel_context<xpu::no_smem>;
+    XPU_D void operator()(context &, xpu::work_queue<int>);
+};
+
+struct work_queue_expand : xpu::kernel<TestKernels> {
+    using block_size = xpu::block_size<64>;
+    using context = xpu::kernel_context<xpu::no_smem>;
+    XPU_D void operator()(context &, xpu::work_queue<int>, int, unsigned int *);
+};
+
+struct vector_add_simd : xpu::kernel<TestKernels> {
+    using cpu_simd_width = xpu::cpu_simd_width<8>;
+    using context = xpu::kernel_context<xpu::no_smem>;
+    XPU_D void operator()(context &, const float *, const float *, float *, int);
+};
+
+// Launched with a multiple of the block size, so it doesn't need a bounds check
+// and the lanes can be vectorized.
+struct vector_add_simd_independent : xpu::kernel<TestKernels> {
+    using block_size = xpu::block_size<64>;
+    using cpu_simd_width = xpu::cpu_simd_width<8, true>;
+    using context = xpu::kernel_context<xpu::no_smem>;
+    XPU_D void operator()(context &, const float *, const float *, float *);
+};
+
 struct vector_add_timing0 : xpu::kernel<TestKernels> {
     using context = xpu::kernel_context<xpu::no_smem>;
     XPU_D void operator()(context &, const float *, const float *, float *, int);
@@ -184,6 +217,12 @@ struct merge_single : xpu::kernel<TestKernels> {
     XPU_D void operator()(context &, const float *, size_t, const float *, size_t, float *);
 };
 
+struct key_value_less {
+    XPU_D bool operator()(const key_value_t &a, const key_value_t &b) const { return a.key < b.key; }
+};
+
+using merge_key_values = xpu::merge_kernel<TestKernels, key_value_t, key_value_less>;
+
 struct block_scan : xpu::kernel<TestKernels> {
     using scan_t = xpu::block_scan<int, block_size::value.x>;
     using shared_memory = scan_t::storage_t;
@@ -191,6 +230,15 @@ struct block_scan : xpu::kernel<TestKernels> {
     XPU_D void operator()(context &, int *, int *);
 };
 
+struct block_reverse : xpu::kernel<TestKernels> {
+    using block_size = xpu::block_size<128>;
+    struct shared_memory {
+        int items[block_size::value.x];
+    };
+    using context = xpu::kernel_context<shared_memory>;
+    XPU_D void operator()(context &, int *);
+};
+
 struct access_cmem_single : xpu::kernel<TestKernels> {
     using constants = xpu::cmem<test_constant0>;
     using context = xpu::kernel_context<xpu::no_smem, constants>;
@@ -1,8 +1,18 @@
 #include "TestKernels.h"
 #include <xpu/host.h>
+#include <xpu/detail/platform/cpu/cpu_queue.h>
+#include <xpu/detail/platform/cpu/vector_math.h>
 #include <gtest/gtest.h>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
 #include <cstdlib>
+#include <fstream>
+#include <limits>
+#include <numeric>
 #include <random>
+#include <thread>
 #include <unordered_set>
 #include <vector>
 
@@ -98,6 +108,195 @@ TEST(XPUTest, IoBufferCanCopyToHost) {
     ASSERT_EQ(val, 42);
 }
 
+TEST(XPUTest, CanMapFileIntoBuffer) {
+    constexpr int NElems = 10000;
+    constexpr int Offset = 3; // Not page aligned
+
+    std::string path = testing::TempDir() + "xpu_test_mmap.bin";
+    std::vector<float> data(NElems);
+    std::iota(data.begin(), data.end(), 0.f);
+    {
+        std::ofstream out{path, std::ios::binary};
+        out.write(reinterpret_cast<const char *>(data.data()), data.size() * sizeof(float));
+    }
+
+    constexpr int N = NElems - Offset;
+    xpu::buffer<float> x{path.c_str(), Offset * sizeof(float), N};
+    xpu::buffer_prop xprop{x};
+    ASSERT_EQ(xprop.type(), xpu::buf_mmap);
+    ASSERT_EQ(xprop.size(), size_t(N));
+
+    xpu::buffer<float> z{N, xpu::buf_io};
+    xpu::copy(x, xpu::h2d);
+    xpu::run_kernel<vector_add>(xpu::n_threads(N), x.get(), x.get(), z.get(), N);
+    xpu::copy(z, xpu::d2h);
+
+    xpu::h_view zh{z};
+    for (int i = 0; i < N; i++) {
+        ASSERT_EQ(zh[i], 2.f * (i + Offset)) << "i = " << i;
+    }
+    ASSERT_THROW(xpu::copy(x, xpu::d2h), std::runtime_error);
+
+    // Writes to a copy-on-write mapping don't reach the file.
+    xpu::buffer<float> cow{path.c_str(), 0, NElems, xpu::mmap_copy_on_write};
+    xpu::h_view cowh{cow};
+    cowh[0] = -1.f;
+    xpu::buffer<float> reread{path.c_str(), 0, NElems};
+    ASSERT_EQ(xpu::h_view{reread}[0], 0.f);
+
+    ASSERT_THROW((xpu::buffer<float>{path.c_str(), 0, NElems + 1}), std::runtime_error);
+    ASSERT_THROW((xpu::buffer<float>{(path + ".missing").c_str(), 0, 1}), std::runtime_error);
+
+    x.reset();
+    cow.reset();
+    reread.reset();
+    std::remove(path.c_str());
+}
+
+TEST(XPUTest, CanLogFromMultipleThreads) {
+    constexpr int NThreads = 8;
+    constexpr int NMessages = 100; // Fits into the queue, so nothing is dropped
+
+    auto &logger = xpu::detail::logger::instance();
+    size_t dropped = logger.dropped();
+
+    std::vector<std::string> lines;
+    logger.initialize([&](std::string_view msg) { lines.emplace_back(msg); });
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < NThreads; t++) {
+        threads.emplace_back([t]() {
+            for (int i = 0; i < NMessages; i++) {
+                XPU_LOG("test %d %d", t, i);
+            }
+        });
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+    XPU_LOG("test %s", std::string(1000, 'x').c_str());
+    logger.flush();
+    logger.initialize({}); // Disable logging again
+
+    ASSERT_EQ(logger.dropped(), dropped);
+
+    std::vector<int> next(NThreads, 0);
+    size_t n_test_lines = 0;
+    for (const auto &line : lines) {
+        size_t msg = line.find("] xpu: test ");
+        if (msg == std::string::npos) {
+            continue;
+        }
+        ASSERT_EQ(line.front(), '[');
+        ASSERT_NE(line.find(" ms | T"), std::string::npos) << line;
+        n_test_lines++;
+
+        int t, i;
+        if (std::sscanf(line.c_str() + msg, "] xpu: test %d %d", &t, &i) == 2) {
+            // Messages of each thread arrive in order.
+            ASSERT_EQ(i, next.at(t)) << line;
+            next[t]++;
+        } else {
+            // Long messages are truncated
+            ASSERT_LT(line.size(), size_t(1000));
+            ASSERT_EQ(line.substr(line.size() - 3), "...");
+        }
+    }
+    ASSERT_EQ(n_test_lines, size_t(NThreads * NMessages + 1));
+}
+
+TEST(XPUTest, CanWriteTrace) {
+    constexpr int N = 1000;
+    xpu::buffer<float> x{N, xpu::buf_shared};
+    xpu::buffer<float> z{N, xpu::buf_shared};
+
+    xpu::detail::config::trace = true;
+    {
+        xpu::scoped_timer t{"trace_region"};
+        xpu::queue q;
+        q.memset(x, 0);
+        q.launch<vector_add>(xpu::n_threads(N), x.get(), x.get(), z.get(), N);
+        q.copy(x.get(), z.get(), N * sizeof(float));
+        q.wait();
+    }
+    xpu::detail::config::trace = false;
+
+    std::string path = testing::TempDir() + "xpu_test_trace.json";
+    xpu::write_trace(path);
+
+    std::ifstream in{path};
+    std::string trace{std::istreambuf_iterator<char>{in}, std::istreambuf_iterator<char>{}};
+    std::remove(path.c_str());
+
+    ASSERT_EQ(trace.rfind("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", 0), 0u);
+    ASSERT_EQ(trace.substr(trace.size() - 4), "\n]}\n");
+    ASSERT_NE(trace.find("{\"name\":\"vector_add\",\"cat\":\"kernel\""), std::string::npos);
+    ASSERT_NE(trace.find("\"threads\":[1000]"), std::string::npos);
+    ASSERT_NE(trace.find("{\"name\":\"copy\",\"cat\":\"copy\""), std::string::npos);
+    ASSERT_NE(trace.find("\"bytes\":4000"), std::string::npos);
+    ASSERT_NE(trace.find("{\"name\":\"memset\""), std::string::npos);
+    ASSERT_NE(trace.find("{\"name\":\"trace_region\",\"cat\":\"region\""), std::string::npos);
+    if (xpu::device::active().backend() == xpu::cpu) {
+        ASSERT_NE(trace.find("xpu queue executor"), std::string::npos);
+    }
+
+    ASSERT_THROW(xpu::write_trace(testing::TempDir() + "missing/trace.json"), std::runtime_error);
+}
+
+TEST(XPUTest, DropsOldestTraceEvents) {
+    constexpr int N = 1000;
+    xpu::buffer<float> x{N, xpu::buf_device};
+
+    size_t max_events = xpu::detail::config::trace_max_events;
+    xpu::detail::config::trace = true;
+    xpu::detail::config::trace_max_events = 4;
+    // Fresh thread, so no events were recorded on it before
+    std::thread t{[&] {
+        for (int i = 0; i < 10; i++) {
+            xpu::memset(x.get(), 0, N * sizeof(float));
+        }
+    }};
+    t.join();
+    xpu::detail::config::trace = false;
+    xpu::detail::config::trace_max_events = max_events;
+
+    std::string path = testing::TempDir() + "xpu_test_trace_dropped.json";
+    xpu::write_trace(path);
+
+    std::ifstream in{path};
+    std::string trace{std::istreambuf_iterator<char>{in}, std::istreambuf_iterator<char>{}};
+    std::remove(path.c_str());
+
+    ASSERT_NE(trace.find("\"dropped_events\":6}"), std::string::npos);
+}
+
+TEST(XPUTest, CanCreateBuffersFromMultipleThreads) {
+    constexpr int NThreads = 8;
+    constexpr int NBuffers = 200;
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < NThreads; t++) {
+        threads.emplace_back([t]() {
+            std::vector<xpu::buffer<int>> buffers;
+            for (int i = 0; i < NBuffers; i++) {
+                xpu::buffer<int> buf{size_t(i + 1), xpu::buf_host};
+                buf.get()[0] = t * NBuffers + i;
+                buffers.push_back(buf); // Copy adds a reference
+            }
+            std::vector<xpu::buffer<int>> copies = buffers;
+            buffers.clear();
+            for (int i = 0; i < NBuffers; i++) {
+                xpu::buffer_prop prop{copies[i]};
+                ASSERT_EQ(prop.size(), size_t(i + 1));
+                ASSERT_EQ(copies[i].get()[0], t * NBuffers + i);
+            }
+        });
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+}
+
 TEST(XPUTest, CanCopyAsyncDeviceToHost) {
     int val = 69;
     xpu::buffer<int> buf{1, xpu::buf_io, &val};
@@ -111,7 +310,23 @@ TEST(XPUTest, CanCopyAsyncDeviceToHost) {
 }
 
 TEST(XPUTest, CanAllocateStackMemory) {
-    xpu::stack_alloc(1024 * 1024);
+    // Only one of several concurrent calls allocates the stack
+    std::atomic<int> allocated{0};
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++) {
+        threads.emplace_back([&]() {
+            try {
+                xpu::stack_alloc(1024 * 1024);
+                allocated++;
+            } catch (const std::runtime_error &) {
+            }
+        });
+    }
+    for (std::thread &t : threads) {
+        t.join();
+    }
+    ASSERT_EQ(allocated, 1);
+
     xpu::buffer<int> buf{1, xpu::buf_stack};
     xpu::buffer<int> x{};
 
@@ -149,6 +364,44 @@ TEST(XPUTest, CanAllocateStackMemory) {
     ASSERT_EQ(buf5.get(), head);
 }
 
+TEST(XPUTest, CanUseStackArenasPerThread) {
+    constexpr int NThreads = 4;
+    constexpr int NBuffers = 100;
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < NThreads; t++) {
+        threads.emplace_back([]() {
+            xpu::stack_arena arena{NBuffers * 256 * 2};
+            xpu::stack_arena::scope s{arena};
+
+            std::vector<xpu::buffer<int>> buffers;
+            for (int i = 0; i < NBuffers; i++) {
+                buffers.emplace_back(size_t(i + 1), xpu::buf_stack);
+                if (i > 0) {
+                    ASSERT_GT(buffers[i].get(), buffers[i - 1].get());
+                }
+            }
+            for (int i = 0; i < NBuffers; i++) {
+                xpu::buffer_prop prop{buffers[i]};
+                ASSERT_EQ(prop.type(), xpu::buf_stack);
+                ASSERT_EQ(prop.size(), size_t(i + 1));
+            }
+
+            void *mid = buffers[NBuffers / 2].get();
+            arena.pop(mid);
+            xpu::buffer<int> next{1, xpu::buf_stack};
+            ASSERT_EQ(next.get(), mid);
+
+            xpu::stack_pop(); // Pops the selected arena
+            xpu::buffer<int> first{1, xpu::buf_stack};
+            ASSERT_EQ(first.get(), buffers[0].get());
+        });
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+}
+
 TEST(XPUTest, CanRunVectorAdd) {
     constexpr int NElems = 100;
 
@@ -176,6 +429,44 @@ TEST(XPUTest, CanRunVectorAdd) {
     xpu::free(dz);
 }
 
+TEST(XPUTest, CanRunVectorAddInSimdMode) {
+    constexpr int NElems = 1001; // Not a multiple of the SIMD width
+
+    xpu::buffer<float> a{NElems, xpu::buf_shared};
+    xpu::buffer<float> b{NElems, xpu::buf_shared};
+    xpu::buffer<float> c{NElems, xpu::buf_shared};
+    for (int i = 0; i < NElems; i++) {
+        a.get()[i] = i;
+        b.get()[i] = 2 * i;
+        c.get()[i] = -1;
+    }
+
+    xpu::run_kernel<vector_add_simd>(xpu::n_threads(NElems), a.get(), b.get(), c.get(), NElems);
+
+    for (int i = 0; i < NElems; i++) {
+        ASSERT_EQ(c.get()[i], float(3 * i)) << "i = " << i;
+    }
+}
+
+TEST(XPUTest, CanRunIndependentLanesInSimdMode) {
+    constexpr int NElems = 64 * 16; // Multiple of the block size
+
+    xpu::buffer<float> a{NElems, xpu::buf_shared};
+    xpu::buffer<float> b{NElems, xpu::buf_shared};
+    xpu::buffer<float> c{NElems, xpu::buf_shared};
+    for (int i = 0; i < NElems; i++) {
+        a.get()[i] = i;
+        b.get()[i] = 2 * i;
+        c.get()[i] = -1;
+    }
+
+    xpu::run_kernel<vector_add_simd_independent>(xpu::n_threads(NElems), a.get(), b.get(), c.get());
+
+    for (int i = 0; i < NElems; i++) {
+        ASSERT_EQ(c.get()[i], float(3 * i)) << "i = " << i;
+    }
+}
+
 TEST(XPUTest, CanRunVectorAddQueue) {
     constexpr int NElems = 100;
 
@@ -205,6 +496,427 @@ TEST(XPUTest, CanRunVectorAddQueue) {
 
 }
 
+TEST(XPUTest, CanRunMultipleQueues) {
+    constexpr int NElems = 4096;
+    constexpr int NQueues = 4;
+
+    std::vector<xpu::queue> queues(NQueues);
+    std::vector<xpu::buffer<float>> out;
+    xpu::buffer<float> xbuf{NElems, xpu::buf_io};
+    xpu::h_view x{xbuf};
+    for (int i = 0; i < NElems; i++) {
+        x[i] = i;
+    }
+    xpu::copy(xbuf, xpu::h2d);
+
+    for (int q = 0; q < NQueues; q++) {
+        out.emplace_back(NElems, xpu::buf_io);
+        queues[q].memset(out[q], 0);
+        for (int i = 0; i <= q; i++) {
+            // Commands in a queue are executed in order, so out = x * (q + 1)
+            queues[q].launch<vector_add>(xpu::n_threads(NElems), xbuf.get(), out[q].get(), out[q].get(), NElems);
+        }
+        queues[q].copy(out[q], xpu::d2h);
+    }
+
+    for (int q = 0; q < NQueues; q++) {
+        queues[q].wait();
+        xpu::h_view z{out[q]};
+        for (int i = 0; i < NElems; i++) {
+            ASSERT_EQ(z[i], float(i * (q + 1))) << "queue = " << q;
+        }
+    }
+}
+
+TEST(XPUTest, CanRunOnEveryCpuDevice) {
+    // The CPU driver exposes one device per NUMA node
+    constexpr int NElems = 10000;
+
+    for (xpu::device dev : xpu::device::all()) {
+        if (dev.backend() != xpu::cpu) {
+            continue;
+        }
+        xpu::queue q{dev};
+        xpu::buffer<float> a{NElems, xpu::buf_shared, dev};
+        xpu::buffer<float> out{NElems, xpu::buf_shared, dev};
+        ASSERT_EQ(xpu::ptr_prop{a.get()}.device().id(), dev.id());
+        ASSERT_EQ(xpu::ptr_prop{out.get() + NElems / 2}.device().id(), dev.id());
+        for (int i = 0; i < NElems; i++) {
+            a.get()[i] = i;
+        }
+        q.launch<vector_add>(xpu::n_threads(NElems), a.get(), a.get(), out.get(), NElems);
+        q.wait();
+        for (int i = 0; i < NElems; i++) {
+            ASSERT_EQ(out.get()[i], float(2 * i)) << "device = " << dev.device_nr();
+        }
+    }
+}
+
+TEST(XPUTest, CanSynchronizeQueuesWithEvents) {
+    constexpr int NElems = 100000;
+
+    xpu::queue producer;
+    xpu::queue consumer;
+
+    xpu::buffer<float> xbuf{NElems, xpu::buf_io};
+    xpu::buffer<float> tmp{NElems, xpu::buf_device};
+    xpu::buffer<float> out{NElems, xpu::buf_io};
+    xpu::h_view x{xbuf};
+    for (int i = 0; i < NElems; i++) {
+        x[i] = i;
+    }
+
+    xpu::event start = producer.record();
+    producer.copy(xbuf, xpu::h2d);
+    producer.launch<vector_add>(xpu::n_threads(NElems), xbuf.get(), xbuf.get(), tmp.get(), NElems);
+    xpu::event produced = producer.record();
+
+    // Consumer must not read tmp before the producer is done
+    consumer.wait_for(produced);
+    consumer.launch<vector_add>(xpu::n_threads(NElems), tmp.get(), xbuf.get(), out.get(), NElems);
+    consumer.copy(out, xpu::d2h);
+    xpu::event consumed = consumer.record();
+
+    consumed.synchronize();
+    xpu::h_view z{out};
+    for (int i = 0; i < NElems; i++) {
+        ASSERT_EQ(z[i], float(3 * i)) << "i = " << i;
+    }
+
+    ASSERT_GE(start.elapsed_ms(produced), 0.);
+}
+
+TEST(XPUTest, CanDestroyEventBeforeQueueWaitsOnIt) {
+    constexpr int NElems = 100000;
+    constexpr size_t BusyBytes = size_t{64} << 20;
+
+    xpu::queue producer;
+    xpu::queue consumer;
+
+    xpu::buffer<float> x{NElems, xpu::buf_shared};
+    xpu::buffer<float> tmp{NElems, xpu::buf_shared};
+    xpu::buffer<float> out{NElems, xpu::buf_shared};
+    xpu::buffer<char> busy_src{BusyBytes, xpu::buf_host};
+    xpu::buffer<char> busy_dst{BusyBytes, xpu::buf_host};
+    for (int i = 0; i < NElems; i++) {
+        x.get()[i] = i;
+    }
+
+    {
+        // Profiling waits for each command to finish
+        xpu::scoped_profiling_pause no_profiling;
+
+        // Keep the consumer busy, so it reaches the wait only after the event was destroyed
+        consumer.copy(busy_src.get(), busy_dst.get(), BusyBytes);
+        {
+            producer.launch<vector_add>(xpu::n_threads(NElems), x.get(), x.get(), tmp.get(), NElems);
+            xpu::event produced = producer.record();
+            consumer.wait_for(produced);
+        }
+        consumer.launch<vector_add>(xpu::n_threads(NElems), tmp.get(), x.get(), out.get(), NElems);
+        consumer.wait();
+    }
+
+    for (int i = 0; i < NElems; i++) {
+        ASSERT_EQ(out.get()[i], float(3 * i)) << "i = " << i;
+    }
+}
+
+TEST(XPUTest, CanCaptureAndReplayGraph) {
+    constexpr int NElems = 10000;
+
+    xpu::buffer<float> x{NElems, xpu::buf_shared};
+    xpu::buffer<float> y{NElems, xpu::buf_shared};
+    xpu::buffer<float> z{NElems, xpu::buf_shared};
+    xpu::buffer<float> out{NElems, xpu::buf_shared};
+    std::fill_n(out.get(), NElems, 0.f);
+
+    xpu::queue q;
+    q.begin_capture();
+    q.memset(y, 0);
+    q.launch<vector_add>(xpu::n_threads(NElems), x.get(), y.get(), y.get(), NElems);
+    q.launch<vector_add>(xpu::n_threads(NElems), x.get(), y.get(), z.get(), NElems);
+    q.copy(z.get(), out.get(), NElems * sizeof(float));
+    ASSERT_THROW(q.wait(), std::runtime_error);
+    xpu::graph g = q.end_capture();
+    ASSERT_EQ(g.size(), 4);
+
+    // Capturing doesn't execute anything
+    for (int i = 0; i < NElems; i++) {
+        ASSERT_EQ(out.get()[i], 0.f);
+    }
+
+    for (int r = 1; r <= 3; r++) {
+        for (int i = 0; i < NElems; i++) {
+            x.get()[i] = i * r;
+        }
+        g.launch(q);
+        q.wait();
+        for (int i = 0; i < NElems; i++) {
+            ASSERT_EQ(out.get()[i], float(2 * i * r)) << "r = " << r << ", i = " << i;
+        }
+    }
+
+    // Only the first half of z is written after the update
+    std::fill_n(z.get(), NElems, -1.f);
+    g.update<vector_add>(2, xpu::n_threads(NElems / 2), x.get(), y.get(), z.get(), NElems / 2);
+    ASSERT_THROW(g.update<vector_add>(0, xpu::n_threads(NElems), x.get(), y.get(), z.get(), NElems), std::runtime_error);
+    g.launch(q);
+    q.wait();
+    for (int i = 0; i < NElems; i++) {
+        ASSERT_EQ(out.get()[i], i < NElems / 2 ? float(2 * i * 3) : -1.f) << "i = " << i;
+    }
+}
+
+TEST(XPUTest, CanLaunchBatches) {
+    constexpr int NInstances = 200;
+
+    // Instances of different sizes, including empty ones
+    std::vector<int> offsets{0};
+    for (int i = 0; i < NInstances; i++) {
+        offsets.push_back(offsets.back() + (i * 37) % 300);
+    }
+    int total = offsets.back();
+
+    xpu::buffer<float> x{size_t(total), xpu::buf_shared};
+    xpu::buffer<float> z{size_t(total), xpu::buf_shared};
+    xpu::buffer<int> idx{size_t(total), xpu::buf_shared};
+    for (int i = 0; i < total; i++) {
+        x.get()[i] = i;
+    }
+
+    std::vector<xpu::grid> grids;
+    std::vector<xpu::kernel_args<vector_add>> add_args;
+    std::vector<xpu::kernel_args<write_instance_idx>> idx_args;
+    for (int i = 0; i < NInstances; i++) {
+        int n = offsets[i + 1] - offsets[i];
+        grids.push_back(xpu::n_threads(n));
+        add_args.emplace_back(x.get() + offsets[i], x.get() + offsets[i], z.get() + offsets[i], n);
+        idx_args.emplace_back(idx.get() + offsets[i], n);
+    }
+
+    xpu::queue q;
+    q.launch_batch<vector_add>(grids, add_args);
+    q.launch_batch<write_instance_idx>(grids, idx_args);
+    q.wait();
+
+    for (int i = 0; i < NInstances; i++) {
+        for (int j = offsets[i]; j < offsets[i + 1]; j++) {
+            ASSERT_EQ(z.get()[j], float(2 * j)) << "j = " << j;
+            ASSERT_EQ(idx.get()[j], i) << "j = " << j;
+        }
+    }
+
+    grids.pop_back();
+    ASSERT_THROW(q.launch_batch<vector_add>(grids, add_args), std::length_error);
+}
+
+TEST(XPUTest, CanDrainWorkQueue) {
+    constexpr int MaxDepth = 10;
+    constexpr unsigned int NNodes = (1u << (MaxDepth + 1)) - 1;
+
+    xpu::work_queue_storage<int> storage{NNodes};
+    xpu::buffer<unsigned int> count{1, xpu::buf_io};
+    xpu::h_view count_h{count};
+
+    for (int run = 0; run < 2; run++) {
+        count_h[0] = 0;
+        xpu::copy(count, xpu::h2d);
+        storage.reset();
+
+        xpu::run_kernel<work_queue_seed>(xpu::n_threads(1), storage.get());
+        xpu::run_kernel<work_queue_expand>(xpu::persistent_blocks(), storage.get(), MaxDepth, count.get());
+
+        xpu::copy(count, xpu::d2h);
+        ASSERT_EQ(count_h[0], NNodes);
+        ASSERT_FALSE(storage.overflowed());
+    }
+
+    // Not enough room for all nodes: Pushes beyond the capacity are dropped, but the kernel still terminates.
+    xpu::work_queue_storage<int> small{NNodes / 2};
+    count_h[0] = 0;
+    xpu::copy(count, xpu::h2d);
+    xpu::run_kernel<work_queue_seed>(xpu::n_threads(1), small.get());
+    xpu::run_kernel<work_queue_expand>(xpu::persistent_blocks(), small.get(), MaxDepth, count.get());
+    xpu::copy(count, xpu::d2h);
+    ASSERT_EQ(count_h[0], NNodes / 2);
+    ASSERT_TRUE(small.overflowed());
+}
+
+TEST(XPUTest, CanStreamChunksThroughPipeline) {
+    constexpr size_t ChunkSize = 1000;
+    constexpr size_t N = ChunkSize * 7 + 123;
+
+    std::vector<float> input(N);
+    std::iota(input.begin(), input.end(), 0.f);
+    std::vector<float> output;
+
+    for (size_t depth : {1, 2, 3}) {
+        xpu::stream_pipeline<float, float> pipeline{ChunkSize, ChunkSize, depth};
+        ASSERT_EQ(pipeline.depth(), depth);
+
+        size_t pos = 0;
+        output.clear();
+
+        size_t chunks = pipeline.run(
+            [&](xpu::h_view<float> in) {
+                size_t n = std::min(ChunkSize, N - pos);
+                std::copy_n(&input[pos], n, in.begin());
+                pos += n;
+                return n;
+            },
+            [](xpu::queue &q, xpu::buffer<float> in, xpu::buffer<float> out, size_t n) {
+                q.launch<vector_add>(xpu::n_threads(n), in.get(), in.get(), out.get(), static_cast<int>(n));
+            },
+            [&](xpu::h_view<const float> out, size_t n) {
+                output.insert(output.end(), out.begin(), out.begin() + n);
+            }
+        );
+
+        ASSERT_EQ(chunks, (N + ChunkSize - 1) / ChunkSize);
+        ASSERT_EQ(output.size(), N);
+        for (size_t i = 0; i < N; i++) {
+            ASSERT_EQ(output[i], 2.f * i) << "i = " << i << ", depth = " << depth;
+        }
+    }
+}
+
+TEST(XPUTest, RethrowsExceptionsOfQueueCommands) {
+    xpu::detail::cpu_queue q{0};
+
+    std::atomic<int> ran{0};
+    q.submit([] { throw std::runtime_error{"command failed"}; });
+    q.submit([&] { ran++; }); // Later commands still run
+    ASSERT_THROW(q.wait(), std::runtime_error);
+    ASSERT_EQ(ran, 1);
+
+    // Error is only reported once
+    ASSERT_EQ(q.wait(), 0);
+}
+
+TEST(XPUTest, FreeWaitsForQueueCommands) {
+    if (xpu::device::active().backend() != xpu::cpu) {
+        GTEST_SKIP() << "GPU drivers synchronize frees themselves";
+    }
+    constexpr size_t BusyBytes = size_t{64} << 20;
+
+    char *src = xpu::malloc_host<char>(BusyBytes);
+    char *dst = xpu::malloc_host<char>(BusyBytes);
+    std::fill_n(src, BusyBytes, 1);
+    char one = 1;
+    char done = 0;
+
+    // Profiling waits for each command to finish
+    xpu::scoped_profiling_pause no_profiling;
+    xpu::queue q;
+    q.copy(src, dst, BusyBytes);
+    q.copy(&one, &done, 1);
+    xpu::free(dst);
+    ASSERT_EQ(done, 1);
+
+    xpu::free(src);
+    q.wait();
+}
+
+TEST(XPUTest, StreamPipelineKeepsChunksInFlight) {
+    constexpr size_t ChunkSize = 1000;
+    constexpr size_t NChunks = 8;
+
+    for (size_t depth : {1, 2, 3}) {
+        xpu::stream_pipeline<float, float> pipeline{ChunkSize, ChunkSize, depth};
+
+        size_t produced = 0;
+        size_t produced_before_sink = 0;
+        size_t consumed = 0;
+
+        // Profiling makes every command synchronous, check the pipeline as it's used for throughput.
+        xpu::scoped_profiling_pause no_profiling;
+        xpu::timings ts;
+        {
+            xpu::scoped_timer timer{"pipeline", &ts};
+            pipeline.run(
+                [&](xpu::h_view<float> in) -> size_t {
+                    if (produced == NChunks) {
+                        return 0;
+                    }
+                    std::fill(in.begin(), in.end(), float(produced));
+                    produced++;
+                    return ChunkSize;
+                },
+                [](xpu::queue &q, xpu::buffer<float> in, xpu::buffer<float> out, size_t n) {
+                    q.launch<vector_add>(xpu::n_threads(n), in.get(), in.get(), out.get(), static_cast<int>(n));
+                },
+                [&](xpu::h_view<const float> out, size_t) {
+                    if (consumed == 0) {
+                        produced_before_sink = produced;
+                    }
+                    ASSERT_EQ(out[0], 2.f * consumed);
+                    consumed++;
+                }
+            );
+        }
+
+        // The first chunk only reaches the sink once its slot is needed again, so 'depth' chunks are in flight.
+        ASSERT_EQ(produced_before_sink, depth);
+        ASSERT_EQ(consumed, NChunks);
+        ASSERT_FALSE(ts.has_details());
+    }
+}
+
+TEST(XPUTest, CanReuseCachedMemory) {
+    xpu::trim_memory_cache();
+
+    void *first = xpu::malloc_device(1000);
+    xpu::free(first);
+
+    xpu::memory_cache_stats stats = xpu::get_memory_cache_stats();
+    if (stats.cached_bytes == 0) {
+        GTEST_SKIP() << "Memory cache disabled";
+    }
+    ASSERT_GE(stats.cached_bytes, 1000);
+
+    // Same size class, so the cached block should be reused
+    void *second = xpu::malloc_device(900);
+    xpu::memory_cache_stats stats2 = xpu::get_memory_cache_stats();
+    ASSERT_EQ(second, first);
+    ASSERT_EQ(stats2.hits, stats.hits + 1);
+    ASSERT_EQ(stats2.misses, stats.misses);
+    ASSERT_EQ(stats2.cached_bytes, 0);
+
+    xpu::free(second);
+    xpu::trim_memory_cache();
+    ASSERT_EQ(xpu::get_memory_cache_stats().cached_bytes, 0);
+}
+
+TEST(XPUTest, LimitsMemoryCachePerDevice) {
+    xpu::trim_memory_cache();
+    if (!xpu::detail::config::memory_cache) {
+        GTEST_SKIP() << "Memory cache disabled";
+    }
+
+    // Size classes are a quarter of a power of two apart
+    void *first = xpu::malloc_device(1250);
+    xpu::free(first);
+    void *second = xpu::malloc_device(1100);
+    ASSERT_EQ(second, first);
+    xpu::free(second);
+    ASSERT_EQ(xpu::get_memory_cache_stats().cached_bytes, 1280);
+    xpu::trim_memory_cache();
+
+    // Host and device blocks count towards the same limit
+    size_t limit = xpu::detail::config::memory_cache_limit;
+    xpu::detail::config::memory_cache_limit = 1024;
+    void *d = xpu::malloc_device(1024);
+    void *h = xpu::malloc_host(1024);
+    xpu::free(d);
+    xpu::free(h);
+    xpu::detail::config::memory_cache_limit = limit;
+
+    ASSERT_EQ(xpu::get_memory_cache_stats().cached_bytes, 1024);
+    xpu::trim_memory_cache();
+    ASSERT_EQ(xpu::get_memory_cache_stats().cached_bytes, 0);
+}
+
 TEST(XPUTest, CanSortStruct) {
 
     // GTEST_SKIP();
@@ -317,6 +1029,94 @@ TEST(XPUTest, CanSortFloatsShort) {
 
 }
 
+template<typename Key, typename Dist>
+void testDeviceSort(size_t N, Dist dist) {
+    xpu::buffer<Key> keys{N, xpu::buf_io};
+
+    std::mt19937 gen{1337};
+    xpu::h_view h{keys};
+    for (size_t i = 0; i < N; i++) {
+        h[i] = dist(gen);
+    }
+    std::vector<Key> expected(h.begin(), h.end());
+    std::sort(expected.begin(), expected.end());
+
+    xpu::copy(keys, xpu::h2d);
+    xpu::device_sort(keys, N);
+    xpu::copy(keys, xpu::d2h);
+
+    for (size_t i = 0; i < N; i++) {
+        ASSERT_EQ(h[i], expected[i]) << "i = " << i;
+    }
+}
+
+TEST(XPUTest, CanSortKeys) {
+    constexpr size_t NLarge = 1 << 20;
+    testDeviceSort<int>(NLarge, std::uniform_int_distribution<int>{-1000000, 1000000});
+    testDeviceSort<unsigned int>(100, std::uniform_int_distribution<unsigned int>{});
+    testDeviceSort<float>(NLarge, std::uniform_real_distribution<float>{-1000, 1000});
+    testDeviceSort<double>(1000, std::normal_distribution<double>{0, 100});
+    testDeviceSort<long long>(NLarge, std::uniform_int_distribution<long long>{std::numeric_limits<long long>::min(), std::numeric_limits<long long>::max()});
+
+    xpu::buffer<int> small{10, xpu::buf_io};
+    EXPECT_THROW(xpu::device_sort(small, 11), std::length_error);
+}
+
+TEST(XPUTest, CanSortPairs) {
+    constexpr size_t N = 300000;
+    xpu::buffer<float> keys{N, xpu::buf_io};
+    xpu::buffer<unsigned int> values{N, xpu::buf_io};
+
+    std::mt19937 gen{1337};
+    std::uniform_int_distribution<int> dist{-100, 100};
+    xpu::h_view k{keys};
+    xpu::h_view v{values};
+    for (size_t i = 0; i < N; i++) {
+        k[i] = static_cast<float>(dist(gen));
+        v[i] = i;
+    }
+    std::vector<float> unsorted(k.begin(), k.end());
+
+    xpu::copy(keys, xpu::h2d);
+    xpu::copy(values, xpu::h2d);
+    xpu::sort_pairs(keys, values, N);
+    xpu::copy(keys, xpu::d2h);
+    xpu::copy(values, xpu::d2h);
+
+    for (size_t i = 0; i < N; i++) {
+        ASSERT_EQ(k[i], unsorted[v[i]]);
+        if (i > 0) {
+            ASSERT_LE(k[i-1], k[i]);
+            if (k[i-1] == k[i]) {
+                ASSERT_LT(v[i-1], v[i]); // stable
+            }
+        }
+    }
+}
+
+TEST(XPUTest, CanSortWithKeyGetter) {
+    constexpr size_t N = 100000;
+    xpu::buffer<key_value_t> items{N, xpu::buf_io};
+
+    std::mt19937 gen{1337};
+    std::uniform_int_distribution<unsigned int> dist{0, 1000};
+    xpu::h_view h{items};
+    for (size_t i = 0; i < N; i++) {
+        h[i] = key_value_t{dist(gen), static_cast<unsigned int>(i)};
+    }
+
+    xpu::copy(items, xpu::h2d);
+    xpu::device_sort(items, N, [](const key_value_t &kv) { return kv.key; });
+    xpu::copy(items, xpu::d2h);
+
+    for (size_t i = 1; i < N; i++) {
+        ASSERT_LE(h[i-1].key, h[i].key);
+        if (h[i-1].key == h[i].key) {
+            ASSERT_LT(h[i-1].value, h[i].value);
+        }
+    }
+}
+
 template<typename K>
 void testMergeKernel(size_t M, size_t N) {
     xpu::buffer<float> a{M, xpu::buf_io};
@@ -386,12 +1186,71 @@ TEST(XPUTest, CanMergeWithOneItemPerThread) {
     testMergeKernel<merge_single>(512, 512);
 }
 
+TEST(XPUTest, CanMergeBuffers) {
+    constexpr size_t M = 700000;
+    constexpr size_t N = 300001;
+    xpu::buffer<key_value_t> a{M, xpu::buf_io};
+    xpu::buffer<key_value_t> b{N, xpu::buf_io};
+    xpu::buffer<key_value_t> dst{M + N, xpu::buf_io};
+
+    // Few distinct keys, so many items compare equal.
+    std::mt19937 gen{1337};
+    std::uniform_int_distribution<unsigned int> dist{0, 1000};
+    auto by_key = [](const key_value_t &x, const key_value_t &y) { return x.key < y.key; };
+
+    xpu::h_view a_h{a};
+    for (size_t i = 0; i < M; i++) {
+        a_h[i] = key_value_t{dist(gen), 0};
+    }
+    std::sort(a_h.begin(), a_h.end(), by_key);
+    for (size_t i = 0; i < M; i++) {
+        a_h[i].value = i;
+    }
+
+    xpu::h_view b_h{b};
+    for (size_t i = 0; i < N; i++) {
+        b_h[i] = key_value_t{dist(gen), 0};
+    }
+    std::sort(b_h.begin(), b_h.end(), by_key);
+    for (size_t i = 0; i < N; i++) {
+        b_h[i].value = M + i;
+    }
+
+    std::vector<key_value_t> expected(M + N);
+    std::merge(a_h.begin(), a_h.end(), b_h.begin(), b_h.end(), expected.begin(), by_key);
+
+    xpu::copy(a, xpu::h2d);
+    xpu::copy(b, xpu::h2d);
+    xpu::device_merge<merge_key_values>(a, b, dst);
+    xpu::copy(dst, xpu::d2h);
+
+    xpu::h_view h{dst};
+    for (size_t i = 0; i < M + N; i++) {
+        ASSERT_EQ(h[i].key, expected[i].key) << "i = " << i;
+        ASSERT_EQ(h[i].value, expected[i].value) << "i = " << i;
+    }
+
+    // Same partitioning as on GPUs: One block per merge_key_values::items_per_block items.
+    std::fill(h.begin(), h.end(), key_value_t{0, 0});
+    xpu::copy(dst, xpu::h2d);
+    int nblocks = static_cast<int>((M + N + merge_key_values::items_per_block - 1) / merge_key_values::items_per_block);
+    xpu::run_kernel<merge_key_values>(xpu::n_blocks(nblocks), a.get(), M, b.get(), N, dst.get());
+    xpu::copy(dst, xpu::d2h);
+    for (size_t i = 0; i < M + N; i++) {
+        ASSERT_EQ(h[i].key, expected[i].key) << "i = " << i;
+        ASSERT_EQ(h[i].value, expected[i].value) << "i = " << i;
+    }
+
+    xpu::buffer<key_value_t> small{M + N - 1, xpu::buf_io};
+    EXPECT_THROW(xpu::device_merge<merge_key_values>(a, b, small), std::length_error);
+}
+
 TEST(XPUTest, CanRunBlockScan) {
 #ifdef DONT_TEST_BLOCK_FUNCS
     GTEST_SKIP();
 #endif
 
-    size_t blockSize = xpu::device::active().backend() == xpu::cpu ? 1 : 64;
+    size_t blockSize = 64;
 
     xpu::buffer<int> incl{blockSize, xpu::buf_io};
     xpu::buffer<int> excl{blockSize, xpu::buf_io};
@@ -414,6 +1273,28 @@ TEST(XPUTest, CanRunBlockScan) {
     }
 }
 
+TEST(XPUTest, CanSyncThreadsInBlock) {
+    constexpr int NBlocks = 4;
+    size_t n = NBlocks * block_reverse::block_size::value.x;
+
+    xpu::buffer<int> data{n, xpu::buf_io};
+    xpu::h_view data_h{data};
+    for (size_t i = 0; i < n; i++) {
+        data_h[i] = static_cast<int>(i);
+    }
+    xpu::copy(data, xpu::h2d);
+
+    xpu::run_kernel<block_reverse>(xpu::n_blocks(NBlocks), data.get());
+    xpu::copy(data, xpu::d2h);
+
+    int blockSize = block_reverse::block_size::value.x;
+    for (size_t i = 0; i < n; i++) {
+        int block = i / blockSize;
+        int expected = block * blockSize + (blockSize - 1 - i % blockSize);
+        ASSERT_EQ(data_h[i], expected) << "i = " << i;
+    }
+}
+
 TEST(XPUTest, CanSetAndReadCMem) {
     float3_ orig{1, 2, 3};
     xpu::buffer<float3_> out{1, xpu::buf_io};
@@ -497,7 +1378,7 @@ void test_thread_position(xpu::dim gpu_block_size, xpu::dim gpu_grid_dim) {
     xpu::copy(block_idx, xpu::d2h);
     xpu::copy(grid_dim, xpu::d2h);
 
-    xpu::dim exp_block_dim = (xpu::device::active().backend() == xpu::cpu ? xpu::dim{1, 1, 1} : gpu_block_size);
+    xpu::dim exp_block_dim = gpu_block_size;
     xpu::dim exp_grid_dim;
     exec_grid.get_compute_grid(exp_block_dim, exp_grid_dim);
     for (int i = 0; i < nthreads.x; i++) {
@@ -638,6 +1519,185 @@ TEST(XPUTest, CanCallDeviceFuncs) {
     EXPECT_FLOAT_EQ(b[TANH].f, 0.76159418f);
     EXPECT_FLOAT_EQ(b[TGAMMA].f, 362880);
     EXPECT_FLOAT_EQ(b[TRUNC].f, 2.f);
+
+    // The batch math functions must agree with the device functions, with every instruction set they're built for.
+    auto batch = [](void (*fn)(const float *, float *, size_t), float x) {
+        float y = 0.f;
+        fn(&x, &y, 1);
+        return y;
+    };
+    const std::string active_isa = xpu::detail::vmath::kernels().isa;
+    for (const char *isa : {"generic", "avx2", "avx512"}) {
+        if (!xpu::detail::vmath::select(isa)) {
+            continue; // Not supported by this CPU
+        }
+        SCOPED_TRACE(isa);
+        ASSERT_STREQ(xpu::detail::vmath::kernels().isa, isa);
+
+        EXPECT_NEAR(batch(xpu::math::exp, 2.f), b[EXP].f, 1e-4f);
+        EXPECT_NEAR(batch(xpu::math::log, 1.f), b[LOG].f, 1e-7f);
+        EXPECT_NEAR(batch(xpu::math::cos, xpu::pi() / 3.f), b[COS].f, 2e-5f);
+        EXPECT_NEAR(batch(xpu::math::sin, xpu::pi()), b[SIN].f, 1e-7f);
+        EXPECT_NEAR(batch(xpu::math::rsqrt, 4.f), b[RSQRT].f, 2e-4f);
+        EXPECT_FLOAT_EQ(batch(xpu::math::erf, 1.f), b[ERF].f);
+
+        float x = 3.f;
+        float pow = 0.f;
+        xpu::math::pow(&x, &x, &pow, 1);
+        EXPECT_FLOAT_EQ(pow, b[POW].f);
+    }
+    ASSERT_TRUE(xpu::detail::vmath::select(active_isa));
+}
+
+// Distance to the exact result in units of the last place of a float.
+static double ulp_error(float x, double exact) {
+    if (std::isnan(exact)) {
+        return std::isnan(x) ? 0 : std::numeric_limits<double>::infinity();
+    }
+    float rounded = static_cast<float>(exact);
+    if (std::isinf(rounded) || std::isinf(x)) {
+        return x == rounded ? 0 : std::numeric_limits<double>::infinity();
+    }
+    int e = 0;
+    std::frexp(std::max(std::abs(rounded), std::numeric_limits<float>::min()), &e);
+    return std::abs(x - exact) / std::ldexp(1., e - 24);
+}
+
+TEST(XPUTest, CanCallBatchMathFuncs) {
+    constexpr size_t N = 100003; // Not a multiple of the vector width
+    constexpr float inf = std::numeric_limits<float>::infinity();
+    constexpr float nan = std::numeric_limits<float>::quiet_NaN();
+
+    std::mt19937 gen{42};
+    auto random = [&](float lo, float hi) {
+        std::uniform_real_distribution<float> dist{lo, hi};
+        std::vector<float> x(N);
+        for (float &v : x) {
+            v = dist(gen);
+        }
+        return x;
+    };
+
+    auto max_error = [](const std::vector<float> &x, const std::vector<float> &y, double (*exact)(double)) {
+        double err = 0;
+        for (size_t i = 0; i < x.size(); i++) {
+            err = std::max(err, ulp_error(y[i], exact(x[i])));
+        }
+        return err;
+    };
+
+    std::vector<float> y(N);
+    std::vector<float> c(N);
+
+    std::vector<float> x = random(-87.f, 88.7f);
+    xpu::math::exp(x.data(), y.data(), N);
+    EXPECT_LE(max_error(x, y, [](double v) { return std::exp(v); }), 1.5);
+
+    x = random(0.f, 1000.f);
+    xpu::math::log(x.data(), y.data(), N);
+    EXPECT_LE(max_error(x, y, [](double v) { return std::log(v); }), 1.);
+
+    x = random(1e-30f, 1e30f);
+    xpu::math::rsqrt(x.data(), y.data(), N);
+    EXPECT_LE(max_error(x, y, [](double v) { return 1. / std::sqrt(v); }), 1.5);
+
+    x = random(-5.f, 5.f);
+    xpu::math::erf(x.data(), y.data(), N);
+    EXPECT_LE(max_error(x, y, [](double v) { return std::erf(v); }), 1.);
+
+    // Results between 2^-126 and 2^128
+    x = random(0.f, 100.f);
+    std::vector<float> e = random(-19.f, 19.f);
+    xpu::math::pow(x.data(), e.data(), y.data(), N);
+    double pow_error = 0;
+    for (size_t i = 0; i < N; i++) {
+        pow_error = std::max(pow_error, ulp_error(y[i], std::pow(double{x[i]}, double{e[i]})));
+    }
+    EXPECT_LE(pow_error, 1.);
+
+    for (float range : {4.f, 8192.f, 1e6f}) {
+        x = random(-range, range);
+        xpu::math::sin(x.data(), y.data(), N);
+        EXPECT_LE(max_error(x, y, [](double v) { return std::sin(v); }), 2.) << "range = " << range;
+        xpu::math::sincos(x.data(), y.data(), c.data(), N);
+        EXPECT_LE(max_error(x, y, [](double v) { return std::sin(v); }), 2.) << "range = " << range;
+        EXPECT_LE(max_error(x, c, [](double v) { return std::cos(v); }), 2.) << "range = " << range;
+        xpu::math::cos(x.data(), c.data(), N);
+        EXPECT_LE(max_error(x, c, [](double v) { return std::cos(v); }), 2.) << "range = " << range;
+    }
+
+    // Special values, in place
+    std::vector<float> s{0.f, -0.f, -1.f, inf, -inf, nan, 100.f, -110.f};
+    xpu::math::exp(s.data(), s.data(), s.size());
+    EXPECT_EQ(s[0], 1.f);
+    EXPECT_EQ(s[1], 1.f);
+    EXPECT_FLOAT_EQ(s[2], 0.36787944f);
+    EXPECT_EQ(s[3], inf);
+    EXPECT_EQ(s[4], 0.f);
+    EXPECT_TRUE(std::isnan(s[5]));
+    EXPECT_EQ(s[6], inf);
+    EXPECT_EQ(s[7], 0.f);
+
+    s = {0.f, -0.f, -1.f, inf, -inf, nan, 1.f, 1e-40f};
+    xpu::math::log(s.data(), s.data(), s.size());
+    EXPECT_EQ(s[0], -inf);
+    EXPECT_EQ(s[1], -inf);
+    EXPECT_TRUE(std::isnan(s[2]));
+    EXPECT_EQ(s[3], inf);
+    EXPECT_TRUE(std::isnan(s[4]));
+    EXPECT_TRUE(std::isnan(s[5]));
+    EXPECT_EQ(s[6], 0.f);
+    EXPECT_FLOAT_EQ(s[7], -92.103404f);
+
+    s = {0.f, -0.f, inf, nan};
+    std::vector<float> sc(s.size());
+    xpu::math::sincos(s.data(), s.data(), sc.data(), s.size());
+    EXPECT_EQ(s[0], 0.f);
+    EXPECT_EQ(sc[0], 1.f);
+    EXPECT_TRUE(std::signbit(s[1]));
+    EXPECT_EQ(sc[1], 1.f);
+    EXPECT_TRUE(std::isnan(s[2]));
+    EXPECT_TRUE(std::isnan(sc[2]));
+    EXPECT_TRUE(std::isnan(s[3]));
+    EXPECT_TRUE(std::isnan(sc[3]));
+
+    s = {0.f, -0.f, inf, -inf, nan, 0.5f};
+    xpu::math::erf(s.data(), s.data(), s.size());
+    EXPECT_EQ(s[0], 0.f);
+    EXPECT_TRUE(std::signbit(s[1]));
+    EXPECT_EQ(s[2], 1.f);
+    EXPECT_EQ(s[3], -1.f);
+    EXPECT_TRUE(std::isnan(s[4]));
+    EXPECT_FLOAT_EQ(s[5], 0.52049988f);
+
+    // Special values of pow as in C99
+    std::vector<float> px{-2.f, -2.f, -2.f,  -0.f, -0.f, 0.f, -1.f, 1.f, nan, 0.5f, 2.f, -inf, -inf, inf, 1e30f, 2.f};
+    std::vector<float> py{3.f,  2.f,  0.5f,  -1.f, 1.f, -2.f, inf, nan, 0.f, -inf, -inf, 3.f, -2.f, -1.f, 2.f, -1000.f};
+    std::vector<float> pz(px.size());
+    xpu::math::pow(px.data(), py.data(), pz.data(), px.size());
+    for (size_t i = 0; i < px.size(); i++) {
+        float expected = std::pow(px[i], py[i]);
+        if (std::isnan(expected)) {
+            EXPECT_TRUE(std::isnan(pz[i])) << "pow(" << px[i] << ", " << py[i] << ")";
+        } else {
+            EXPECT_EQ(pz[i], expected) << "pow(" << px[i] << ", " << py[i] << ")";
+            EXPECT_EQ(std::signbit(pz[i]), std::signbit(expected)) << "pow(" << px[i] << ", " << py[i] << ")";
+        }
+    }
+
+    // View overloads
+    xpu::buffer<float> buf{16, xpu::buf_host};
+    xpu::h_view<float> v{buf};
+    for (size_t i = 0; i < v.size(); i++) {
+        v[i] = static_cast<float>(i);
+    }
+    xpu::math::rsqrt(v, v);
+    EXPECT_EQ(v[0], inf);
+    EXPECT_FLOAT_EQ(v[4], 0.5f);
+
+    xpu::buffer<float> small{8, xpu::buf_host};
+    EXPECT_THROW(xpu::math::exp(v, xpu::h_view<float>{small}), std::length_error);
+    EXPECT_THROW(xpu::math::pow(v, xpu::h_view<float>{small}, v), std::length_error);
 }
 
 TEST(XPUTest, CanRunTemplatedKernels) {
@@ -712,6 +1772,111 @@ TEST(XPUTest, CollectsTimingData) {
     }
 
     ASSERT_FLOAT_EQ(ts.kernel_time(), timings0.total() + timings1.total());
+
+    ASSERT_EQ(timings0.count(), NRuns);
+    ASSERT_LE(timings0.min(), timings0.percentile(0.5));
+    ASSERT_LE(timings0.percentile(0.5), timings0.percentile(0.99));
+    ASSERT_LE(timings0.percentile(0.99), timings0.max());
+}
+
+TEST(XPUTest, CountsHardwareEventsOnCPU) {
+    if (xpu::device::active().backend() != xpu::cpu) {
+        GTEST_SKIP() << "Hardware counters are only collected on the CPU";
+    }
+
+    constexpr int NElems = 1000000;
+    xpu::buffer<float> a{NElems, xpu::buf_device};
+    xpu::buffer<float> b{NElems, xpu::buf_device};
+    xpu::buffer<float> c{NElems, xpu::buf_device};
+    xpu::queue q;
+    q.memset(a, 0);
+    q.memset(b, 0);
+
+    xpu::detail::config::perf_counters = true;
+    xpu::push_timer("counters");
+    q.launch<vector_add_timing0>(xpu::n_threads(NElems), a.get(), b.get(), c.get(), NElems);
+    q.launch<vector_add_timing0>(xpu::n_threads(NElems), a.get(), b.get(), c.get(), NElems);
+    q.wait();
+    xpu::timings ts = xpu::pop_timer();
+    xpu::detail::config::perf_counters = false;
+
+    xpu::kernel_timings k = ts.kernel<vector_add_timing0>();
+    ASSERT_EQ(k.count(), 2);
+    if (not k.has_counters()) {
+        GTEST_SKIP() << "Hardware counters not available";
+    }
+    ASSERT_GT(k.cycles(), 0);
+    ASSERT_GT(k.instructions(), 0);
+    ASSERT_GT(k.ipc(), 0);
+    ASSERT_LE(k.llc_miss_rate(), 1);
+    ASSERT_GE(k.memory_bandwidth(), 0);
+}
+
+TEST(XPUTest, CanComputeTimePercentiles) {
+    xpu::detail::time_histogram a, b;
+    for (int i = 1; i <= 1000; i++) {
+        (i % 2 == 0 ? a : b).add(i * 1e-3); // 1us to 1ms
+    }
+    a.merge(b);
+
+    ASSERT_EQ(a.count, 1000);
+    ASSERT_DOUBLE_EQ(a.min, 1e-3);
+    ASSERT_DOUBLE_EQ(a.max, 1.);
+    ASSERT_NEAR(a.sum, 500.5, 1e-9);
+    ASSERT_NEAR(a.percentile(0.5), 0.5, 0.5 * 0.03);
+    ASSERT_NEAR(a.percentile(0.9), 0.9, 0.9 * 0.03);
+    ASSERT_NEAR(a.percentile(0.99), 0.99, 0.99 * 0.03);
+    ASSERT_NEAR(a.percentile(0.999), 0.999, 0.999 * 0.03);
+    ASSERT_DOUBLE_EQ(a.percentile(1), 1.);
+    ASSERT_LE(a.buckets.size(), xpu::detail::time_histogram::max_buckets);
+
+    // Long times go into the last bucket
+    a.add(1e9);
+    ASSERT_EQ(a.buckets.size(), xpu::detail::time_histogram::max_buckets);
+    ASSERT_DOUBLE_EQ(a.percentile(1), 1e9);
+}
+
+TEST(XPUTest, KeepsTimersPerThread) {
+    static constexpr int NRuns = 5;
+    static constexpr int NElems = 1000;
+
+    auto run = [](int id, xpu::timings &outer, xpu::timings &inner) {
+        xpu::buffer<float> a{NElems, xpu::buf_device};
+        xpu::buffer<float> b{NElems, xpu::buf_device};
+        xpu::buffer<float> c{NElems, xpu::buf_device};
+        xpu::queue q;
+
+        xpu::push_timer("outer" + std::to_string(id));
+        xpu::push_timer("inner");
+        for (int i = 0; i < NRuns; i++) {
+            q.launch<vector_add_timing0>(xpu::n_threads(NElems), a.get(), b.get(), c.get(), NElems);
+        }
+        q.wait();
+        inner = xpu::pop_timer();
+        q.launch<vector_add_timing1>(xpu::n_threads(NElems), a.get(), b.get(), c.get(), NElems);
+        q.wait();
+        outer = xpu::pop_timer();
+    };
+
+    xpu::timings outer[2], inner[2];
+    std::thread t0{run, 0, std::ref(outer[0]), std::ref(inner[0])};
+    std::thread t1{run, 1, std::ref(outer[1]), std::ref(inner[1])};
+    t0.join();
+    t1.join();
+
+    for (int i = 0; i < 2; i++) {
+        ASSERT_EQ(std::string{outer[i].name()}, "outer" + std::to_string(i));
+        ASSERT_EQ(outer[i].children().size(), 1);
+        ASSERT_EQ(outer[i].children()[0].name(), "inner");
+
+        ASSERT_EQ(inner[i].kernel<vector_add_timing0>().count(), NRuns);
+        ASSERT_EQ(inner[i].kernel<vector_add_timing1>().count(), 0);
+
+        // Times of the inner timer are merged into the outer one
+        ASSERT_EQ(outer[i].kernel<vector_add_timing0>().count(), NRuns);
+        ASSERT_EQ(outer[i].kernel<vector_add_timing1>().count(), 1);
+        ASSERT_FLOAT_EQ(outer[i].kernel<vector_add_timing0>().total(), inner[i].kernel<vector_add_timing0>().total());
+    }
 }
 
 TEST(XPUTest, CanCallImageFunction) {
@@ -727,6 +1892,7 @@ int main(int argc, char **argv) {
     ::testing::InitGoogleTest(&argc, argv);
     xpu::settings settings{};
     settings.profile = true; // Always enable profiling for tests
+    settings.profile_samples = true;
     xpu::initialize(settings);
     int ret = RUN_ALL_TESTS();
 